@@ -8,7 +8,9 @@
 #include <TopExp_Explorer.hxx>
 
 #include "geometry.hpp"
+#include "properties_file.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
 
 int
@@ -16,7 +18,10 @@ main(int argc, char **argv)
 {
 	configure_aixlog();
 
+	profile_writer profile;
+
 	std::string path_in, path_out;
+	unsigned num_parallel_jobs = 1;
 
 	{
 		const char *doc = "Flatten contents of BREP file, producing a file usable by other tools.";
@@ -24,6 +29,9 @@ main(int argc, char **argv)
 
 		tool_argp_parser argp(2);
 
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+
 		if (!argp.parse(argc, argv, usage, doc)) {
 			return 1;
 		}
@@ -51,5 +59,10 @@ main(int argc, char **argv)
 
 	doc.write_brep_file(path_out.c_str());
 
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
+	write_properties_file(path_out, compute_properties(doc, pool));
+
 	return 0;
 }
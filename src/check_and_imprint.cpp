@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iomanip>
+#include <ios>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cxx_argp_parser.h>
+#include <aixlog.hpp>
+
+#include "geometry.hpp"
+#include "pair_checker.hpp"
+#include "properties_file.hpp"
+#include "utils.hpp"
+#include "thread_pool.hpp"
+
+
+// checks and imprints share the pool, so results of both come back through
+// the same asyncmap
+struct stage_output {
+	size_t pair;
+	bool is_imprint;
+
+	worker_output check;
+	imprint_result imprint;
+};
+
+static bool
+should_imprint(intersect_status status)
+{
+	switch (status) {
+	case intersect_status::touching:
+	case intersect_status::overlap:
+		return true;
+	case intersect_status::failed:
+	case intersect_status::timeout:
+	case intersect_status::distinct:
+		break;
+	}
+	return false;
+}
+
+// returns false if the imprint failed, in which case the shapes shouldn't be
+// used
+static bool
+log_imprint_result(size_t first, size_t second, const imprint_result &res)
+{
+	const auto hi_lo = indexpair_to_string(first, second);
+
+	switch(res.status) {
+	case imprint_status::failed:
+		LOG(ERROR) << hi_lo << " failed to imprint\n";
+		return false;
+	case imprint_status::distinct:
+		LOG(DEBUG) << hi_lo << " were mostly distinct\n";
+		break;
+	case imprint_status::merge_into_shape:
+		LOG(INFO)
+			<< hi_lo << " were imprinted, "
+			<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
+			<< " was merged into " << first << '\n';
+		break;
+	case imprint_status::merge_into_tool:
+		LOG(INFO)
+			<< hi_lo << " were imprinted, "
+			<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
+			<< " was merged into " << second << '\n';
+		break;
+	}
+	return true;
+}
+
+int
+main(int argc, char **argv)
+{
+	configure_aixlog();
+
+	profile_writer profile;
+
+	std::string path_in, path_out;
+	bool enable_intel_tbb = false;
+	unsigned num_parallel_jobs = 1;
+	unsigned pave_time_seconds = 60;
+	bool distance_prefilter = false;
+	unsigned distance_time_millisecs = 1000;
+	bool fast_classification = false;
+	double
+		bbox_clearance = 0.5,
+		max_common_volume_ratio = 0.01;
+	std::vector<double> imprint_tolerances = {0.001, 0};
+
+	{
+		const char * doc = (
+			"Find all pairwise intersections between solids and imprint them, writing results to BREP file.\n"
+			"\n"
+			"Equivalent to running overlap_checker and passing its output, sorted by "
+			"index, to imprint_solids. Pairs are imprinted as soon as they have been "
+			"checked and any earlier pairs involving the same solids are done, so "
+			"imprinting happens alongside checking. The same CSV output as overlap_checker "
+			"is written to stdout.");
+		const char * usage = "input.brep output.brep";
+
+		std::stringstream stream;
+
+		stream << "Bounding-boxes closer than C[=" << bbox_clearance << "] will be checked for overlaps";
+		auto help_bbox_cl = stream.str();
+		stream = {};
+
+		stream
+			<< "Faces, edges, and verticies will be merged when closer than T[="
+			<< imprint_tolerances[0] << ']';
+		auto help_imp_tol = stream.str();
+		stream = {};
+
+		stream
+			<< "Imprinted volume with ratio <R[="
+			<< max_common_volume_ratio << "] is considered acceptable";
+		auto help_max_common = stream.str();
+		stream = {};
+
+		stream
+			<< "Amount of time, T[=" << pave_time_seconds << "] seconds, "
+			<< "to allow for computing one pair-wise intersection";
+		auto help_pave_time_seconds = stream.str();
+		stream = {};
+
+		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+		argp.add_distance_prefilter_option(distance_prefilter, distance_time_millisecs);
+		argp.add_option(
+			{"bbox-clearance", 1024, "C", 0, help_bbox_cl.c_str(), 0}, bbox_clearance);
+		argp.add_option(
+			{"imprint-tolerance", 1025, "T", 0, help_imp_tol.c_str(), 0}, imprint_tolerances);
+		argp.add_option(
+			{"max-common-volume-ratio", 1026, "R", 0, help_max_common.c_str(), 0}, max_common_volume_ratio);
+		argp.add_option(
+			{"enable-intel_tbb", 1027, 0, 0, "Enable OCCT use of Intel TBB, disabled by default as it gets in the way of our parallelism", -1}, enable_intel_tbb);
+		argp.add_option(
+			{"fast-classification", 1033, 0, 0, "Derive cut volumes of overlapping pairs from solid volumes rather than building the cuts", -1},
+			fast_classification);
+		argp.add_option(
+			{"time-per-pair", 1028, "T", 0, help_pave_time_seconds.c_str(), -1}, pave_time_seconds);
+
+		if (!argp.parse(argc, argv, usage, doc)) {
+			return 1;
+		}
+
+		const auto &args = argp.arguments();
+		assert(args.size() == 2);
+		path_in = args[0];
+		path_out = args[1];
+
+		for (const auto tolerance : imprint_tolerances) {
+			if (tolerance < 0) {
+				LOG(ERROR)
+					<< "Imprinting tolerance should not be negative, "
+					<< tolerance << " < 0\n";
+				return 1;
+			}
+
+			if (bbox_clearance < tolerance) {
+				LOG(WARNING)
+					<< "Bounding-box clearance smaller than imprinting tolerance, "
+					<< bbox_clearance << " < " << tolerance << '\n';
+			}
+		}
+
+		if (!(max_common_volume_ratio >= 0 && max_common_volume_ratio <= 1)) {
+			LOG(ERROR)
+				<< "Maximum common volume ratio should be in (0, 1).\n";
+			return 1;
+		}
+	}
+
+	configure_occt_threads(enable_intel_tbb);
+
+	// checks are done against the original solids, as overlap_checker would
+	document doc;
+	doc.load_brep_file(path_in.c_str());
+	document imprinted{doc};
+
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
+	auto props = load_or_compute_properties(doc, path_in, pool);
+
+	const auto candidates = find_candidate_pairs(props, bbox_clearance);
+	const auto &pairs = candidates.pairs;
+
+	// pairs are imprinted in index order, like imprint_solids given sorted
+	// input, so the output doesn't depend on which checks finish first
+	pair_sequencer sequencer{pairs};
+
+	result_reporter reporter{props, max_common_volume_ratio, pave_time_seconds};
+
+	unsigned long
+		num_checked = 0,
+		num_imprinted = 0,
+		num_imprint_failed = 0;
+
+	std::vector<size_t> modified;
+
+	{
+		struct worker_state state{doc, imprint_tolerances, pave_time_seconds * 1000};
+		state.distance_prefilter = distance_prefilter;
+		state.distance_time_millisecs = distance_time_millisecs;
+		state.derive_cut_volumes = fast_classification;
+		state.solids = &props;
+		asyncmap<stage_output> map;
+
+		auto submit_imprints = [&map, &pool, &imprinted, &pairs](const std::vector<size_t> &ready) {
+			for (const auto i : ready) {
+				map.submit(pool, [&imprinted, &pairs, i]() {
+					stage_output output{i, true, {}, {}};
+					output.imprint = perform_solid_imprinting(
+						imprinted.solid_shapes[pairs[i].first],
+						imprinted.solid_shapes[pairs[i].second],
+						0.01);
+					return output;
+				});
+			}
+		};
+
+		for (const auto i : order_by_decreasing_cost(candidates.costs)) {
+			map.submit(pool, [&state, &pairs, i, cost = candidates.costs[i]]() {
+				stage_output output{i, false, {}, {}};
+				output.check = classify_pair(state, pairs[i].first, pairs[i].second);
+				output.check.predicted_cost = cost;
+				return output;
+			});
+		}
+
+		LOG(INFO) << "checking for overlaps between " << pairs.size() << " pairs\n";
+
+		const std::chrono::seconds reporting_interval{5};
+		auto report_when = std::chrono::steady_clock::now() + reporting_interval;
+
+		profile_scope checking{"check and imprint pairs"};
+		while (!map.empty()) {
+			stage_output output = map.get();
+
+			// something weird is causing this to get set to hex formatting,
+			// reset it here
+			LOG(INFO) << std::dec;
+
+			if (report_when < std::chrono::steady_clock::now()) {
+				LOG(INFO)
+					<< "checked " << num_checked << " of " << pairs.size() << " pairs, "
+					<< sequencer.num_completed() << " pairs finished with\n";
+
+				report_when += reporting_interval;
+			}
+
+			if (!output.is_imprint) {
+				num_checked += 1;
+				reporter.report(output.check);
+
+				submit_imprints(sequencer.resolve(
+					output.pair, should_imprint(output.check.result.status)));
+				continue;
+			}
+
+			const size_t first = pairs[output.pair].first, second = pairs[output.pair].second;
+			if (log_imprint_result(first, second, output.imprint)) {
+				imprinted.solid_shapes[first] = output.imprint.shape;
+				imprinted.solid_shapes[second] = output.imprint.tool;
+				modified.push_back(first);
+				modified.push_back(second);
+				num_imprinted += 1;
+			} else {
+				// carry on so everything gets reported, but the output
+				// won't be written
+				num_imprint_failed += 1;
+			}
+
+			submit_imprints(sequencer.finish(output.pair));
+		}
+	}
+
+	assert(sequencer.done());
+
+	LOG(INFO)
+		<< "processing summary: "
+		<< "bbox tests=" << candidates.num_bbox_tests << ", "
+		<< "intersection tests=" << num_checked << ", "
+		<< "skipped by distance=" << reporter.num_distance_skipped << ", "
+		<< "touching=" << reporter.num_touching << ", "
+		<< "overlapping=" << reporter.num_overlaps << ", "
+		<< "bad overlaps=" << reporter.num_bad_overlaps << ", "
+		<< "tests failed=" << reporter.num_failed << ", "
+		<< "imprinted=" << num_imprinted << ", "
+		<< "imprints failed=" << num_imprint_failed << '\n';
+
+	if (num_imprint_failed > 0) {
+		LOG(FATAL) << "failed to imprint " << num_imprint_failed << " shapes\n";
+		return 1;
+	}
+
+	imprinted.write_brep_file(path_out.c_str());
+
+	std::sort(modified.begin(), modified.end());
+	modified.erase(std::unique(modified.begin(), modified.end()), modified.end());
+	update_properties(imprinted, modified, props, pool);
+	write_properties_file(path_out, props);
+
+	if (reporter.num_failed || reporter.num_bad_overlaps) {
+		LOG(ERROR)
+			<< "errors occurred while processing: "
+			<< "intersection tests failed=" << reporter.num_failed << ", "
+			<< "overlapped by too much=" << reporter.num_bad_overlaps << '\n';
+		return 1;
+	}
+
+	return 0;
+}
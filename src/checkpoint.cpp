@@ -0,0 +1,310 @@
+#include <ios>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef INCLUDE_TESTS
+#include <catch2/catch_test_macros.hpp>
+#endif
+
+#include <aixlog.hpp>
+
+#include "checkpoint.hpp"
+#include "result_cache.hpp"
+#include "utils.hpp"
+
+
+static const char *journal_magic = "overlap_checker journal 1";
+
+// bits of the flags field
+static const unsigned
+	skipped_by_distance_flag = 1,
+	skipped_by_split_flag = 2,
+	ran_parallel_flag = 4,
+	approximated_flag = 8,
+	worker_died_flag = 16,
+	cached_flag = 32,
+	reused_context_flag = 64;
+
+// index, hi, lo, result fields, then elapsed_seconds, predicted_cost, flags,
+// tolerance_index and failed_tolerances
+static const size_t num_entry_fields = 3 + num_result_fields + 5;
+
+static bool
+parse_entry(const std::vector<std::string> &fields, size_t &index, worker_output &output, bool &cached)
+{
+	const size_t rest = 3 + num_result_fields;
+	size_t flags, failed;
+	if (!(fields.size() == num_entry_fields &&
+		  size_t_of_string(fields[0].c_str(), index, 10) &&
+		  size_t_of_string(fields[1].c_str(), output.hi, 10) &&
+		  size_t_of_string(fields[2].c_str(), output.lo, 10) &&
+		  parse_result_fields(fields, 3, output.result) &&
+		  double_of_string(fields[rest], output.elapsed_seconds) &&
+		  double_of_string(fields[rest + 1], output.predicted_cost) &&
+		  size_t_of_string(fields[rest + 2].c_str(), flags, 10) &&
+		  int_of_string(fields[rest + 3].c_str(), output.tolerance_index, 10) &&
+		  size_t_of_string(fields[rest + 4].c_str(), failed, 10))) {
+		return false;
+	}
+
+	output.skipped_by_distance = flags & skipped_by_distance_flag;
+	output.skipped_by_split = flags & skipped_by_split_flag;
+	output.ran_parallel = flags & ran_parallel_flag;
+	output.approximated = flags & approximated_flag;
+	output.worker_died = flags & worker_died_flag;
+	output.reused_context = flags & reused_context_flag;
+	output.failed_tolerances = uint32_t(failed);
+	cached = flags & cached_flag;
+	return true;
+}
+
+checkpoint_journal::~checkpoint_journal()
+{
+	if (file.is_open()) {
+		file.flush();
+	}
+}
+
+bool
+checkpoint_journal::open(const char *path, uint64_t fingerprint, bool resume)
+{
+	std::stringstream header;
+	header << journal_magic << ',' << std::hex << fingerprint;
+
+	bool exists = false, needs_newline = false;
+	if (resume) {
+		size_t num_invalid = 0;
+
+		std::ifstream input{path};
+		std::string line;
+		if (std::getline(input, line)) {
+			exists = true;
+			if (line != header.str()) {
+				LOG(FATAL)
+					<< "checkpoint " << path << " is from a different model, "
+					<< "set of pairs or settings\n";
+				return false;
+			}
+		}
+
+		while (std::getline(input, line)) {
+			size_t index;
+			entry e{{0, 0, {}}, false};
+			if (!parse_entry(parse_csv_row(line), index, e.output, e.cached)) {
+				num_invalid += 1;
+				continue;
+			}
+			entries[index] = e;
+		}
+
+		// killed part way through writing a line
+		if (input.eof() && !line.empty()) {
+			needs_newline = true;
+		}
+
+		if (num_invalid > 1 || (num_invalid == 1 && !needs_newline)) {
+			LOG(WARNING)
+				<< "ignoring " << num_invalid << " invalid lines in checkpoint " << path << '\n';
+		}
+		LOG(DEBUG) << "loaded " << entries.size() << " pairs from checkpoint " << path << '\n';
+	}
+
+	if (exists) {
+		file.open(path, std::ios::app);
+	} else {
+		file.open(path, std::ios::trunc);
+	}
+	if (!file.is_open()) {
+		LOG(FATAL) << "unable to open checkpoint " << path << '\n';
+		return false;
+	}
+
+	if (!exists) {
+		file << header.str() << '\n';
+	} else if (needs_newline) {
+		file << '\n';
+	}
+	file.flush();
+	last_flush = clock::now();
+	if (!file) {
+		LOG(FATAL) << "unable to write checkpoint " << path << '\n';
+		return false;
+	}
+	return true;
+}
+
+bool
+checkpoint_journal::lookup(size_t index, worker_output &output, bool &cached) const
+{
+	const auto it = entries.find(index);
+	if (it == entries.end()) {
+		return false;
+	}
+	output = it->second.output;
+	cached = it->second.cached;
+	return true;
+}
+
+void
+checkpoint_journal::record(size_t index, const worker_output &output, bool cached)
+{
+	if (!file.is_open()) {
+		return;
+	}
+
+	const unsigned flags =
+		(output.skipped_by_distance ? skipped_by_distance_flag : 0u) |
+		(output.skipped_by_split ? skipped_by_split_flag : 0u) |
+		(output.ran_parallel ? ran_parallel_flag : 0u) |
+		(output.approximated ? approximated_flag : 0u) |
+		(output.worker_died ? worker_died_flag : 0u) |
+		(output.reused_context ? reused_context_flag : 0u) |
+		(cached ? cached_flag : 0u);
+
+	file << index << ',' << output.hi << ',' << output.lo << ',';
+	write_result_fields(file, output.result);
+	file
+		<< ',' << std::hexfloat
+		<< output.elapsed_seconds << ','
+		<< output.predicted_cost << ','
+		<< std::defaultfloat
+		<< flags << ','
+		<< output.tolerance_index << ','
+		<< output.failed_tolerances << '\n';
+
+	// at most flush_interval of work is lost if we're killed
+	const auto now = clock::now();
+	if (now - last_flush >= flush_interval) {
+		file.flush();
+		last_flush = now;
+	}
+}
+
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("checkpoint_journal") {
+	const temp_file file{"checkpoint_test"};
+	const char *path = file.path();
+
+	worker_output paved{9, 2, {
+		intersect_status::overlap, 1e-6, 0, 4, 1, 0.3, 7.25, 1e-12, 0.2,
+	}};
+	paved.elapsed_seconds = 3.1;
+	paved.predicted_cost = 0.7;
+	paved.ran_parallel = true;
+	paved.reused_context = true;
+	paved.approximated = true;
+	paved.tolerance_index = 2;
+	paved.failed_tolerances = 5;
+
+	worker_output near{6, 0, {}};
+	near.result.status = intersect_status::distinct;
+	near.skipped_by_distance = true;
+
+	worker_output split{8, 6, {}};
+	split.result.status = intersect_status::distinct;
+	split.skipped_by_split = true;
+
+	worker_output died{4, 3, {}};
+	died.result.status = intersect_status::failed;
+	died.worker_died = true;
+	died.tolerance_index = 0;
+	died.failed_tolerances = 1;
+
+	{
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xfeed, false));
+		journal.record(0, paved, false);
+		journal.record(3, near, true);
+		journal.record(1, split, false);
+	}
+
+	{
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xfeed, true));
+		CHECK(journal.size() == 3);
+
+		worker_output res{0, 0, {}};
+		bool cached = true;
+		REQUIRE(journal.lookup(0, res, cached));
+		CHECK_FALSE(cached);
+		CHECK((res.hi == 9 && res.lo == 2));
+		CHECK(res.result.status == intersect_status::overlap);
+		CHECK(res.result.fuzzy_value == paved.result.fuzzy_value);
+		CHECK(res.result.num_common_warnings == 4);
+		CHECK(res.result.vol_common == paved.result.vol_common);
+		CHECK(res.result.vol_cut12 == paved.result.vol_cut12);
+		CHECK(res.result.pave_time_seconds == paved.result.pave_time_seconds);
+		// written as hexfloat, so exact
+		CHECK(res.elapsed_seconds == paved.elapsed_seconds);
+		CHECK(res.predicted_cost == paved.predicted_cost);
+		CHECK((res.ran_parallel && res.reused_context && res.approximated));
+		CHECK_FALSE((res.skipped_by_distance || res.skipped_by_split || res.worker_died));
+		CHECK(res.tolerance_index == 2);
+		CHECK(res.failed_tolerances == 5);
+
+		REQUIRE(journal.lookup(3, res, cached));
+		CHECK(cached);
+		CHECK(res.result.status == intersect_status::distinct);
+		CHECK(res.skipped_by_distance);
+		CHECK_FALSE((res.skipped_by_split || res.ran_parallel || res.reused_context));
+		CHECK(res.tolerance_index == -1);
+
+		REQUIRE(journal.lookup(1, res, cached));
+		CHECK_FALSE(cached);
+		CHECK(res.skipped_by_split);
+		CHECK_FALSE(res.skipped_by_distance);
+
+		CHECK_FALSE(journal.lookup(2, res, cached));
+	}
+
+	{
+		// killed part way through writing a line
+		std::ofstream out{path, std::ios::app};
+		out << "5,7,1,overlap,0x1p-";
+	}
+
+	{
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xfeed, true));
+		CHECK(journal.size() == 3);
+		// starts on a line of its own
+		journal.record(5, died, false);
+	}
+
+	{
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xfeed, true));
+		CHECK(journal.size() == 4);
+
+		worker_output res{0, 0, {}};
+		bool cached = true;
+		REQUIRE(journal.lookup(5, res, cached));
+		CHECK((res.hi == 4 && res.lo == 3));
+		CHECK(res.result.status == intersect_status::failed);
+		CHECK(res.worker_died);
+		CHECK(res.tolerance_index == 0);
+		CHECK(res.failed_tolerances == 1);
+	}
+
+	{
+		// another model or settings
+		checkpoint_journal journal;
+		CHECK_FALSE(journal.open(path, 0xbeef, true));
+	}
+
+	{
+		// without resume, starts again
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xbeef, false));
+		CHECK(journal.size() == 0);
+	}
+
+	{
+		checkpoint_journal journal;
+		REQUIRE(journal.open(path, 0xbeef, true));
+		CHECK(journal.size() == 0);
+	}
+}
+#endif
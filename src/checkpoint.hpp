@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <unordered_map>
+
+#include "pair_checker.hpp"
+
+
+/* journal of the pairs overlap_checker has finished, so a run that was
+ * interrupted can be resumed without checking them again.
+ *
+ * the first line identifies the run, see the fingerprint passed to open, and
+ * is followed by a CSV line for each pair with its index among the candidate
+ * pairs and everything result_reporter uses, so resuming reproduces the same
+ * output and summary. lines are flushed every flush_interval rather than
+ * after each pair, as there can be millions of them.
+ */
+class checkpoint_journal {
+	using clock = std::chrono::steady_clock;
+
+	struct entry {
+		worker_output output;
+		bool cached;
+	};
+
+	std::unordered_map<size_t, entry> entries;
+	std::ofstream file;
+	clock::duration flush_interval;
+	clock::time_point last_flush;
+
+public:
+	explicit checkpoint_journal(
+		clock::duration flush_interval = std::chrono::seconds{10}) :
+		flush_interval{flush_interval} {}
+
+	~checkpoint_journal();
+
+	// starts a new journal, or with resume loads the pairs finished by a
+	// previous run and appends to it. logs and returns false if it can't be
+	// written, or was written by a run with a different fingerprint
+	bool open(const char *path, uint64_t fingerprint, bool resume);
+
+	// only finds pairs loaded by open, cached is set if the result came from
+	// the result cache
+	bool lookup(size_t index, worker_output &output, bool &cached) const;
+
+	void record(size_t index, const worker_output &output, bool cached);
+
+	size_t size() const {
+		return entries.size();
+	}
+};
@@ -1,9 +1,16 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <limits>
+#include <map>
 #include <memory>
 #include <set>
+#include <sstream>
 #include <stdexcept>
+#include <unordered_map>
 #include <sys/types.h>
 
 #ifdef INCLUDE_TESTS
@@ -11,16 +18,26 @@
 #include <catch2/catch_approx.hpp>
 #endif
 
+#include <BOPAlgo_CellsBuilder.hxx>
 #include <BOPAlgo_PaveFiller.hxx>
+#include <BOPDS_DS.hxx>
 #include <BOPAlgo_Operation.hxx>
 
 #include <TopAbs_ShapeEnum.hxx>
+#include <TopExp.hxx>
 #include <TopExp_Explorer.hxx>
+#include <TopTools_IndexedMapOfShape.hxx>
+#include <TopoDS.hxx>
 
+#include <BRepAdaptor_Surface.hxx>
+#include <BRepBndLib.hxx>
+#include <BRepBuilderAPI_Copy.hxx>
 #include <BRepTools.hxx>
 #include <BRep_Builder.hxx>
+#include <BRep_Tool.hxx>
 
 #include <BRepCheck_Analyzer.hxx>
+#include <BRepClass3d_SolidClassifier.hxx>
 
 #include <BRepExtrema_DistShapeShape.hxx>
 
@@ -30,6 +47,7 @@
 #include <TopoDS_Builder.hxx>
 #include <TopoDS_Shape.hxx>
 #include <TopoDS_CompSolid.hxx>
+#include <TopoDS_Compound.hxx>
 
 #include <Message_ProgressIndicator.hxx>
 #include <Message_ProgressRange.hxx>
@@ -37,10 +55,17 @@
 #include <Message_Report.hxx>
 #include <Message_Gravity.hxx>
 
+#include <NCollection_IncAllocator.hxx>
+
+#include <Standard_Version.hxx>
+
 #include <aixlog.hpp>
 
 #include "geometry.hpp"
+#include "indexed_brep.hpp"
+#include "profiling.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
 
 std::ostream&
@@ -141,9 +166,258 @@ distance_between_shapes(const TopoDS_Shape& a, const TopoDS_Shape& b)
 	std::abort();
 }
 
+uint64_t
+hash_of_shape(const TopoDS_Shape& shape)
+{
+	std::ostringstream stream;
+	BRepTools::Write(shape, stream);
+	return hash_of_string(stream.str());
+}
+
+solid_properties
+properties_of_solid(const TopoDS_Shape& shape)
+{
+	return properties_of_solid(shape, volume_of_shape(shape));
+}
+
+solid_properties
+properties_of_solid(const TopoDS_Shape& shape, double volume)
+{
+	profile_scope scope{"solid properties"};
+	solid_properties props;
+
+	BRepBndLib::AddOBB(shape, props.obb);
+	// triangulation isn't needed, and might not exist yet
+	BRepBndLib::Add(shape, props.aabb, false);
+	props.volume = volume;
+
+	TopTools_IndexedMapOfShape faces, edges, verticies;
+	TopExp::MapShapes(shape, TopAbs_FACE, faces);
+	TopExp::MapShapes(shape, TopAbs_EDGE, edges);
+	TopExp::MapShapes(shape, TopAbs_VERTEX, verticies);
+	props.num_faces = faces.Extent();
+	props.num_edges = edges.Extent();
+	props.num_verticies = verticies.Extent();
+
+	props.num_curved_faces = 0;
+	for (int i = 1; i <= faces.Extent(); i++) {
+		// don't need the surface restricted to the face, just its type
+		const BRepAdaptor_Surface surface{TopoDS::Face(faces(i)), false};
+		if (surface.GetType() != GeomAbs_Plane) {
+			props.num_curved_faces += 1;
+		}
+	}
+
+	return props;
+}
+
+uint32_t
+surface_types_of_shape(const TopoDS_Shape& shape)
+{
+	uint32_t result = 0;
+	for (TopExp_Explorer ex{shape, TopAbs_FACE}; ex.More(); ex.Next()) {
+		const BRepAdaptor_Surface surface{TopoDS::Face(ex.Current()), false};
+		result |= uint32_t{1} << unsigned(surface.GetType());
+	}
+	return result;
+}
+
+double
+estimate_intersection_cost(
+	const solid_properties &a, double bbox_volume_a,
+	const solid_properties &b, double bbox_volume_b,
+	double overlap)
+{
+	// how much of each solid is near the other. surfaces cross a small
+	// overlap more often than its volume would suggest, hence the cube root
+	auto fraction_near = [overlap](double bbox_volume) {
+		if (!(bbox_volume > 0) || overlap >= bbox_volume) {
+			return 1.;
+		}
+		return std::cbrt(std::max(overlap, 0.) / bbox_volume);
+	};
+	const double
+		frac_a = fraction_near(bbox_volume_a),
+		frac_b = fraction_near(bbox_volume_b);
+
+	// intersecting curved surfaces needs iterative methods, while planes
+	// have closed form solutions
+	auto weighted_faces = [](const solid_properties &p) {
+		return (p.num_faces - p.num_curved_faces) + 4. * p.num_curved_faces;
+	};
+
+	// every face of one solid is potentially intersected with every face of
+	// the other, then edges are split against the results
+	return
+		(1 + weighted_faces(a) * frac_a) * (1 + weighted_faces(b) * frac_b) +
+		a.num_edges * frac_a + b.num_edges * frac_b;
+}
+
+std::vector<std::pair<size_t, size_t>>
+overlapping_bbox_pairs(const std::vector<Bnd_Box> &boxes)
+{
+	struct extent {
+		std::array<double, 3> min, max;
+		size_t index;
+	};
+
+	std::vector<extent> extents;
+	extents.reserve(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++) {
+		const auto &box = boxes[i];
+		if (box.IsVoid()) {
+			continue;
+		}
+		extent ext;
+		box.Get(
+			ext.min[0], ext.min[1], ext.min[2],
+			ext.max[0], ext.max[1], ext.max[2]);
+		ext.index = i;
+		extents.push_back(ext);
+	}
+
+	if (extents.empty()) {
+		return {};
+	}
+
+	// sweep along the axis where the boxes are most spread out, models like
+	// a tokamak tend to be long and thin in at least one direction
+	size_t axis = 0;
+	{
+		std::array<double, 3> lo, hi;
+		lo.fill(std::numeric_limits<double>::infinity());
+		hi.fill(-std::numeric_limits<double>::infinity());
+		for (const auto &ext : extents) {
+			for (size_t i = 0; i < 3; i++) {
+				lo[i] = std::min(lo[i], ext.min[i]);
+				hi[i] = std::max(hi[i], ext.max[i]);
+			}
+		}
+		for (size_t i = 1; i < 3; i++) {
+			if (hi[i] - lo[i] > hi[axis] - lo[axis]) {
+				axis = i;
+			}
+		}
+	}
+
+	std::sort(
+		extents.begin(), extents.end(),
+		[axis](const extent &a, const extent &b) {
+			return a.min[axis] < b.min[axis];
+		});
+
+	const size_t ax1 = (axis + 1) % 3, ax2 = (axis + 2) % 3;
+
+	std::vector<std::pair<size_t, size_t>> pairs;
+	for (auto a = extents.begin(); a != extents.end(); ++a) {
+		// only boxes starting before this one ends can overlap with it
+		for (auto b = a + 1; b != extents.end() && b->min[axis] <= a->max[axis]; ++b) {
+			if (b->min[ax1] > a->max[ax1] || a->min[ax1] > b->max[ax1] ||
+				b->min[ax2] > a->max[ax2] || a->min[ax2] > b->max[ax2]) {
+				continue;
+			}
+			pairs.emplace_back(
+				std::max(a->index, b->index),
+				std::min(a->index, b->index));
+		}
+	}
+
+	std::sort(pairs.begin(), pairs.end());
+
+	return pairs;
+}
+
+#ifdef INCLUDE_TESTS
+static inline Bnd_Box
+bbox_of(double x, double y, double z, double length)
+{
+	Bnd_Box box;
+	box.Update(x, y, z, x + length, y + length, z + length);
+	return box;
+}
+
+TEST_CASE("overlapping_bbox_pairs") {
+	using pairs = std::vector<std::pair<size_t, size_t>>;
+
+	SECTION("nothing to do") {
+		CHECK(overlapping_bbox_pairs({}).empty());
+		CHECK(overlapping_bbox_pairs({bbox_of(0, 0, 0, 1)}).empty());
+	}
+
+	SECTION("distinct boxes") {
+		CHECK(overlapping_bbox_pairs({
+					bbox_of(0, 0, 0, 1),
+					bbox_of(2, 0, 0, 1),
+					bbox_of(0, 2, 0, 1),
+					bbox_of(0, 0, 2, 1)}).empty());
+	}
+
+	SECTION("overlapping and touching boxes") {
+		const auto result = overlapping_bbox_pairs({
+				bbox_of(0, 0, 0, 1),
+				bbox_of(5, 5, 5, 1),
+				bbox_of(0.5, 0.5, 0.5, 1),
+				bbox_of(1, 0, 0, 1)});
+		CHECK(result == pairs{{2, 0}, {3, 0}, {3, 2}});
+	}
+
+	SECTION("void boxes are ignored") {
+		const auto result = overlapping_bbox_pairs({
+				bbox_of(0, 0, 0, 1),
+				Bnd_Box{},
+				bbox_of(0, 0, 0, 1)});
+		CHECK(result == pairs{{2, 0}});
+	}
+}
+#endif
+
+void
+document::load_brep_subset(const char* path, const std::vector<size_t> &indices)
+{
+	if (!is_indexed_brep_file(path)) {
+		load_brep_file(path);
+		return;
+	}
+
+	indexed_brep_reader reader;
+	if (!reader.open(path)) {
+		LOG(FATAL) << "unable to read indexed BREP file\n";
+		std::exit(1);
+	}
+
+	solid_shapes.clear();
+	solid_shapes.resize(reader.num_solids());
+	for (const auto i : indices) {
+		if (i < solid_shapes.size()) {
+			solid_shapes[i] = reader.read_solid(i);
+		}
+	}
+
+	LOG(DEBUG)
+		<< "loaded " << indices.size() << " of " << solid_shapes.size()
+		<< " solids from " << path << '\n';
+}
+
 void
 document::load_brep_file(const char* path)
 {
+	profile_scope scope{"load brep"};
+	if (is_indexed_brep_file(path)) {
+		indexed_brep_reader reader;
+		LOG(DEBUG) << "reading indexed brep file " << path << '\n';
+		if (!reader.open(path)) {
+			LOG(FATAL) << "unable to read indexed BREP file\n";
+			std::exit(1);
+		}
+
+		solid_shapes.clear();
+		solid_shapes.reserve(reader.num_solids());
+		for (size_t i = 0; i < reader.num_solids(); i++) {
+			solid_shapes.push_back(reader.read_solid(i));
+		}
+		return;
+	}
+
 	BRep_Builder builder;
 	TopoDS_Shape shape;
 
@@ -191,6 +465,16 @@ document::load_brep_file(const char* path)
 void
 document::write_brep_file(const char* path) const
 {
+	profile_scope scope{"write brep"};
+	if (has_indexed_brep_extension(path)) {
+		LOG(DEBUG) << "writing indexed brep file " << path << '\n';
+		if (!write_indexed_brep_file(path, solid_shapes)) {
+			LOG(FATAL) << "failed to write indexed brep file\n";
+			std::exit(1);
+		}
+		return;
+	}
+
 	LOG(DEBUG) << "merging " << solid_shapes.size() << " shapes for writing\n";
 
 	TopoDS_Compound merged;
@@ -225,15 +509,17 @@ report_analyzer_status(
 	}
 }
 
+// errors are written to msg rather than logged so that checks can run in
+// parallel
 static bool
-is_shape_valid(int i, const TopoDS_Shape& shape)
+is_shape_valid(size_t i, const TopoDS_Shape& shape, std::ostream &msg)
 {
 	BRepCheck_Analyzer checker{shape};
 	if (checker.IsValid()) {
 		return true;
 	}
 
-	LOG(WARNING)
+	msg
 		<< "shape " << i
 		<< " contains following errors";
 
@@ -241,26 +527,62 @@ is_shape_valid(int i, const TopoDS_Shape& shape)
 	report_analyzer_status(checker, shape, stats);
 	for (const auto pair : stats) {
 		if (pair.first != BRepCheck_NoError) {
-			LOG(WARNING) << ' ' << pair.first << ' ' << pair.second << " times";
+			msg << ' ' << pair.first << ' ' << pair.second << " times";
 		}
 	}
 
-	LOG(WARNING) << '\n';
+	msg << '\n';
 
 	return false;
 }
 
+std::vector<std::vector<size_t>>
+groups_sharing_verticies(const std::vector<TopoDS_Shape> &shapes)
+{
+	// every shape is paired with itself so it ends up in a group, and with
+	// the first shape to use each of its verticies
+	std::vector<std::pair<size_t, size_t>> pairs;
+	std::unordered_map<const TopoDS_TShape*, size_t> first_user;
+	for (size_t i = 0; i < shapes.size(); i++) {
+		pairs.emplace_back(i, i);
+		for (TopExp_Explorer ex{shapes[i], TopAbs_VERTEX}; ex.More(); ex.Next()) {
+			const auto it = first_user.emplace(ex.Current().TShape().get(), i).first;
+			if (it->second != i) {
+				pairs.emplace_back(i, it->second);
+			}
+		}
+	}
+	return connected_components(pairs);
+}
+
 size_t
-document::count_invalid_shapes() const
+document::count_invalid_shapes(thread_pool &pool) const
 {
-	int i = 0;
+	// vector<bool> packs bits so can't be written from several threads
+	std::vector<char> valid(solid_shapes.size());
+	std::vector<std::string> messages(solid_shapes.size());
+
+	const auto groups = groups_sharing_verticies(solid_shapes);
+	{
+		parfor work;
+		for (const auto &group : groups) {
+			work.submit(pool, [this, &valid, &messages, &group]() {
+				for (const auto i : group) {
+					std::ostringstream msg;
+					valid[i] = is_shape_valid(i, solid_shapes[i], msg);
+					messages[i] = msg.str();
+				}
+			});
+		}
+	}
+
 	size_t num_invalid = 0;
-	for (const auto &shape : solid_shapes) {
-		LOG(DEBUG) << "checking shape" << i << '\n';
-		if (!is_shape_valid(i, shape)) {
+	for (size_t i = 0; i < solid_shapes.size(); i++) {
+		LOG(DEBUG) << "checked shape " << i << '\n';
+		if (!valid[i]) {
+			LOG(WARNING) << messages[i];
 			num_invalid += 1;
 		}
-		i++;
 	}
 	return num_invalid;
 }
@@ -308,6 +630,16 @@ public:
 		}
 	}
 
+	// for algorithms that take a progress range instead
+	Message_ProgressRange begin(unsigned timeout_millisecs) {
+		startedat_ = clock::now();
+		if (timeout_millisecs > 0) {
+			expireat_ = startedat_ + std::chrono::milliseconds{timeout_millisecs};
+			return Start();
+		}
+		return {};
+	}
+
 	bool expired() const {
 		return expired_;
 	}
@@ -331,10 +663,104 @@ public:
 };
 
 
+// paving allocates lots of small objects that all live until the filler is
+// destroyed, an arena per thread keeps them together and lets them be
+// released at once rather than fragmenting the heap
+static thread_local Handle(NCollection_IncAllocator) thread_arena;
+
+static const Handle(NCollection_IncAllocator) &
+arena_of_thread()
+{
+	if (thread_arena.IsNull()) {
+		thread_arena = new NCollection_IncAllocator;
+	}
+	return thread_arena;
+}
+
+void
+release_thread_arena()
+{
+	if (!thread_arena.IsNull()) {
+		thread_arena->Reset(Standard_True);
+	}
+}
+
+Handle(IntTools_Context)
+context_cache::context_for(
+	size_t solid, size_t solid_faces, size_t other_faces, bool &reused)
+{
+	auto it = by_solid.find(solid);
+	reused = it != by_solid.end();
+	if (reused) {
+		items.splice(items.begin(), items, it->second);
+	} else {
+		items.push_front({solid, new IntTools_Context, 0});
+		by_solid[solid] = items.begin();
+	}
+
+	const size_t faces = reused ? other_faces : solid_faces + other_faces;
+	auto &front = items.front();
+	front.num_faces += faces;
+	num_faces += faces;
+
+	evict();
+	return front.context;
+}
+
+void
+context_cache::charge(size_t solid, size_t faces)
+{
+	const auto it = by_solid.find(solid);
+	if (it == by_solid.end()) {
+		return;
+	}
+	it->second->num_faces += faces;
+	num_faces += faces;
+	evict();
+}
+
+// always keeps the most recently used
+void
+context_cache::evict()
+{
+	while (num_faces > max_faces && items.size() > 1) {
+		const auto &last = items.back();
+		num_faces -= last.num_faces;
+		by_solid.erase(last.solid);
+		items.pop_back();
+	}
+}
+
+// BOPAlgo_PaveFiller creates a new IntTools_Context every time it's
+// performed. this lets the caller supply one instead, so that surface
+// adaptors, projectors, 2d classifiers and bounding boxes built while paving
+// are kept between attempts. none of these depend on the fuzzy value, note
+// that OBBs would but we leave UseOBB off
+class context_reusing_filler : public BOPAlgo_PaveFiller {
+	Handle(IntTools_Context) context_;
+
+public:
+	context_reusing_filler(
+		const Handle(IntTools_Context) &context,
+		const Handle(NCollection_BaseAllocator) &allocator) :
+		BOPAlgo_PaveFiller{allocator},
+		context_{context} {}
+
+protected:
+	void Init(const Message_ProgressRange& range) override {
+		BOPAlgo_PaveFiller::Init(range);
+		if (!context_.IsNull()) {
+			myContext = context_;
+		}
+	}
+};
+
 intersect_result classify_solid_intersection(
 	const TopoDS_Shape& shape, const TopoDS_Shape& tool,
 	double fuzzy_value, unsigned pave_time_millisecs,
-	const char *msg)
+	const char *msg, const Handle(IntTools_Context) &context,
+	double shape_volume, double tool_volume, TopoDS_Shape *common,
+	bool run_parallel, size_t *num_split_shapes)
 {
 	using std::chrono::steady_clock;
 	using std::chrono::duration;
@@ -356,9 +782,15 @@ intersect_result classify_solid_intersection(
 
 	// explicitly construct a PaveFiller so we can reuse the work between
 	// operations, at a minimum we want to perform sectioning and getting any
-	// common solid
-	BOPAlgo_PaveFiller filler;
-	filler.SetRunParallel(false);
+	// common solid. booleans built from the filler share its allocator, and
+	// nothing allocated from the arena outlives this function. OCCT's threads
+	// would all allocate from the allocator, so parallel runs don't use the
+	// arena
+	const Handle(NCollection_BaseAllocator) allocator = run_parallel ?
+		NCollection_BaseAllocator::CommonBaseAllocator() :
+		Handle(NCollection_BaseAllocator){arena_of_thread()};
+	context_reusing_filler filler{context, allocator};
+	filler.SetRunParallel(run_parallel);
 	filler.SetFuzzyValue(fuzzy_value);
 	filler.SetNonDestructive(true);
 
@@ -374,11 +806,20 @@ intersect_result classify_solid_intersection(
 		<< msg << " PaveFiller configured\n";
 
 	// this can be a very expensive call, e.g. 10+ seconds
-	filler.Perform();
+	{
+		profile_scope scope{"pave"};
+		filler.Perform();
+	}
 
 	result.pave_time_seconds = timeout.duration_secs();
 	result.fuzzy_value = filler.FuzzyValue();
 
+	// split and section edges, and their new verticies
+	if (num_split_shapes) {
+		const BOPDS_DS &ds = filler.DS();
+		*num_split_shapes += size_t(ds.NbShapes() - ds.NbSourceShapes());
+	}
+
 	{
 		Handle(Message_Report) report = filler.GetReport();
 		collect_warnings(report.get(), result.num_filler_warnings);
@@ -402,7 +843,11 @@ intersect_result classify_solid_intersection(
 
 	boolean_op op{filler, BOPAlgo_COMMON, shape, tool};
 	op.SetFuzzyValue(filler.FuzzyValue());
-	op.Build();
+	op.SetRunParallel(run_parallel);
+	{
+		profile_scope scope{"common"};
+		op.Build();
+	}
 	collect_warnings(op.GetReport().get(), result.num_common_warnings);
 	if (op.HasErrors()) {
 		return result;
@@ -416,19 +861,32 @@ intersect_result classify_solid_intersection(
 		// non-trivial faces that are within the given tolerance/fuzzy value
 		result.vol_common = volume_of_shape_maybe_neg(op.Shape());
 
-		op.SetOperation(BOPAlgo_CUT);
-		op.Build();
-		if (op.HasErrors()) {
-			return result;
-		}
-		result.vol_cut = volume_of_shape(op.Shape());
+		if (shape_volume >= 0 && tool_volume >= 0 && result.vol_common >= 0) {
+			// only the negative volume check below needs the cuts, so
+			// avoid building two more booleans
+			result.vol_cut = std::max(0.0, shape_volume - result.vol_common);
+			result.vol_cut12 = std::max(0.0, tool_volume - result.vol_common);
+		} else {
+			op.SetOperation(BOPAlgo_CUT);
+			{
+				profile_scope scope{"cut"};
+				op.Build();
+			}
+			if (op.HasErrors()) {
+				return result;
+			}
+			result.vol_cut = volume_of_shape(op.Shape());
 
-		op.SetOperation(BOPAlgo_CUT21);
-		op.Build();
-		if (op.HasErrors()) {
-			return result;
+			op.SetOperation(BOPAlgo_CUT21);
+			{
+				profile_scope scope{"cut21"};
+				op.Build();
+			}
+			if (op.HasErrors()) {
+				return result;
+			}
+			result.vol_cut12 = volume_of_shape(op.Shape());
 		}
-		result.vol_cut12 = volume_of_shape(op.Shape());
 
 		LOG(TRACE)
 			<< msg << " PaveFiller.Perform overlap result\n";
@@ -451,12 +909,19 @@ intersect_result classify_solid_intersection(
 			result.status = intersect_status::touching;
 		} else {
 			result.status = intersect_status::overlap;
+			if (common) {
+				// copied so nothing refers to the filler's arena
+				*common = BRepBuilderAPI_Copy(op.Shape()).Shape();
+			}
 		}
 		return result;
 	}
 
 	op.SetOperation(BOPAlgo_SECTION);
-	op.Build();
+	{
+		profile_scope scope{"section"};
+		op.Build();
+	}
 	collect_warnings(op.GetReport().get(), result.num_section_warnings);
 	if (!op.HasErrors()) {
 		ex.Init(op.Shape(), TopAbs_VERTEX);
@@ -469,8 +934,201 @@ intersect_result classify_solid_intersection(
 	return result;
 }
 
+TopoDS_Shape
+common_of_solids(
+	const TopoDS_Shape& shape, const TopoDS_Shape& tool, double fuzzy_value)
+{
+	profile_scope scope{"common of solids"};
+	boolean_op op{BOPAlgo_COMMON, shape, tool};
+	op.SetFuzzyValue(fuzzy_value);
+	op.Build();
+	if (op.HasErrors()) {
+		return {};
+	}
+	return op.Shape();
+}
+
+// shapes are considered touching by the pave filler when their sub-shapes'
+// tolerances and the fuzzy value overlap, and verticies are the most
+// tolerant sub-shapes
+static double
+max_vertex_tolerance(const TopoDS_Shape& shape)
+{
+	double result = 0;
+	for (TopExp_Explorer ex{shape, TopAbs_VERTEX}; ex.More(); ex.Next()) {
+		result = std::max(result, BRep_Tool::Tolerance(TopoDS::Vertex(ex.Current())));
+	}
+	return result;
+}
+
+// if the boundaries of two solids don't meet, each shell of one is either
+// entirely inside or outside the other, so checking a point on each is
+// enough to find nested solids
+static bool
+any_shell_inside(const TopoDS_Shape& shape, const TopoDS_Shape& other, double tolerance)
+{
+	for (TopExp_Explorer solid{other, TopAbs_SOLID}; solid.More(); solid.Next()) {
+		BRepClass3d_SolidClassifier classifier{solid.Current()};
+		for (TopExp_Explorer shell{shape, TopAbs_SHELL}; shell.More(); shell.Next()) {
+			TopExp_Explorer vertex{shell.Current(), TopAbs_VERTEX};
+			if (!vertex.More()) {
+				continue;
+			}
+			classifier.Perform(BRep_Tool::Pnt(TopoDS::Vertex(vertex.Current())), tolerance);
+			if (classifier.State() != TopAbs_OUT) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+distance_status
+check_solids_apart(
+	const TopoDS_Shape& shape, const TopoDS_Shape& tool,
+	double fuzzy_value, unsigned time_millisecs)
+{
+	profile_scope scope{"distance"};
+	const double limit =
+		fuzzy_value + max_vertex_tolerance(shape) + max_vertex_tolerance(tool);
+
+	ProgressTimeout timeout;
+	BRepExtrema_DistShapeShape dss;
+	dss.SetFlag(Extrema_ExtFlag_MIN);
+	dss.LoadS1(shape);
+	dss.LoadS2(tool);
+
+#if OCC_VERSION_HEX >= 0x070600
+	dss.Perform(timeout.begin(time_millisecs));
+#else
+	// no way to interrupt it before 7.6
+	(void)time_millisecs;
+	dss.Perform();
+#endif
+
+	if (!dss.IsDone() || timeout.expired()) {
+		return distance_status::unknown;
+	}
+
+	if (dss.InnerSolution() || dss.Value() <= limit) {
+		return distance_status::near;
+	}
+
+	if (any_shell_inside(shape, tool, limit) || any_shell_inside(tool, shape, limit)) {
+		return distance_status::near;
+	}
+
+	return distance_status::apart;
+}
+
+// faces of shape whose bounding box is within tolerance of box
+static std::vector<TopoDS_Shape>
+faces_near_box(const TopoDS_Shape& shape, const Bnd_OBB &box, double tolerance)
+{
+	Bnd_OBB enlarged{box};
+	enlarged.Enlarge(tolerance);
+
+	std::vector<TopoDS_Shape> result;
+	TopTools_IndexedMapOfShape faces;
+	TopExp::MapShapes(shape, TopAbs_FACE, faces);
+	for (int i = 1; i <= faces.Extent(); i++) {
+		Bnd_Box face_box;
+		BRepBndLib::Add(faces(i), face_box, false);
+		// keep faces without a box, rather than risk missing a contact
+		if (face_box.IsVoid() || !enlarged.IsOut(Bnd_OBB{face_box})) {
+			result.push_back(faces(i));
+		}
+	}
+	return result;
+}
+
+static TopoDS_Compound
+compound_of(std::vector<TopoDS_Shape>::const_iterator begin, std::vector<TopoDS_Shape>::const_iterator end)
+{
+	TopoDS_Builder builder;
+	TopoDS_Compound result;
+	builder.MakeCompound(result);
+	for (auto it = begin; it != end; ++it) {
+		builder.Add(result, *it);
+	}
+	return result;
+}
+
+distance_status
+check_solids_apart_split(
+	const TopoDS_Shape& shape, const Bnd_OBB &shape_obb,
+	const TopoDS_Shape& tool, const Bnd_OBB &tool_obb,
+	double fuzzy_value, size_t faces_per_task, thread_pool &pool)
+{
+	profile_scope scope{"split distance"};
+
+	// like check_solids_apart, faces touch when their tolerances overlap
+	const double limit =
+		fuzzy_value + max_vertex_tolerance(shape) + max_vertex_tolerance(tool);
+
+	auto near_shape = faces_near_box(shape, tool_obb, limit);
+	auto near_tool = faces_near_box(tool, shape_obb, limit);
+
+	// the side with more faces is split between tasks
+	if (near_shape.size() < near_tool.size()) {
+		std::swap(near_shape, near_tool);
+	}
+
+	if (!near_tool.empty()) {
+		const size_t chunk = std::max(faces_per_task, size_t{1});
+		const size_t num_chunks = (near_shape.size() + chunk - 1) / chunk;
+		const TopoDS_Compound others = compound_of(near_tool.begin(), near_tool.end());
+
+		std::vector<distance_status> chunk_status(num_chunks, distance_status::apart);
+		// once any chunk finds contact the pair gets paved anyway, so the
+		// rest don't need sectioning
+		std::atomic<bool> found_contact{false};
+		cooperative_for(pool, num_chunks, [&](size_t i) {
+			if (found_contact.load(std::memory_order_relaxed)) {
+				return;
+			}
+			profile_scope chunk_scope{"split section"};
+			const auto begin = near_shape.begin() + long(i * chunk);
+			const auto end = near_shape.begin() + long(std::min((i + 1) * chunk, near_shape.size()));
+
+			// only the intersections between the two groups are in the
+			// section, not those between faces of the same solid
+			boolean_op op{BOPAlgo_SECTION, compound_of(begin, end), others};
+			op.SetFuzzyValue(fuzzy_value);
+			op.Build();
+			if (op.HasErrors()) {
+				chunk_status[i] = distance_status::unknown;
+				return;
+			}
+			TopExp_Explorer ex{op.Shape(), TopAbs_VERTEX};
+			if (ex.More()) {
+				chunk_status[i] = distance_status::near;
+				found_contact = true;
+			}
+		});
+
+		// any contact means paving is needed, even if another chunk failed
+		if (std::count(chunk_status.begin(), chunk_status.end(), distance_status::near)) {
+			return distance_status::near;
+		}
+		if (std::count(chunk_status.begin(), chunk_status.end(), distance_status::unknown)) {
+			return distance_status::unknown;
+		}
+	}
+
+	// surfaces don't meet, but one could be inside the other
+	if (any_shell_inside(shape, tool, limit) || any_shell_inside(tool, shape, limit)) {
+		return distance_status::near;
+	}
+
+	return distance_status::apart;
+}
+
 #ifdef INCLUDE_TESTS
 #include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeTorus.hxx>
+#include <gp_Ax2.hxx>
 
 static inline TopoDS_Shape
 cube_at(double x, double y, double z, double length)
@@ -507,6 +1165,33 @@ TEST_CASE("classify_solid_intersection") {
 		CHECK(result.vol_cut12 == Approx(0));
 	}
 
+	SECTION("derived cut volumes match built cuts") {
+		const auto s1 = cube_at(0, 0, 0, 5), s2 = cube_at(1, 2, 3, 5);
+
+		const auto exact = classify_solid_intersection(s1, s2, 0.5, 0, "test");
+		const auto fast = classify_solid_intersection(
+			s1, s2, 0.5, 0, "test", {}, volume_of_shape(s1), volume_of_shape(s2));
+
+		REQUIRE(exact.status == intersect_status::overlap);
+		REQUIRE(fast.status == intersect_status::overlap);
+		CHECK(fast.vol_common == Approx(4*3*2));
+		CHECK(fast.vol_common == Approx(exact.vol_common));
+		CHECK(fast.vol_cut == Approx(exact.vol_cut));
+		CHECK(fast.vol_cut12 == Approx(exact.vol_cut12));
+	}
+
+	SECTION("common solid is returned for overlaps") {
+		const auto s1 = cube_at(0, 0, 0, 5), s2 = cube_at(1, 2, 3, 5);
+
+		TopoDS_Shape common;
+		const auto result = classify_solid_intersection(s1, s2, 0.5, 0, "test", {}, -1, -1, &common);
+
+		REQUIRE(result.status == intersect_status::overlap);
+		REQUIRE_FALSE(common.IsNull());
+		CHECK(volume_of_shape(common) == Approx(4*3*2));
+		CHECK(volume_of_shape(common_of_solids(s1, s2, 0.5)) == Approx(4*3*2));
+	}
+
 	SECTION("distinct objects don't overlap") {
 		const auto s1 = cube_at(0, 0, 0, 4), s2 = cube_at(5, 5, 5, 4);
 
@@ -553,6 +1238,237 @@ TEST_CASE("classify_solid_intersection") {
 
 		REQUIRE(result.status == expected);
 	}
+
+	SECTION("reusing context between fuzzy values") {
+		const auto s1 = cube_at(0, 0, 0, 5), s2 = cube_at(0, 0, 5.2, 5);
+
+		Handle(IntTools_Context) context = new IntTools_Context;
+
+		const auto r1 = classify_solid_intersection(s1, s2, 0.5, 0, "test", context);
+		CHECK(r1.status == intersect_status::touching);
+
+		const auto r2 = classify_solid_intersection(s1, s2, 0.1, 0, "test", context);
+		CHECK(r2.status == intersect_status::distinct);
+
+		// and back again, make sure nothing was cached from the tighter fuzz
+		const auto r3 = classify_solid_intersection(s1, s2, 0.5, 0, "test", context);
+		CHECK(r3.status == intersect_status::touching);
+	}
+
+	SECTION("reusing context between pairs") {
+		const auto
+			s1 = cube_at(0, 0, 0, 5),
+			s2 = cube_at(0, 0, 5, 5),
+			s3 = cube_at(1, 2, 3, 5),
+			s4 = cube_at(6, 6, 6, 1);
+
+		Handle(IntTools_Context) context = new IntTools_Context;
+
+		const auto r1 = classify_solid_intersection(s1, s2, 0.5, 0, "test", context);
+		CHECK(r1.status == intersect_status::touching);
+
+		const auto r2 = classify_solid_intersection(s1, s3, 0.5, 0, "test", context);
+		REQUIRE(r2.status == intersect_status::overlap);
+		CHECK(r2.vol_common == Approx(4*3*2));
+
+		const auto r3 = classify_solid_intersection(s4, s1, 0.5, 0, "test", context);
+		CHECK(r3.status == intersect_status::distinct);
+	}
+}
+
+TEST_CASE("context_cache") {
+	context_cache cache{20};
+	bool reused = true;
+
+	const auto c1 = cache.context_for(1, 10, 2, reused);
+	CHECK_FALSE(reused);
+	CHECK(cache.faces() == 12);
+	CHECK(cache.context_for(1, 10, 6, reused) == c1);
+	CHECK(reused);
+	CHECK(cache.faces() == 18);
+
+	// solid 1 is least recently used, so is dropped
+	const auto c2 = cache.context_for(2, 4, 2, reused);
+	CHECK_FALSE(reused);
+	CHECK(c2 != c1);
+	CHECK(cache.size() == 1);
+	CHECK(cache.faces() == 6);
+
+	cache.context_for(3, 4, 2, reused);
+	CHECK(cache.context_for(2, 4, 6, reused) == c2);
+	CHECK(reused);
+	CHECK(cache.size() == 2);
+	CHECK(cache.faces() == 18);
+
+	// 3 is dropped rather than 2
+	cache.context_for(4, 4, 2, reused);
+	CHECK(cache.size() == 2);
+	cache.context_for(2, 4, 0, reused);
+	CHECK(reused);
+	cache.context_for(3, 4, 0, reused);
+	CHECK_FALSE(reused);
+
+	// kept even when it's larger than the limit on its own
+	context_cache small{1};
+	const auto big = small.context_for(5, 100, 0, reused);
+	CHECK(small.context_for(5, 100, 100, reused) == big);
+	CHECK(reused);
+
+	// splits added after paving count towards the limit
+	context_cache charged{20};
+	charged.context_for(1, 4, 2, reused);
+	charged.context_for(2, 4, 2, reused);
+	charged.charge(2, 6);
+	CHECK(charged.faces() == 18);
+	charged.charge(2, 4);
+	CHECK(charged.size() == 1);
+	CHECK(charged.faces() == 16);
+	charged.context_for(2, 4, 0, reused);
+	CHECK(reused);
+
+	// overlapping cubes have their edges split
+	size_t num_split_shapes = 0;
+	classify_solid_intersection(
+		cube_at(0, 0, 0, 5), cube_at(1, 2, 3, 5), 0.5, 0, "test",
+		new IntTools_Context, -1, -1, nullptr, false, &num_split_shapes);
+	CHECK(num_split_shapes > 0);
+}
+#endif
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("check_solids_apart") {
+	SECTION("far apart") {
+		CHECK(check_solids_apart(cube_at(0, 0, 0, 4), cube_at(5, 5, 5, 4), 0.5, 0) ==
+			  distance_status::apart);
+	}
+	SECTION("just outside fuzzy value") {
+		CHECK(check_solids_apart(cube_at(0, 0, 0, 5), cube_at(0, 0, 5.6, 5), 0.5, 0) ==
+			  distance_status::apart);
+	}
+	SECTION("within fuzzy value") {
+		CHECK(check_solids_apart(cube_at(0, 0, 0, 5), cube_at(0, 0, 5.4, 5), 0.5, 0) ==
+			  distance_status::near);
+	}
+	SECTION("touching") {
+		CHECK(check_solids_apart(cube_at(0, 0, 0, 5), cube_at(5, 5, 5, 5), 0, 0) ==
+			  distance_status::near);
+	}
+	SECTION("nested, boundaries far apart") {
+		CHECK(check_solids_apart(cube_at(0, 0, 0, 10), cube_at(2, 2, 2, 6), 0.5, 0) ==
+			  distance_status::near);
+		CHECK(check_solids_apart(cube_at(2, 2, 2, 6), cube_at(0, 0, 0, 10), 0.5, 0) ==
+			  distance_status::near);
+	}
+}
+
+TEST_CASE("check_solids_apart_split") {
+	// one face per task, so every case is spread over several tasks
+	thread_pool pool(2);
+	auto check = [&pool](const TopoDS_Shape &a, const TopoDS_Shape &b, double fuzzy_value) {
+		return check_solids_apart_split(
+			a, properties_of_solid(a).obb, b, properties_of_solid(b).obb,
+			fuzzy_value, 1, pool);
+	};
+
+	SECTION("far apart") {
+		CHECK(check(cube_at(0, 0, 0, 4), cube_at(5, 5, 5, 4), 0.5) == distance_status::apart);
+	}
+	SECTION("boxes overlap but solids don't") {
+		const auto cylinder = BRepPrimAPI_MakeCylinder(1, 4).Shape();
+		const auto ring = BRepPrimAPI_MakeTorus(gp_Ax2(gp_Pnt(0, 0, 2), gp::DZ()), 2.5, 0.5).Shape();
+		CHECK(check(cylinder, ring, 0.001) == distance_status::apart);
+	}
+	SECTION("touching") {
+		CHECK(check(cube_at(0, 0, 0, 5), cube_at(5, 5, 5, 5), 0) == distance_status::near);
+	}
+	SECTION("overlapping") {
+		CHECK(check(cube_at(0, 0, 0, 5), cube_at(1, 2, 3, 5), 0) == distance_status::near);
+	}
+	SECTION("nested, boundaries far apart") {
+		CHECK(check(cube_at(0, 0, 0, 10), cube_at(2, 2, 2, 6), 0.5) == distance_status::near);
+		CHECK(check(cube_at(2, 2, 2, 6), cube_at(0, 0, 0, 10), 0.5) == distance_status::near);
+	}
+}
+#endif
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("hash_of_shape") {
+	// separately constructed, but geometrically identical
+	CHECK(hash_of_shape(cube_at(0, 0, 0, 1)) == hash_of_shape(cube_at(0, 0, 0, 1)));
+
+	CHECK(hash_of_shape(cube_at(0, 0, 0, 1)) != hash_of_shape(cube_at(0, 0, 0, 2)));
+	CHECK(hash_of_shape(cube_at(0, 0, 0, 1)) != hash_of_shape(cube_at(1, 0, 0, 1)));
+}
+#endif
+
+#ifdef INCLUDE_TESTS
+#include <gp_Trsf.hxx>
+#include <TopLoc_Location.hxx>
+
+TEST_CASE("groups_sharing_verticies") {
+	using groups = std::vector<std::vector<size_t>>;
+
+	CHECK(groups_sharing_verticies({}).empty());
+
+	const auto a = cube_at(0, 0, 0, 1), b = cube_at(0, 0, 0, 1);
+
+	// another instance of a, sharing its topology but moved elsewhere
+	gp_Trsf trsf;
+	trsf.SetTranslation({5, 0, 0});
+	const auto moved = a.Moved(TopLoc_Location{trsf});
+
+	CHECK(groups_sharing_verticies({a, b}) == groups{{0}, {1}});
+	CHECK(groups_sharing_verticies({a, b, moved}) == groups{{0, 2}, {1}});
+}
+#endif
+
+#ifdef INCLUDE_TESTS
+#include <BRepPrimAPI_MakeCylinder.hxx>
+
+TEST_CASE("properties_of_solid") {
+	const auto cube = properties_of_solid(cube_at(0, 0, 0, 2));
+	CHECK(cube.volume == Catch::Approx(8));
+	CHECK(cube.num_faces == 6);
+	CHECK(cube.num_edges == 12);
+	CHECK(cube.num_verticies == 8);
+	CHECK(cube.num_curved_faces == 0);
+	CHECK_FALSE(cube.obb.IsVoid());
+	CHECK_FALSE(cube.aabb.IsVoid());
+
+	const auto cylinder = properties_of_solid(BRepPrimAPI_MakeCylinder(1, 2).Shape());
+	CHECK(cylinder.num_faces == 3);
+	CHECK(cylinder.num_curved_faces == 1);
+
+	// a known volume is used as given
+	const auto known = properties_of_solid(cube_at(0, 0, 0, 2), 8.5);
+	CHECK(known.volume == 8.5);
+	CHECK(known.num_faces == 6);
+
+	SECTION("surface_types_of_shape") {
+		const uint32_t
+			plane = uint32_t{1} << GeomAbs_Plane,
+			cylindrical = uint32_t{1} << GeomAbs_Cylinder;
+		CHECK(surface_types_of_shape(cube_at(0, 0, 0, 2)) == plane);
+		CHECK(surface_types_of_shape(BRepPrimAPI_MakeCylinder(1, 2).Shape()) == (plane | cylindrical));
+	}
+
+	SECTION("estimate_intersection_cost") {
+		auto rounded = cube;
+		rounded.num_curved_faces = 6;
+
+		const double
+			full = estimate_intersection_cost(cube, 8, cube, 8, 8),
+			small = estimate_intersection_cost(cube, 8, cube, 8, 0.001),
+			curved = estimate_intersection_cost(rounded, 8, rounded, 8, 8);
+
+		CHECK(small > 0);
+		CHECK(small < full);
+		CHECK(full < curved);
+
+		// symmetric in its arguments
+		CHECK(estimate_intersection_cost(cube, 8, cylinder, 16, 2) ==
+			  estimate_intersection_cost(cylinder, 16, cube, 8, 2));
+	}
 }
 #endif
 
@@ -591,7 +1507,10 @@ imprint_result perform_solid_imprinting(
 	}
 
 	// this can be a very expensive call, e.g. 10+ seconds
-	filler.Perform();
+	{
+		profile_scope scope{"imprint pave"};
+		filler.Perform();
+	}
 
 	{
 		Handle(Message_Report) report = filler.GetReport();
@@ -608,6 +1527,7 @@ imprint_result perform_solid_imprinting(
 	TopoDS_Shape common;
 
 	{
+		profile_scope scope{"imprint booleans"};
 		boolean_op op{filler, BOPAlgo_COMMON, shape, tool};
 		op.SetFuzzyValue(filler.FuzzyValue());
 		op.Build();
@@ -650,6 +1570,7 @@ imprint_result perform_solid_imprinting(
 		// op.SetFuzzyValue(filler.FuzzyValue());
 		// the above created distinct shapes, so we are free to modify here
 
+		profile_scope scope{"imprint fuse"};
 		op.Build();
 		collect_warnings(op.GetReport().get(), result.num_fuse_warnings);
 		if (op.HasErrors()) {
@@ -799,7 +1720,8 @@ TEST_CASE("salome_glue_shape") {
 		CHECK(shape_count_uniq(input, TopAbs_SOLID) == 2);
 		CHECK(volume_of_shape(input) == Approx(2));
 
-		TopoDS_Shape result = salome_glue_shape(input, 1e-9);
+		thread_pool pool(1);
+		TopoDS_Shape result = salome_glue_shape(input, 1e-9, pool);
 
 		// should have merged 1 face, 4 verts, and 4 edges
 		CHECK(shape_count_uniq(result, TopAbs_VERTEX) == 12);
@@ -808,6 +1730,208 @@ TEST_CASE("salome_glue_shape") {
 		CHECK(shape_count_uniq(input, TopAbs_SOLID) == 2);
 		CHECK(volume_of_shape(result) == Approx(2));
 	}
+
+	SECTION("row of cubes glued in parallel") {
+		TopoDS_Compound input;
+		TopoDS_Builder builder;
+		builder.MakeCompound(input);
+		for (int i = 0; i < 10; i++) {
+			builder.Add(input, cube_at(i, 0, 0, 1));
+		}
+
+		thread_pool serial(1), parallel(4);
+		const auto expected = salome_glue_shape(input, 1e-9, serial);
+		const auto result = salome_glue_shape(input, 1e-9, parallel);
+
+		// 9 faces shared between neighbours
+		CHECK(shape_count_uniq(result, TopAbs_FACE) == 60 - 9);
+		CHECK(shape_count_uniq(result, TopAbs_EDGE) == shape_count_uniq(expected, TopAbs_EDGE));
+		CHECK(shape_count_uniq(result, TopAbs_VERTEX) == shape_count_uniq(expected, TopAbs_VERTEX));
+		CHECK(volume_of_shape(result) == Approx(10));
+
+		std::stringstream a, b;
+		BRepTools::Write(expected, a);
+		BRepTools::Write(result, b);
+		CHECK(a.str() == b.str());
+	}
+}
+
+#endif
+
+general_imprint_result
+perform_general_imprinting(const std::vector<TopoDS_Shape>& solids, double fuzzy_value)
+{
+	general_imprint_result result{false, 0.0, 0, {}};
+
+	// the cells builder does a general fuse, splitting every solid into
+	// "cells" that are each inside a specific set of the inputs. these can
+	// then be selected and merged without paving again
+	BOPAlgo_CellsBuilder builder;
+	builder.SetRunParallel(false);
+	builder.SetFuzzyValue(fuzzy_value);
+	builder.SetNonDestructive(true);
+
+	{
+		TopTools_ListOfShape args;
+		for (const auto &solid : solids) {
+			args.Append(solid);
+		}
+		builder.SetArguments(args);
+	}
+
+	// this does the work of every pairwise pave at once, so can be very
+	// expensive
+	{
+		profile_scope scope{"general fuse"};
+		builder.Perform();
+	}
+
+	collect_warnings(builder.GetReport().get(), result.num_warnings);
+	result.fuzzy_value = builder.FuzzyValue();
+	if (builder.HasErrors()) {
+		return result;
+	}
+
+	// work out which inputs each cell is inside of
+	TopTools_IndexedMapOfShape cells;
+	std::vector<std::vector<size_t>> owners_of_cell;
+	for (size_t i = 0; i < solids.size(); i++) {
+		TopTools_ListOfShape images = builder.Modified(solids[i]);
+		if (images.IsEmpty() && !builder.IsDeleted(solids[i])) {
+			images.Append(solids[i]);
+		}
+		for (TopTools_ListOfShape::Iterator it{images}; it.More(); it.Next()) {
+			const auto idx = (size_t)cells.Add(it.Value());
+			if (idx > owners_of_cell.size()) {
+				owners_of_cell.resize(idx);
+			}
+			owners_of_cell[idx - 1].push_back(i);
+		}
+	}
+
+	std::vector<double> volumes;
+	volumes.reserve(solids.size());
+	for (const auto &solid : solids) {
+		volumes.push_back(volume_of_shape(solid));
+	}
+
+	// cells inside the same set of inputs are selected together, common
+	// volume goes to the largest input, ties to the earliest
+	std::map<std::vector<size_t>, size_t> owner_of_set;
+	// inputs sharing a cell with each input, these need to be avoided when
+	// selecting cells
+	std::vector<std::set<size_t>> neighbours(solids.size());
+	for (const auto &owners : owners_of_cell) {
+		size_t best = owners.front();
+		for (const auto i : owners) {
+			if (volumes[i] > volumes[best]) {
+				best = i;
+			}
+			neighbours[i].insert(owners.begin(), owners.end());
+		}
+		owner_of_set[owners] = best;
+	}
+
+	result.shapes.resize(solids.size());
+	for (size_t i = 0; i < solids.size(); i++) {
+		builder.RemoveAllFromResult();
+
+		for (const auto &it : owner_of_set) {
+			const auto &owners = it.first;
+			if (it.second != i) {
+				continue;
+			}
+
+			TopTools_ListOfShape take, avoid;
+			std::set<size_t> others;
+			for (const auto j : owners) {
+				take.Append(solids[j]);
+				others.insert(neighbours[j].begin(), neighbours[j].end());
+			}
+			for (const auto j : others) {
+				if (!std::binary_search(owners.begin(), owners.end(), j)) {
+					avoid.Append(solids[j]);
+				}
+			}
+
+			// any non-zero material will do, it's just used to merge the
+			// cells selected for this input
+			builder.AddToResult(take, avoid, 1, false);
+		}
+
+		// merge cells back into one solid, i.e. remove faces between the
+		// cut solid and any common volume it gained
+		builder.RemoveInternalBoundaries();
+		if (builder.HasErrors()) {
+			result.shapes.clear();
+			return result;
+		}
+
+		result.shapes[i] = builder.Shape();
+	}
+
+	result.ok = true;
+	return result;
 }
 
+#ifdef INCLUDE_TESTS
+TEST_CASE("perform_general_imprinting") {
+	using Catch::Approx;
+
+	SECTION("smaller object contained in larger one") {
+		// larger given second, so it's not just going to the earliest
+		const auto res = perform_general_imprinting(
+			{cube_at(2, 2, 2, 6), cube_at(0, 0, 0, 10)}, 0.5);
+		REQUIRE(res.ok);
+		REQUIRE(res.shapes.size() == 2);
+
+		// all goes to the larger
+		CHECK(volume_of_shape(res.shapes[0]) == Approx(0).margin(1e-6));
+		CHECK(volume_of_shape(res.shapes[1]) == Approx(10*10*10));
+	}
+
+	SECTION("two independent objects") {
+		const auto res = perform_general_imprinting(
+			{cube_at(0, 0, 0, 4), cube_at(5, 0, 0, 4)}, 0.5);
+		REQUIRE(res.ok);
+
+		CHECK(volume_of_shape(res.shapes[0]) == Approx(4*4*4));
+		CHECK(volume_of_shape(res.shapes[1]) == Approx(4*4*4));
+	}
+
+	SECTION("matches pairwise imprinting") {
+		const auto s1 = cube_at(0, 0, 0, 5), s2 = cube_at(4, 4, 4, 2);
+
+		const auto pairwise = perform_solid_imprinting(s1, s2, 0.1);
+		REQUIRE(pairwise.status == imprint_status::merge_into_shape);
+
+		const auto res = perform_general_imprinting({s1, s2}, 0.1);
+		REQUIRE(res.ok);
+
+		CHECK(volume_of_shape(res.shapes[0]) == Approx(volume_of_shape(pairwise.shape)));
+		CHECK(volume_of_shape(res.shapes[1]) == Approx(volume_of_shape(pairwise.tool)));
+		CHECK(shape_count_uniq(res.shapes[0], TopAbs_SOLID) == 1);
+	}
+
+	SECTION("several overlapping objects") {
+		// a big cube with smaller ones overlapping two of its corners, one of
+		// these also overlaps a larger cube. sizes all differ so volumes
+		// never tie
+		const auto res = perform_general_imprinting({
+				cube_at(0, 0, 0, 5),
+				cube_at(4, 4, 4, 2),
+				cube_at(-1, -1, -1, 2.5),
+				cube_at(5, 5, 5, 3),
+			}, 0.1);
+		REQUIRE(res.ok);
+		REQUIRE(res.shapes.size() == 4);
+
+		// big cube keeps all its volume
+		CHECK(volume_of_shape(res.shapes[0]) == Approx(5*5*5));
+		// loses a corner to the big cube and another to the last cube
+		CHECK(volume_of_shape(res.shapes[1]) == Approx(2*2*2 - 1 - 1));
+		CHECK(volume_of_shape(res.shapes[2]) == Approx(2.5*2.5*2.5 - 1.5*1.5*1.5));
+		CHECK(volume_of_shape(res.shapes[3]) == Approx(3*3*3));
+	}
+}
 #endif
@@ -1,11 +1,20 @@
+#pragma once
+
 #include <sys/types.h>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <ostream>
 
 // from opencascade
+#include <Bnd_Box.hxx>
+#include <Bnd_OBB.hxx>
 #include <TopoDS_Shape.hxx>
 #include <BRepCheck_Status.hxx>
 #include <BRepAlgoAPI_BooleanOperation.hxx>
+#include <IntTools_Context.hxx>
 
 
 std::ostream& operator<<(std::ostream& str, TopAbs_ShapeEnum type);
@@ -15,15 +24,72 @@ std::ostream& operator<<(std::ostream& str, BRepCheck_Status type);
 double volume_of_shape(const class TopoDS_Shape& shape);
 double distance_between_shapes(const TopoDS_Shape& a, const TopoDS_Shape& b);
 
+// hash of the serialised geometry, identical shapes hash to the same value
+// across runs even if they're different objects in memory
+uint64_t hash_of_shape(const TopoDS_Shape& shape);
+
+// broad phase for finding nearby shapes, returns all pairs of overlapping
+// boxes as (hi, lo) with hi > lo. these are sorted into the same order as a
+// nested loop would visit them, void boxes never overlap anything
+std::vector<std::pair<size_t, size_t>> overlapping_bbox_pairs(
+	const std::vector<Bnd_Box> &boxes);
+
+// things about a solid that are used repeatedly when checking pairs, so are
+// worth computing once up front
+struct solid_properties {
+	Bnd_OBB obb;
+	// not enlarged by any tolerance
+	Bnd_Box aabb;
+	double volume;
+	int num_faces, num_edges, num_verticies;
+	// faces on something other than a plane, these are much more expensive
+	// to intersect
+	int num_curved_faces;
+};
+
+solid_properties properties_of_solid(const TopoDS_Shape& shape);
+
+// when the volume is already known, e.g. step_to_brep has to compute it to
+// filter out small solids
+solid_properties properties_of_solid(const TopoDS_Shape& shape, double volume);
+
+// a bit, 1 << GeomAbs_SurfaceType, for each type of surface the faces of
+// shape lie on. e.g. to group pairs that are likely to behave similarly
+uint32_t surface_types_of_shape(const TopoDS_Shape& shape);
+
+// rough estimate, in arbitrary units, of how long it will take to classify
+// the intersection between two solids. only useful for comparing pairs, e.g.
+// to start the worst ones first. overlap is the volume of the region where
+// their bounding boxes intersect
+double estimate_intersection_cost(
+	const solid_properties &a, double bbox_volume_a,
+	const solid_properties &b, double bbox_volume_b,
+	double overlap);
+
+// groups of shapes sharing any verticies, these can't safely be modified
+// in parallel because changing one could change the others. every shape is
+// in exactly one group, groups and their members are in index order
+std::vector<std::vector<size_t>> groups_sharing_verticies(
+	const std::vector<TopoDS_Shape> &shapes);
+
+class thread_pool;
+
 struct document {
 	std::vector<TopoDS_Shape> solid_shapes;
 
 	// these just exit on error, will do something better when it's clear what
-	// that is!
+	// that is! paths ending in .bbrep are written as indexed BREP files, and
+	// these are detected when reading
 	void load_brep_file(const char* path);
 	void write_brep_file(const char* path) const;
 
-	size_t count_invalid_shapes() const;
+	// only the given solids are guaranteed to be loaded, others are left as
+	// null shapes. indexed files are read lazily so this can be much quicker
+	// than loading everything, text BREP files are still read in full
+	void load_brep_subset(const char* path, const std::vector<size_t> &indices);
+
+	// problems are logged in index order
+	size_t count_invalid_shapes(thread_pool &pool) const;
 
 	// only integer indexes supported at the moment, returns -1 if invalid
 	ssize_t lookup_solid(const std::string &str) const;
@@ -98,11 +164,112 @@ struct intersect_result {
 	double pave_time_seconds;
 };
 
-// pave time of zero disables timeout handling
+// classify_solid_intersection allocates the pave filler's working memory
+// from an arena owned by the calling thread, which is only released by
+// calling this. call it after each pair, rather than each attempt, so the
+// arena is reused for retries
+void release_thread_arena();
+
+/* IntTools_Contexts kept between pairs, so projectors, classifiers and
+ * bounding boxes built for a solid's faces while paving one pair are reused
+ * by later pairs including it. keyed by the solid with the most faces in each
+ * pair, as that's where most of the preprocessing goes, and the other solid's
+ * faces are added to the same context. contexts aren't thread safe, so this
+ * shouldn't be shared between threads.
+ *
+ * memory is bounded by counting the faces each context has seen, dropping the
+ * least recently used contexts once the total exceeds max_faces. paving adds
+ * split and section edges, which contexts keep data for too, so these should
+ * be counted with charge()
+ */
+class context_cache {
+	struct item {
+		size_t solid;
+		Handle(IntTools_Context) context;
+		size_t num_faces;
+	};
+
+	const size_t max_faces;
+	size_t num_faces = 0;
+	// most recently used first
+	std::list<item> items;
+	std::unordered_map<size_t, std::list<item>::iterator> by_solid;
+
+	void evict();
+
+public:
+	explicit context_cache(size_t max_faces) : max_faces{max_faces} {}
+
+	// context for a pair including solid, with other_faces in the other
+	// solid. reused is set if it was already cached
+	Handle(IntTools_Context) context_for(
+		size_t solid, size_t solid_faces, size_t other_faces, bool &reused);
+
+	// counts shapes paving added to solid's context as faces, as splits
+	// are kept much like faces
+	void charge(size_t solid, size_t faces);
+
+	size_t size() const {
+		return items.size();
+	}
+
+	size_t faces() const {
+		return num_faces;
+	}
+};
+
+enum class distance_status {
+	// further apart than the fuzzy value, so paving would find them distinct
+	apart,
+
+	// close enough that they need paving, or one is inside the other
+	near,
+
+	// ran out of time or failed, so should be paved to find out
+	unknown,
+};
+
+// measures the distance between two solids, much more cheaply than
+// classify_solid_intersection() for pairs whose bounding boxes are close but
+// which are clearly apart. gives up after time_millisecs, or never if it's
+// zero. before OCCT 7.6 the time limit is ignored
+distance_status check_solids_apart(
+	const TopoDS_Shape& shape, const TopoDS_Shape& tool,
+	double fuzzy_value, unsigned time_millisecs);
+
+// like check_solids_apart, but spreads the work for one pair of very large
+// solids over pool. faces of each solid are kept if their bounding box is
+// within fuzzy_value of the other solid's OBB, then chunks of at most
+// faces_per_task nearby faces of one are sectioned against the nearby faces
+// of the other as separate tasks. safe to call from within a pool task
+distance_status check_solids_apart_split(
+	const TopoDS_Shape& shape, const Bnd_OBB &shape_obb,
+	const TopoDS_Shape& tool, const Bnd_OBB &tool_obb,
+	double fuzzy_value, size_t faces_per_task, thread_pool &pool);
+
+// pave time of zero disables timeout handling. when common is given, it's set
+// to the common solids of overlapping shapes. passing the same context when
+// retrying a pair with a different fuzzy value allows work that doesn't
+// depend on the tolerance to be reused, a null context uses a fresh one.
+// when shape_volume and tool_volume aren't negative, e.g. from
+// solid_properties, vol_cut and vol_cut12 are derived from them and
+// vol_common rather than building the cuts, which are then only built when
+// the common volume comes back negative. run_parallel lets paving and
+// the booleans use OCCT's threads, see configure_occt_threads.
+// num_split_shapes is increased by the number of shapes paving added, e.g.
+// for context_cache::charge
 intersect_result classify_solid_intersection(
 	const TopoDS_Shape& shape, const TopoDS_Shape& tool,
 	double fuzzy_value, unsigned pave_time_millisecs,
-	const char *msg);
+	const char *msg, const Handle(IntTools_Context) &context = {},
+	double shape_volume = -1, double tool_volume = -1,
+	TopoDS_Shape *common = nullptr,
+	bool run_parallel = false, size_t *num_split_shapes = nullptr);
+
+// the solids common to both shapes, as found by classify_solid_intersection
+// for overlapping shapes. returns a null shape if the boolean fails
+TopoDS_Shape common_of_solids(
+	const TopoDS_Shape& shape, const TopoDS_Shape& tool, double fuzzy_value);
 
 
 enum class imprint_status {
@@ -136,3 +303,22 @@ struct imprint_result {
 
 imprint_result perform_solid_imprinting(
 	const TopoDS_Shape& shape, const TopoDS_Shape& tool, double fuzzy_value);
+
+
+struct general_imprint_result {
+	// false if something failed within OCCT, the shapes are left empty
+	bool ok;
+
+	double fuzzy_value;
+
+	int num_warnings;
+
+	// one for each input solid, in the same order
+	std::vector<TopoDS_Shape> shapes;
+};
+
+// imprints a group of solids against each other in a single general fuse,
+// rather than one pair at a time like perform_solid_imprinting(). volume
+// common to several solids is merged into whichever was largest
+general_imprint_result perform_general_imprinting(
+	const std::vector<TopoDS_Shape>& solids, double fuzzy_value);
@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iomanip>
 #include <ios>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <TopoDS_Builder.hxx>
 #include <TopoDS_Compound.hxx>
@@ -11,71 +14,215 @@
 #include <aixlog.hpp>
 
 #include "geometry.hpp"
+#include "properties_file.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
 
+// read all the pairs up front so they can be scheduled
+static bool
+read_pairs(const document &doc, std::vector<std::pair<size_t, size_t>> &pairs)
+{
+	csv_reader reader{std::cin};
+	input_status status;
+	size_t first, second;
+	while ((status = reader.next_pair(first, second)) == input_status::success) {
+		if (first >= doc.solid_shapes.size()) {
+			LOG(FATAL) << "first value (" << first << ") is not a valid shape index\n";
+			return false;
+		}
+
+		if (second >= doc.solid_shapes.size()) {
+			LOG(FATAL) << "second value (" << second << ") is not a valid shape index\n";
+			return false;
+		}
+
+		pairs.emplace_back(first, second);
+	}
+
+	if (status != input_status::end_of_file) {
+		LOG(FATAL) << "failed to read CSV input\n";
+		return false;
+	}
+
+	return true;
+}
+
 static int
-imprint(document &doc)
+imprint_pairwise(
+	document &doc, thread_pool &pool,
+	const std::vector<std::pair<size_t, size_t>> &pairs)
 {
+	// pairs in a batch don't share any solids so can be imprinted at the
+	// same time, while updates to each solid still happen in CSV order
+	const auto batch_of_pair = batch_independent_pairs(pairs);
+	const size_t num_batches = batch_of_pair.empty() ? 0 :
+		*std::max_element(batch_of_pair.begin(), batch_of_pair.end()) + 1;
+
+	std::vector<std::vector<size_t>> batches(num_batches);
+	for (size_t i = 0; i < pairs.size(); i++) {
+		batches[batch_of_pair[i]].push_back(i);
+	}
+
+	LOG(INFO)
+		<< "imprinting " << pairs.size() << " pairs in "
+		<< num_batches << " batches\n";
+
 	int num_failed = 0;
 
-	input_status status;
-	std::vector<std::string> fields;
-	while ((status = parse_next_row(std::cin, fields)) == input_status::success) {
-		if (fields.size() < 2) {
-			LOG(FATAL) << "CSV input does not contain two fields\n";
-			return 1;
+	std::vector<imprint_result> results;
+	for (const auto &batch : batches) {
+		results.resize(batch.size());
+
+		{
+			parfor work;
+			for (size_t j = 0; j < batch.size(); j++) {
+				work.submit(pool, [&doc, &pairs, &batch, &results, j]() {
+					const auto &pair = pairs[batch[j]];
+					results[j] = perform_solid_imprinting(
+						doc.solid_shapes[pair.first], doc.solid_shapes[pair.second], 0.01);
+				});
+			}
 		}
 
-		ssize_t first, second;
-		if ((first = doc.lookup_solid(fields[0])) < 0) {
-			LOG(FATAL) << "first value (" << fields[0] << ") is not a valid shape index\n";
-			return 1;
+		// batch is in CSV order, so logging is deterministic
+		for (size_t j = 0; j < batch.size(); j++) {
+			const size_t first = pairs[batch[j]].first, second = pairs[batch[j]].second;
+			const auto hi_lo = indexpair_to_string(first, second);
+			const auto &res = results[j];
+
+			switch(res.status) {
+			case imprint_status::failed:
+				LOG(ERROR) << hi_lo << " failed to imprint\n";
+				num_failed += 1;
+				// continue because we don't want to put these shapes back into
+				// the document!
+				continue;
+			case imprint_status::distinct:
+				LOG(DEBUG) << hi_lo << " were mostly distinct\n";
+				break;
+			case imprint_status::merge_into_shape:
+				LOG(INFO)
+					<< hi_lo << " were imprinted, "
+					<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
+					<< "was merged into " << first << '\n';
+				break;
+			case imprint_status::merge_into_tool:
+				LOG(INFO)
+					<< hi_lo << " were imprinted, "
+					<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
+					<< "was merged into " << second << '\n';
+				break;
+			}
+			doc.solid_shapes[first] = res.shape;
+			doc.solid_shapes[second] = res.tool;
 		}
 
-		if ((second = doc.lookup_solid(fields[1])) < 0) {
-			LOG(FATAL) << "second value (" << fields[1] << ") is not a valid shape index\n";
-			return 1;
+		results.clear();
+	}
+
+	if (num_failed > 0) {
+		LOG(FATAL) << "failed to imprint " << num_failed << " shapes\n";
+		return 1;
+	}
+
+	return 0;
+}
+
+// imprints each group of connected solids with a single general fuse.
+// groups of more than max_group_size solids are imprinted pairwise instead,
+// as a general fuse over a large group can take far longer and use far more
+// memory than imprinting its pairs one at a time
+static int
+imprint_general(
+	document &doc, thread_pool &pool,
+	const std::vector<std::pair<size_t, size_t>> &pairs,
+	size_t max_group_size)
+{
+	auto components = connected_components(pairs);
+
+	std::vector<bool> too_large(doc.solid_shapes.size(), false);
+	size_t num_large = 0;
+	for (const auto &component : components) {
+		if (component.size() > max_group_size) {
+			for (const auto i : component) {
+				too_large[i] = true;
+			}
+			num_large += 1;
+		}
+	}
+	components.erase(
+		std::remove_if(components.begin(), components.end(),
+			[max_group_size](const std::vector<size_t> &component) {
+				return component.size() > max_group_size;
+			}),
+		components.end());
+
+	// still in CSV order
+	std::vector<std::pair<size_t, size_t>> pairwise;
+	for (const auto &pair : pairs) {
+		if (too_large[pair.first]) {
+			pairwise.push_back(pair);
 		}
+	}
+
+	LOG(INFO)
+		<< "imprinting " << (pairs.size() - pairwise.size()) << " pairs as "
+		<< components.size() << " groups of connected solids\n";
+
+	if (num_large > 0) {
+		LOG(INFO)
+			<< "imprinting " << num_large << " groups of more than "
+			<< max_group_size << " solids pairwise\n";
+
+		// these groups share no solids with the rest
+		const int status = imprint_pairwise(doc, pool, pairwise);
+		if (status != 0) {
+			return status;
+		}
+	}
+
+	// components don't share any solids, so can run at the same time
+	std::vector<general_imprint_result> results(components.size());
+	{
+		parfor work;
+		for (size_t i = 0; i < components.size(); i++) {
+			work.submit(pool, [&doc, &components, &results, i]() {
+				std::vector<TopoDS_Shape> solids;
+				for (const auto j : components[i]) {
+					solids.push_back(doc.solid_shapes[j]);
+				}
+				results[i] = perform_general_imprinting(solids, 0.01);
+			});
+		}
+	}
+
+	int num_failed = 0;
 
-		const auto hi_lo = indexpair_to_string((size_t)first, (size_t)second);
+	for (size_t i = 0; i < components.size(); i++) {
+		const auto &component = components[i];
+		const auto &res = results[i];
 
-		const auto res = perform_solid_imprinting(
-			doc.solid_shapes[(size_t)first], doc.solid_shapes[(size_t)second], 0.01);
-		switch(res.status) {
-		case imprint_status::failed:
-			LOG(ERROR) << hi_lo << " failed to imprint\n";
+		if (!res.ok) {
+			LOG(ERROR)
+				<< "failed to imprint group of " << component.size()
+				<< " solids starting with " << component.front() << '\n';
 			num_failed += 1;
-			// continue because we don't want to put these shapes back into
-			// the document!
 			continue;
-		case imprint_status::distinct:
-			LOG(DEBUG) << hi_lo << " were mostly distinct\n";
-			break;
-		case imprint_status::merge_into_shape:
-			LOG(INFO)
-				<< hi_lo << " were imprinted, "
-				<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
-				<< "was merged into " << first << '\n';
-			break;
-		case imprint_status::merge_into_tool:
-			LOG(INFO)
-				<< hi_lo << " were imprinted, "
-				<< "a volume of " << std::fixed << std::setprecision(2) << res.vol_common
-				<< "was merged into " << second << '\n';
-			break;
 		}
-		doc.solid_shapes[(size_t)first] = res.shape;
-		doc.solid_shapes[(size_t)second] = res.tool;
-	}
 
-	if (status != input_status::end_of_file) {
-		LOG(FATAL) << "failed to read line\n";
-		return 1;
+		LOG(DEBUG)
+			<< "imprinted group of " << component.size()
+			<< " solids starting with " << component.front()
+			<< " with " << res.num_warnings << " warnings\n";
+
+		for (size_t j = 0; j < component.size(); j++) {
+			doc.solid_shapes[component[j]] = res.shapes[j];
+		}
 	}
 
 	if (num_failed > 0) {
-		LOG(FATAL) << "failed to imprint " << num_failed << " shapes\n";
+		LOG(FATAL) << "failed to imprint " << num_failed << " groups of solids\n";
 		return 1;
 	}
 
@@ -87,7 +234,12 @@ main(int argc, char **argv)
 {
 	configure_aixlog();
 
+	profile_writer profile;
+
 	std::string path_in, path_out;
+	unsigned num_parallel_jobs = 1;
+	bool use_general_fuse = false;
+	unsigned max_group_size = 64;
 
 	{
 		const auto doc = (
@@ -96,7 +248,28 @@ main(int argc, char **argv)
 			"The intersection of any overlapping shapes will be assigned to the one with a larger volume.");
 		const auto usage = "input.brep output.brep";
 
+		auto parse_engine = [&use_general_fuse](int, const char* arg, struct argp_state* state) {
+			if (std::strcmp(arg, "pairwise") == 0) {
+				use_general_fuse = false;
+			} else if (std::strcmp(arg, "general") == 0) {
+				use_general_fuse = true;
+			} else {
+				argp_error(
+					state, "engine should be 'pairwise' or 'general', not '%s'",
+					arg);
+			}
+			return 0;
+		};
+
 		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+		argp.add_option(
+			{"engine", 1024, "ENGINE", 0, "Imprint one pair at a time in CSV order (pairwise, the default), or each group of connected solids at once (general)", 0},
+			std::function{parse_engine});
+		argp.add_option(
+			{"max-group-size", 1025, "N", 0, "With the general engine, imprint groups of more than N connected solids pairwise (default 64)", 0},
+			max_group_size);
 		if (!argp.parse(argc, argv, usage, doc)) {
 			return 1;
 		}
@@ -110,12 +283,40 @@ main(int argc, char **argv)
 	document doc;
 	doc.load_brep_file(path_in.c_str());
 
-	const int status = imprint(doc);
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
+	std::vector<std::pair<size_t, size_t>> pairs;
+	if (!read_pairs(doc, pairs)) {
+		return 1;
+	}
+
+	const int status = use_general_fuse ?
+		imprint_general(doc, pool, pairs, max_group_size) :
+		imprint_pairwise(doc, pool, pairs);
 	if (status != 0) {
 		return status;
 	}
 
 	doc.write_brep_file(path_out.c_str());
 
+	// only solids that were imprinted have changed, so if the input had
+	// properties saved just update those. otherwise leave it to whatever
+	// reads the output
+	std::vector<solid_properties> props;
+	if (read_properties_file(path_in, props) && props.size() == doc.solid_shapes.size()) {
+		std::vector<size_t> modified;
+		for (const auto &pair : pairs) {
+			modified.push_back(pair.first);
+			modified.push_back(pair.second);
+		}
+		std::sort(modified.begin(), modified.end());
+		modified.erase(std::unique(modified.begin(), modified.end()), modified.end());
+
+		LOG(DEBUG) << "updating properties of " << modified.size() << " solids\n";
+		update_properties(doc, modified, props, pool);
+		write_properties_file(path_out, props);
+	}
+
 	return 0;
 }
@@ -0,0 +1,350 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <streambuf>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef INCLUDE_TESTS
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/catch_approx.hpp>
+#endif
+
+#include <BinTools.hxx>
+#include <TopoDS_Builder.hxx>
+#include <TopoDS_Compound.hxx>
+#include <TopoDS_Iterator.hxx>
+
+#include <aixlog.hpp>
+
+#include "indexed_brep.hpp"
+#include "geometry.hpp"
+#include "utils.hpp"
+
+
+static const char magic[8] = {'I', 'D', 'X', 'B', 'R', 'E', 'P', '1'};
+static const uint64_t byte_order_marker = 0x0102030405060708ull;
+
+// magic, byte order, number of solids and number of blobs
+static const size_t header_size = sizeof(magic) + 3 * sizeof(uint64_t);
+
+// lets BinTools read straight out of the mapped file
+class memory_streambuf : public std::streambuf {
+public:
+	memory_streambuf(const char *data, size_t size) {
+		char *p = const_cast<char *>(data);
+		setg(p, p, p + size);
+	}
+
+protected:
+	pos_type seekoff(
+		off_type off, std::ios_base::seekdir dir,
+		std::ios_base::openmode which = std::ios_base::in) override {
+		if (!(which & std::ios_base::in)) {
+			return pos_type(off_type(-1));
+		}
+		char *pos;
+		switch (dir) {
+		case std::ios_base::beg: pos = eback() + off; break;
+		case std::ios_base::cur: pos = gptr() + off; break;
+		case std::ios_base::end: pos = egptr() + off; break;
+		default: return pos_type(off_type(-1));
+		}
+		if (pos < eback() || pos > egptr()) {
+			return pos_type(off_type(-1));
+		}
+		setg(eback(), pos, egptr());
+		return pos_type(pos - eback());
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+};
+
+bool
+has_indexed_brep_extension(const std::string &path)
+{
+	const std::string ext = ".bbrep";
+	return path.size() >= ext.size() &&
+		path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+bool
+is_indexed_brep_file(const char *path)
+{
+	std::ifstream input{path, std::ios::binary};
+	char buf[sizeof(magic)];
+	return
+		input.read(buf, sizeof(buf)) &&
+		std::memcmp(buf, magic, sizeof(magic)) == 0;
+}
+
+static void
+write_uint64(std::ostream &out, uint64_t val)
+{
+	out.write(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+bool
+write_indexed_brep_file(const char *path, const std::vector<TopoDS_Shape> &solids)
+{
+	const auto groups = groups_sharing_verticies(solids);
+
+	std::vector<std::pair<uint64_t, uint64_t>> solid_locations(solids.size());
+	for (size_t i = 0; i < groups.size(); i++) {
+		for (size_t j = 0; j < groups[i].size(); j++) {
+			solid_locations[groups[i][j]] = {i, j};
+		}
+	}
+
+	std::ofstream out{path, std::ios::binary | std::ios::trunc};
+	if (!out.is_open()) {
+		LOG(ERROR) << "unable to open " << path << " for writing\n";
+		return false;
+	}
+
+	out.write(magic, sizeof(magic));
+	write_uint64(out, byte_order_marker);
+	write_uint64(out, solids.size());
+	write_uint64(out, groups.size());
+
+	for (const auto &loc : solid_locations) {
+		write_uint64(out, loc.first);
+		write_uint64(out, loc.second);
+	}
+
+	// blob offsets aren't known until they've been written, so leave space
+	// and come back to fill them in
+	const auto offsets_pos = out.tellp();
+	std::vector<uint64_t> blob_offsets;
+	for (size_t i = 0; i <= groups.size(); i++) {
+		write_uint64(out, 0);
+	}
+
+	TopoDS_Builder builder;
+	for (const auto &group : groups) {
+		blob_offsets.push_back((uint64_t)out.tellp());
+
+		TopoDS_Compound compound;
+		builder.MakeCompound(compound);
+		for (const auto i : group) {
+			builder.Add(compound, solids[i]);
+		}
+		BinTools::Write(compound, out);
+	}
+	blob_offsets.push_back((uint64_t)out.tellp());
+
+	out.seekp(offsets_pos);
+	for (const auto offset : blob_offsets) {
+		write_uint64(out, offset);
+	}
+
+	out.close();
+	if (out.fail()) {
+		LOG(ERROR) << "failed to write " << path << '\n';
+		return false;
+	}
+	return true;
+}
+
+void
+indexed_brep_reader::close()
+{
+	if (data) {
+		munmap(const_cast<char *>(data), size);
+		data = nullptr;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	solid_locations.clear();
+	blob_offsets.clear();
+	loaded_blobs.clear();
+}
+
+bool
+indexed_brep_reader::open(const char *path)
+{
+	close();
+
+	fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		LOG(ERROR) << "unable to open " << path << ": " << std::strerror(errno) << '\n';
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		LOG(ERROR) << "unable to stat " << path << ": " << std::strerror(errno) << '\n';
+		close();
+		return false;
+	}
+	size = (size_t)st.st_size;
+
+	if (size < header_size) {
+		LOG(ERROR) << path << " is too small to be an indexed BREP file\n";
+		close();
+		return false;
+	}
+
+	void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		LOG(ERROR) << "unable to map " << path << ": " << std::strerror(errno) << '\n';
+		size = 0;
+		close();
+		return false;
+	}
+	data = static_cast<const char *>(addr);
+
+	size_t pos = 0;
+	auto read_uint64 = [this, &pos]() {
+		uint64_t val;
+		std::memcpy(&val, data + pos, sizeof(val));
+		pos += sizeof(val);
+		return val;
+	};
+
+	if (std::memcmp(data, magic, sizeof(magic)) != 0) {
+		LOG(ERROR) << path << " is not an indexed BREP file\n";
+		close();
+		return false;
+	}
+	pos += sizeof(magic);
+
+	if (read_uint64() != byte_order_marker) {
+		LOG(ERROR) << path << " was written on a machine with a different byte order\n";
+		close();
+		return false;
+	}
+
+	const uint64_t num_solids = read_uint64(), num_blobs = read_uint64();
+
+	// make sure the tables fit before reading them, being careful of
+	// overflow from bad counts
+	const uint64_t max_entries = size / sizeof(uint64_t);
+	if (num_solids > max_entries / 2 || num_blobs >= max_entries ||
+		header_size + (num_solids * 2 + num_blobs + 1) * sizeof(uint64_t) > size) {
+		LOG(ERROR) << path << " has a truncated index\n";
+		close();
+		return false;
+	}
+
+	solid_locations.resize(num_solids);
+	for (auto &loc : solid_locations) {
+		loc.first = read_uint64();
+		loc.second = read_uint64();
+		if (loc.first >= num_blobs) {
+			LOG(ERROR) << path << " has an invalid index\n";
+			close();
+			return false;
+		}
+	}
+
+	blob_offsets.resize(num_blobs + 1);
+	uint64_t prev = pos;
+	for (auto &offset : blob_offsets) {
+		offset = read_uint64();
+		if (offset < prev || offset > size) {
+			LOG(ERROR) << path << " has an invalid index\n";
+			close();
+			return false;
+		}
+		prev = offset;
+	}
+
+	loaded_blobs.resize(num_blobs);
+
+	LOG(DEBUG)
+		<< "opened indexed brep file " << path << " containing "
+		<< num_solids << " solids in " << num_blobs << " blobs\n";
+
+	return true;
+}
+
+const TopoDS_Shape &
+indexed_brep_reader::read_solid(size_t i)
+{
+	const auto loc = solid_locations.at(i);
+	auto &blob = loaded_blobs[loc.first];
+
+	if (blob.empty()) {
+		const uint64_t
+			begin = blob_offsets[loc.first],
+			end = blob_offsets[loc.first + 1];
+
+		memory_streambuf buf{data + begin, end - begin};
+		std::istream input{&buf};
+
+		TopoDS_Shape compound;
+		BinTools::Read(compound, input);
+
+		for (TopoDS_Iterator it{compound}; it.More(); it.Next()) {
+			blob.push_back(it.Value());
+		}
+	}
+
+	if (loc.second >= blob.size()) {
+		LOG(FATAL) << "solid " << i << " missing from indexed brep file\n";
+		std::exit(1);
+	}
+
+	return blob[loc.second];
+}
+
+
+#ifdef INCLUDE_TESTS
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <TopExp.hxx>
+#include <TopTools_IndexedMapOfShape.hxx>
+#include <gp_Trsf.hxx>
+#include <TopLoc_Location.hxx>
+
+TEST_CASE("indexed brep file") {
+	using Catch::Approx;
+
+	const temp_file file{"indexed_brep_test"};
+	const char *path = file.path();
+
+	const auto cube = BRepPrimAPI_MakeBox(gp_Pnt(0, 0, 0), 1, 1, 1).Shape();
+	gp_Trsf trsf;
+	trsf.SetTranslation({5, 0, 0});
+
+	const std::vector<TopoDS_Shape> solids = {
+		cube,
+		BRepPrimAPI_MakeBox(gp_Pnt(0, 2, 0), 2, 2, 2).Shape(),
+		// shares topology with the first
+		cube.Moved(TopLoc_Location{trsf}),
+	};
+
+	REQUIRE(write_indexed_brep_file(path, solids));
+	CHECK(is_indexed_brep_file(path));
+
+	indexed_brep_reader reader;
+	REQUIRE(reader.open(path));
+	REQUIRE(reader.num_solids() == 3);
+
+	SECTION("read out of order") {
+		CHECK(volume_of_shape(reader.read_solid(1)) == Approx(8));
+		CHECK(volume_of_shape(reader.read_solid(2)) == Approx(1));
+		CHECK(volume_of_shape(reader.read_solid(0)) == Approx(1));
+	}
+
+	SECTION("shared topology is kept") {
+		const auto &a = reader.read_solid(0), &b = reader.read_solid(2);
+		CHECK(a.TShape() == b.TShape());
+		CHECK(!a.IsEqual(b));
+	}
+
+	SECTION("text brep isn't indexed") {
+		std::ofstream{path} << "DBRep_DrawableShape\n";
+		CHECK_FALSE(is_indexed_brep_file(path));
+	}
+}
+#endif
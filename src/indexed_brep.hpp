@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <TopoDS_Shape.hxx>
+
+
+/* binary container for solids with an index, so tools that only need a few
+ * solids don't have to parse the whole file.
+ *
+ * solids are grouped by shared verticies (see groups_sharing_verticies) and
+ * each group is written with BinTools as a compound, so topology shared
+ * between solids survives being written out. the header has an offset
+ * table for these blobs, and a table of which blob and position each solid
+ * is at. numbers are stored in native byte order, a marker in the header
+ * means files from other platforms are rejected.
+ */
+class indexed_brep_reader {
+	int fd;
+	const char *data;
+	size_t size;
+
+	// blob and position within it of each solid
+	std::vector<std::pair<uint64_t, uint64_t>> solid_locations;
+	std::vector<uint64_t> blob_offsets;
+
+	// each blob is only read once, solids in the same blob are likely to be
+	// wanted together
+	std::vector<std::vector<TopoDS_Shape>> loaded_blobs;
+
+	void close();
+
+public:
+	indexed_brep_reader() : fd{-1}, data{nullptr}, size{0} {}
+	~indexed_brep_reader() {
+		close();
+	}
+
+	indexed_brep_reader(const indexed_brep_reader &) = delete;
+	indexed_brep_reader& operator=(const indexed_brep_reader &) = delete;
+
+	// memory maps the file and reads the index, returns false with a logged
+	// error on failure
+	bool open(const char *path);
+
+	size_t num_solids() const {
+		return solid_locations.size();
+	}
+
+	// deserialises the blob containing solid i if needed
+	const TopoDS_Shape &read_solid(size_t i);
+};
+
+// checks for the magic number at the start of the file
+bool is_indexed_brep_file(const char *path);
+
+// returns false with a logged error on failure
+bool write_indexed_brep_file(const char *path, const std::vector<TopoDS_Shape> &solids);
+
+// files with this extension are written as indexed BREP files
+bool has_indexed_brep_extension(const std::string &path);
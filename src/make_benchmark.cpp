@@ -0,0 +1,172 @@
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include <aixlog.hpp>
+
+#include <BRepAlgoAPI_Cut.hxx>
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+#include <BRepPrimAPI_MakeTorus.hxx>
+#include <gp_Ax2.hxx>
+#include <gp_Pnt.hxx>
+
+#include "geometry.hpp"
+#include "properties_file.hpp"
+#include "utils.hpp"
+#include "thread_pool.hpp"
+
+
+/* generates models for tests/benchmark.py, each the cases that are hard for
+ * one part of the pipeline, at any scale */
+
+// rows by columns of unit cubes, each touching the faces, edges and
+// verticies of its neighbours. overlap makes each cube longer, so neighbours
+// overlap by that much instead
+static void
+make_grid(document &doc, size_t rows, size_t columns, double overlap)
+{
+	for (size_t i = 0; i < rows; i++) {
+		for (size_t j = 0; j < columns; j++) {
+			doc.solid_shapes.push_back(
+				BRepPrimAPI_MakeBox(gp_Pnt(double(i), double(j), 0), 1 + overlap, 1 + overlap, 1).Shape());
+		}
+	}
+}
+
+// groups of concentric spherical shells, each touching the shells either
+// side. every pair in a group has overlapping bounding boxes, but only
+// neighbouring shells touch
+static void
+make_nested(document &doc, size_t groups, size_t depth)
+{
+	const double spacing = 2 * double(depth) + 1;
+	for (size_t g = 0; g < groups; g++) {
+		const gp_Pnt centre{double(g) * spacing, 0, 0};
+		for (size_t k = 0; k < depth; k++) {
+			const TopoDS_Shape outer = BRepPrimAPI_MakeSphere(centre, double(k + 1)).Shape();
+			if (k == 0) {
+				doc.solid_shapes.push_back(outer);
+			} else {
+				const TopoDS_Shape inner = BRepPrimAPI_MakeSphere(centre, double(k)).Shape();
+				doc.solid_shapes.push_back(BRepAlgoAPI_Cut(outer, inner).Shape());
+			}
+		}
+	}
+}
+
+// cylinders with a torus around each whose hole is wider than the cylinder,
+// so their bounding boxes overlap but the solids are distinct
+static void
+make_tori(document &doc, size_t count)
+{
+	size_t side = 1;
+	while (side * side < count) {
+		side += 1;
+	}
+
+	const double spacing = 7;
+	for (size_t n = 0; n < count; n++) {
+		const double x = double(n % side) * spacing, y = double(n / side) * spacing;
+		doc.solid_shapes.push_back(
+			BRepPrimAPI_MakeCylinder(gp_Ax2(gp_Pnt(x, y, 0), gp::DZ()), 1, 4).Shape());
+		doc.solid_shapes.push_back(
+			BRepPrimAPI_MakeTorus(gp_Ax2(gp_Pnt(x, y, 2), gp::DZ()), 2.5, 0.5).Shape());
+	}
+}
+
+// parses "name:A" or "name:AxB"
+static bool
+parse_spec(const std::string &spec, std::string &name, size_t &a, size_t &b)
+{
+	const auto colon = spec.find(':');
+	if (colon == std::string::npos) {
+		return false;
+	}
+	name = spec.substr(0, colon);
+
+	const auto rest = spec.substr(colon + 1);
+	const auto cross = rest.find('x');
+	b = 0;
+	if (cross == std::string::npos) {
+		return size_t_of_string(rest.c_str(), a, 10) && a > 0;
+	}
+	return
+		size_t_of_string(rest.substr(0, cross).c_str(), a, 10) && a > 0 &&
+		size_t_of_string(rest.substr(cross + 1).c_str(), b, 10) && b > 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	configure_aixlog();
+
+	profile_writer profile;
+
+	std::string spec, path_out;
+	unsigned num_parallel_jobs = 1;
+	double overlap = 0;
+
+	{
+		const char *doc = (
+			"Generate a model for benchmarking, writing it to a BREP file along with its properties.\n"
+			"\n"
+			"MODEL is one of: "
+			"'grid:RxC' for R rows by C columns of touching cubes, "
+			"'nested:GxD' for G groups of D concentric spherical shells, or "
+			"'tori:N' for N cylinders each inside a torus.");
+		const char *usage = "MODEL output.brep";
+
+		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+		argp.add_option(
+			{"overlap", 1024, "F", 0, "Make grid cubes overlap their neighbours by F rather than touching", 0},
+			overlap);
+
+		if (!argp.parse(argc, argv, usage, doc)) {
+			return 1;
+		}
+
+		const auto &args = argp.arguments();
+		assert(args.size() == 2);
+		spec = args[0];
+		path_out = args[1];
+
+		if (!(overlap >= 0 && overlap < 1)) {
+			LOG(ERROR) << "Overlap should be in [0, 1), not " << overlap << '\n';
+			return 1;
+		}
+	}
+
+	std::string name;
+	size_t a, b;
+	if (!parse_spec(spec, name, a, b)) {
+		LOG(ERROR) << "unable to parse model '" << spec << "'\n";
+		return 1;
+	}
+
+	document doc;
+	if (name == "grid" && b > 0) {
+		make_grid(doc, a, b, overlap);
+	} else if (name == "nested" && b > 0) {
+		make_nested(doc, a, b);
+	} else if (name == "tori" && b == 0) {
+		make_tori(doc, a);
+	} else {
+		LOG(ERROR) << "unknown model '" << spec << "'\n";
+		return 1;
+	}
+
+	LOG(INFO) << "generated " << doc.solid_shapes.size() << " solids\n";
+
+	doc.write_brep_file(path_out.c_str());
+
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
+	write_properties_file(path_out, compute_properties(doc, pool));
+
+	return 0;
+}
@@ -1,10 +1,20 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <utility>
+#include <vector>
 
 #include <aixlog.hpp>
 
 #include <BRepTools.hxx>
+#include <BRep_Tool.hxx>
+
+#include <Geom_Surface.hxx>
+#include <TopLoc_Location.hxx>
+
+#include <TopExp.hxx>
+#include <TopTools_IndexedMapOfShape.hxx>
+#include <TopoDS.hxx>
 
 #include <TopoDS_Iterator.hxx>
 #include <TopoDS_Builder.hxx>
@@ -15,15 +25,86 @@
 #include "salome/geom_gluer.hxx"
 
 #include "geometry.hpp"
+#include "properties_file.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
 
+// gluing replaces sub-shapes with coincident ones from other solids, so a
+// solid whose faces still lie on the same surfaces, with the same number of
+// edges, can't have changed volume. much cheaper than integrating it
+static bool
+same_geometry(const TopoDS_Shape &a, const TopoDS_Shape &b)
+{
+	if (a.IsSame(b)) {
+		return true;
+	}
+
+	TopTools_IndexedMapOfShape faces_a, faces_b, edges_a, edges_b;
+	TopExp::MapShapes(a, TopAbs_FACE, faces_a);
+	TopExp::MapShapes(b, TopAbs_FACE, faces_b);
+	TopExp::MapShapes(a, TopAbs_EDGE, edges_a);
+	TopExp::MapShapes(b, TopAbs_EDGE, edges_b);
+	if (faces_a.Extent() != faces_b.Extent() || edges_a.Extent() != edges_b.Extent()) {
+		return false;
+	}
+
+	// the surfaces stored in each face, which a and b keep alive, rather than
+	// BRep_Tool::Surface(face) as that returns a new copy for located faces
+	using located_surface = std::pair<const Geom_Surface *, TopLoc_Location>;
+	auto surfaces_of = [](const TopTools_IndexedMapOfShape &faces) {
+		std::vector<located_surface> result;
+		for (int i = 1; i <= faces.Extent(); i++) {
+			TopLoc_Location loc;
+			const auto &surface = BRep_Tool::Surface(TopoDS::Face(faces(i)), loc);
+			result.emplace_back(surface.get(), loc);
+		}
+		std::sort(result.begin(), result.end(), [](const located_surface &x, const located_surface &y) {
+			return x.first < y.first;
+		});
+		return result;
+	};
+
+	const auto surfaces_a = surfaces_of(faces_a), surfaces_b = surfaces_of(faces_b);
+
+	// locations aren't ordered, so match them up within each run of faces on
+	// the same surface
+	for (size_t i = 0; i < surfaces_a.size();) {
+		size_t end = i;
+		while (end < surfaces_a.size() && surfaces_a[end].first == surfaces_a[i].first) {
+			end += 1;
+		}
+
+		std::vector<bool> used(end - i);
+		for (size_t j = i; j < end; j++) {
+			if (surfaces_b[j].first != surfaces_a[i].first) {
+				return false;
+			}
+
+			bool found = false;
+			for (size_t k = i; k < end && !found; k++) {
+				if (!used[k - i] && surfaces_a[j].second.IsEqual(surfaces_b[k].second)) {
+					used[k - i] = found = true;
+				}
+			}
+			if (!found) {
+				return false;
+			}
+		}
+		i = end;
+	}
+	return true;
+}
+
 int
 main(int argc, char **argv)
 {
 	configure_aixlog();
 
+	profile_writer profile;
+
 	std::string path_in, path_out;
+	unsigned num_parallel_jobs = 1;
 
 	{
 		const char * doc = (
@@ -31,6 +112,8 @@ main(int argc, char **argv)
 		const char * usage = "input.brep output.brep";
 
 		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
 
 		if (!argp.parse(argc, argv, usage, doc)) {
 			return 1;
@@ -52,10 +135,13 @@ main(int argc, char **argv)
 		builder.Add(merged, shape);
 	}
 
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
 	document out;
 
 	{
-		const auto result = salome_glue_shape(merged, 0.001);
+		const auto result = salome_glue_shape(merged, 0.001, pool);
 
 		for (TopoDS_Iterator it{result}; it.More(); it.Next()) {
 			out.solid_shapes.emplace_back(it.Value());
@@ -72,11 +158,40 @@ main(int argc, char **argv)
 		std::exit(1);
 	}
 
+	const size_t num_solids = inp.solid_shapes.size();
+
+	std::vector<char> unchanged(num_solids);
+	{
+		parfor work;
+		for (size_t i = 0; i < num_solids; i++) {
+			work.submit(pool, [&inp, &out, &unchanged, i]() {
+				unchanged[i] = same_geometry(inp.solid_shapes[i], out.solid_shapes[i]);
+			});
+		}
+	}
+
+	// only solids changed by gluing need their properties recomputed for
+	// the output, these also give the volumes needed below
+	const auto inp_props = load_or_compute_properties(inp, path_in, pool);
+	auto out_props = inp_props;
+	{
+		std::vector<size_t> changed;
+		for (size_t i = 0; i < num_solids; i++) {
+			if (!unchanged[i]) {
+				changed.push_back(i);
+			}
+		}
+		LOG(DEBUG)
+			<< changed.size() << " of " << num_solids
+			<< " solids were changed by gluing\n";
+		update_properties(out, changed, out_props, pool);
+	}
+
 	size_t num_changed = 0;
-	for (size_t i = 0; i < inp.solid_shapes.size(); i++) {
+	for (size_t i = 0; i < num_solids; i++) {
 		const double
-			v1 = volume_of_shape(inp.solid_shapes[i]),
-			v2 = volume_of_shape(out.solid_shapes[i]),
+			v1 = inp_props[i].volume,
+			v2 = out_props[i].volume,
 			mn = std::min(v1, v2) * 0.001;
 
 		if (std::fabs(v1 - v2) > mn) {
@@ -92,6 +207,7 @@ main(int argc, char **argv)
 	}
 
 	out.write_brep_file(path_out.c_str());
+	write_properties_file(path_out, out_props);
 
 	return 0;
 }
@@ -1,100 +1,142 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
-#include <iomanip>
+#include <cstring>
+#include <fstream>
 #include <ios>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
 #include <vector>
 
-#include <BRepBndLib.hxx>
-#include <Bnd_OBB.hxx>
-#include <OSD_Parallel.hxx>
-#include <OSD_ThreadPool.hxx>
+#include <Standard_Version.hxx>
+
+#include <BRepTools.hxx>
+#include <TopoDS_Builder.hxx>
+#include <TopoDS_Compound.hxx>
 
 #include <cxx_argp_parser.h>
 #include <aixlog.hpp>
 
+#include "checkpoint.hpp"
 #include "geometry.hpp"
+#include "pair_checker.hpp"
+#include "process_pool.hpp"
+#include "properties_file.hpp"
+#include "result_cache.hpp"
 #include "utils.hpp"
 #include "thread_pool.hpp"
+#include "triangle_mesh.hpp"
 
 
-struct worker_state {
-	const document &doc;
-	std::vector<double> &fuzzy_values;
-	unsigned pave_time_millisecs;
-};
-
-struct worker_output {
-	size_t hi, lo;
-	intersect_result result;
-};
+// anything apart from the solids themselves that could change how a pair is
+// classified, timeouts aren't cached so the time limit isn't included
+static uint64_t
+hash_of_settings(const std::vector<double> &fuzzy_values)
+{
+	std::stringstream stream;
+	stream << OCC_VERSION_COMPLETE << std::hexfloat;
+	for (const auto fuzzy_value : fuzzy_values) {
+		stream << ',' << fuzzy_value;
+	}
+	return hash_of_string(stream.str());
+}
 
-static worker_output
-shape_classifier(const worker_state& state, size_t hi, size_t lo)
+// identifies the pairs being checked, on which solids and how, so a
+// checkpoint from a different run isn't resumed. options has anything else
+// that changes results or the summary
+static uint64_t
+hash_of_run(
+	uint64_t settings, std::string_view options,
+	const std::vector<solid_properties> &solids,
+	const std::vector<std::pair<size_t, size_t>> &pairs)
 {
-	const auto &shape = state.doc.solid_shapes[hi];
-	const auto &tool = state.doc.solid_shapes[lo];
+	std::stringstream stream;
+	stream << std::hex << settings << ',' << options << std::hexfloat;
+	for (const auto &solid : solids) {
+		stream << ',' << solid.volume;
+	}
+	uint64_t hash = hash_of_string(stream.str());
 
-	intersect_result result;
+	// there can be millions of pairs, so hashed a pair at a time
+	for (const auto &[hi, lo] : pairs) {
+		char buf[48];
+		const int n = std::snprintf(buf, sizeof(buf), "%zu,%zu;", hi, lo);
+		hash = hash_of_string(std::string_view(buf, size_t(n)), hash);
+	}
+	return hash;
+}
 
-	std::stringstream msg;
-	msg << "CSI(" << hi << ", " << lo << ")";
+// columns spanning the overlap of each pair's bounding boxes when estimating
+// common volumes from meshes
+static const unsigned approximate_resolution = 64;
 
-	bool first = true;
-	for (const auto fuzzy_value : state.fuzzy_values) {
-		if (!first) {
-			LOG(INFO)
-				<< indexpair_to_string(hi, lo) << " imprint failed with "
-				<< '(' << result.num_filler_warnings << " filler and "
-				<< result.num_common_warnings << " common) "
-				<< "warnings, retrying with tolerance=" << fuzzy_value << '\n';
-		}
+// very rough working set of the pave filler and booleans for each unit of
+// estimate_intersection_cost, used to keep pairs within --max-memory
+static const double bytes_per_unit_cost = 16 * 1024;
 
-		try {
-			result = classify_solid_intersection(
-				shape, tool, fuzzy_value, state.pave_time_millisecs,
-				msg.str().c_str());
-		} catch (const std::exception &ex) {
-			LOG(FATAL)
-				<< indexpair_to_string(hi, lo)
-				<< " classifying intersection failed: "
-				<< ex.what() << '\n';
-			abort();
-		}
+// very rough size of what IntTools_Context keeps for each face, or each
+// shape paving splits off, used to turn --context-cache into a number of
+// faces
+static const size_t bytes_per_cached_face = 64 * 1024;
 
-		// try again with less fuzz
-		if (result.status != intersect_status::failed) {
-			break;
+// solids common to each overlapping pair, computing any that weren't kept
+// while classifying. ordered by the pair's solid indices, so the output
+// matches overlap_collecter given the sorted CSV
+static bool
+write_common_solids(
+	const std::string &path, const document &doc,
+	const std::vector<std::pair<size_t, size_t>> &pairs,
+	std::vector<std::pair<size_t, double>> overlapping,
+	std::vector<TopoDS_Shape> &commons, thread_pool &pool)
+{
+	profile_scope scope{"write common"};
+	std::sort(overlapping.begin(), overlapping.end(), [&pairs](const auto &a, const auto &b) {
+		return pairs[a.first] < pairs[b.first];
+	});
+
+	{
+		parfor work;
+		for (const auto &[i, fuzzy_value] : overlapping) {
+			if (!commons[i].IsNull()) {
+				continue;
+			}
+			work.submit(pool, [&doc, &pairs, &commons, i = i, fuzzy_value = fuzzy_value]() {
+				commons[i] = common_of_solids(
+					doc.solid_shapes[pairs[i].first],
+					doc.solid_shapes[pairs[i].second],
+					fuzzy_value);
+			});
 		}
 	}
 
-	if (result.status == intersect_status::failed) {
-		LOG(WARNING)
-			<< indexpair_to_string(hi, lo) << " imprint failed with "
-			<< '(' << result.num_filler_warnings << " filler and "
-			<< result.num_common_warnings << " common) "
-			<< "warnings\n";
+	TopoDS_Compound merged;
+	TopoDS_Builder builder;
+	builder.MakeCompound(merged);
+	for (const auto &item : overlapping) {
+		const size_t i = item.first;
+		if (commons[i].IsNull()) {
+			LOG(ERROR)
+				<< indexpair_to_string(pairs[i].first, pairs[i].second)
+				<< " unable to determine solid common to shapes\n";
+			return false;
+		}
+		builder.Add(merged, commons[i]);
 	}
 
-	return {hi, lo, result};
-}
-
-
-// "OBB" stands for "orientated bounding-box", i.e. aligned to the shape
-// rather than the axis
-static bool
-are_bboxs_disjoint(const Bnd_OBB &b1, const Bnd_OBB& b2, double tolerance)
-{
-	if (tolerance > 0) {
-		Bnd_OBB e1{b1}, e2{b2};
-		e1.Enlarge(tolerance);
-		e2.Enlarge(tolerance);
-		return e1.IsOut(e2);
+	LOG(DEBUG) << "writing " << overlapping.size() << " common solids to " << path << '\n';
+	if (!BRepTools::Write(merged, path.c_str())) {
+		LOG(FATAL) << "failed to write brep file " << path << '\n';
+		return false;
 	}
-	return b1.IsOut(b2);
+	return true;
 }
 
 int
@@ -102,10 +144,26 @@ main(int argc, char **argv)
 {
 	configure_aixlog();
 
-	std::string path_in;
+	profile_writer profile;
+
+	std::string path_in, path_result_cache, path_cost_report, path_checkpoint;
 	bool enable_intel_tbb = false;
 	unsigned num_parallel_jobs = 1;
 	unsigned pave_time_seconds = 60;
+	bool distance_prefilter = false;
+	unsigned distance_time_millisecs = 1000;
+	bool fast_classification = false;
+	bool approximate = false;
+	double approximate_deflection = 0.001;
+	size_t max_memory = 0;
+	size_t context_cache_bytes = 0;
+	bool isolate = false;
+	bool adaptive_tolerance = false;
+	unsigned split_num_faces = 0;
+	bool hybrid_parallel = false;
+	bool resume = false;
+	std::string path_common;
+	size_t shard_index = 0, num_shards = 1;
 	double
 		bbox_clearance = 0.5,
 		max_common_volume_ratio = 0.01;
@@ -124,12 +182,6 @@ main(int argc, char **argv)
 
 		std::stringstream stream;
 
-		stream
-			<< "Parallelise over N[=" << num_parallel_jobs << "] threads, leave N blank "
-			"to use all (" << std::thread::hardware_concurrency() << ") cores.";
-		auto help_num_par_jobs = stream.str();
-		stream = {};
-
 		stream << "Bounding-boxes closer than C[=" << bbox_clearance << "] will be checked for overlaps";
 		auto help_bbox_cl = stream.str();
 		stream = {};
@@ -152,45 +204,63 @@ main(int argc, char **argv)
 		auto help_pave_time_seconds = stream.str();
 		stream = {};
 
-		auto parse_parallel = [&num_parallel_jobs](int, const char* arg, struct argp_state* state) {
+		auto parse_shard = [&shard_index, &num_shards](int, const char* arg, struct argp_state* state) {
+			size_t k = 0, n = 0;
+			const char *slash = std::strchr(arg, '/');
+			if (!slash ||
+				!size_t_of_string(std::string(arg, slash).c_str(), k, 10) ||
+				!size_t_of_string(slash + 1, n, 10) ||
+				k < 1 || k > n) {
+				argp_error(
+					state, "shard should be K/N with 1 <= K <= N, not '%s'",
+					arg);
+			}
+			shard_index = k - 1;
+			num_shards = n;
+			return 0;
+		};
+
+		auto parse_approximate = [&approximate, &approximate_deflection](int, const char* arg, struct argp_state* state) {
+			approximate = true;
 			if (!arg) {
-				num_parallel_jobs = std::thread::hardware_concurrency();
-				LOG(DEBUG)
-					<< "Using " << num_parallel_jobs << " threads for parallel computation\n";
 				return 0;
 			}
-
-			// sanity checking user input
-			const long parallel_job_limit = 9999;
-			long n;
-			size_t end;
-			try {
-				n = std::stol(arg, &end);
-			} catch(std::exception &err) {
+			char *end;
+			const double deflection = std::strtod(arg, &end);
+			if (end == arg || *end != '\0' || !(deflection > 0 && deflection < 1)) {
 				argp_error(
-					state, "not a valid number: '%s'",
+					state, "mesh deflection should be between 0 and 1, not '%s'",
 					arg);
 			}
-			if (arg[end] != '\0') {
+			approximate_deflection = deflection;
+			return 0;
+		};
+
+		auto parse_max_memory = [&max_memory](int, const char* arg, struct argp_state* state) {
+			if (!bytes_of_string(arg, max_memory)) {
 				argp_error(
-					state, "trailing characters after number in '%s'",
+					state, "memory should be a number of bytes with an optional K, M, G or T suffix, not '%s'",
 					arg);
 			}
-			// make sure the user isn't doing anything silly
-			else if (n < 1 || n > parallel_job_limit) {
+			return 0;
+		};
+
+		auto parse_context_cache = [&context_cache_bytes](int, const char* arg, struct argp_state* state) {
+			if (!bytes_of_string(arg, context_cache_bytes)) {
 				argp_error(
-					state, "number of parallel jobs should be between 1 and %li, not %li",
-					parallel_job_limit, n);
-			} else {
-				num_parallel_jobs = unsigned(n);
+					state, "memory should be a number of bytes with an optional K, M, G or T suffix, not '%s'",
+					arg);
 			}
 			return 0;
 		};
 
 		tool_argp_parser argp(1);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+		argp.add_distance_prefilter_option(distance_prefilter, distance_time_millisecs);
 		argp.add_option(
-			{"jobs", 'j', "N", OPTION_ARG_OPTIONAL, help_num_par_jobs.c_str(), 0},
-			std::function{parse_parallel});
+			{"shard", 1030, "K/N", 0, "Only check the K'th of N similarly expensive subsets of pairs, for spreading work over machines", 0},
+			std::function{parse_shard});
 		argp.add_option(
 			{"bbox-clearance", 1024, "C", 0, help_bbox_cl.c_str(), 0}, bbox_clearance);
 		argp.add_option(
@@ -201,6 +271,45 @@ main(int argc, char **argv)
 			{"enable-intel_tbb", 1027, 0, 0, "Enable OCCT use of Intel TBB, disabled by default as it gets in the way of our parallelism", -1}, enable_intel_tbb);
 		argp.add_option(
 			{"time-per-pair", 1028, "T", 0, help_pave_time_seconds.c_str(), -1}, pave_time_seconds);
+		argp.add_option(
+			{"result-cache", 1029, "FILE", 0, "Reuse results for unchanged pairs from FILE, appending new results to it", 0},
+			path_result_cache);
+		argp.add_option(
+			{"fast-classification", 1033, 0, 0, "Derive cut volumes of overlapping pairs from solid volumes rather than building the cuts", -1},
+			fast_classification);
+		argp.add_option(
+			{"approximate", 1034, "D", OPTION_ARG_OPTIONAL, "Classify pairs from meshes with deflection D[=0.001] relative to each solid's size, only paving those near the common volume ratio", 0},
+			std::function{parse_approximate});
+		argp.add_option(
+			{"max-memory", 1035, "SIZE", 0, "Hold back expensive pairs while their estimated memory use would exceed SIZE, e.g. 16G", 0},
+			std::function{parse_max_memory});
+		argp.add_option(
+			{"isolate", 1036, 0, 0, "Check pairs in forked worker processes, killing any that crash or take much longer than the time per pair", 0},
+			isolate);
+		argp.add_option(
+			{"write-common", 1037, "FILE", 0, "Write the solids common to each overlapping pair to BREP FILE, like overlap_collecter", 0},
+			path_common);
+		argp.add_option(
+			{"adaptive-tolerance", 1038, 0, 0, "Learn which imprint tolerance tends to succeed for each kind of pair, and try that first", 0},
+			adaptive_tolerance);
+		argp.add_option(
+			{"split-faces", 1039, "N", 0, "Check pairs with at least N faces between them for contact in parallel, face by face, before paving", 0},
+			split_num_faces);
+		argp.add_option(
+			{"hybrid-parallel", 1040, 0, 0, "Once fewer pairs remain than jobs, let the remaining pairs use the idle threads themselves", 0},
+			hybrid_parallel);
+		argp.add_option(
+			{"checkpoint", 1041, "FILE", 0, "Record each finished pair in FILE, so an interrupted run can be resumed", 0},
+			path_checkpoint);
+		argp.add_option(
+			{"resume", 1042, 0, 0, "Skip pairs already recorded in the checkpoint file, reporting their results again", 0},
+			resume);
+		argp.add_option(
+			{"context-cache", 1043, "SIZE", 0, "Keep up to SIZE, e.g. 4G, of per-solid preprocessing between pairs, shared out between jobs", 0},
+			std::function{parse_context_cache});
+		argp.add_option(
+			{"cost-report", 1031, "FILE", 0, "Write predicted cost and actual time of each pair to FILE, for tuning the scheduler", -1},
+			path_cost_report);
 
 		if (!argp.parse(argc, argv, usage, doc)) {
 			return 1;
@@ -225,6 +334,11 @@ main(int argc, char **argv)
 			}
 		}
 
+		if (resume && path_checkpoint.empty()) {
+			LOG(ERROR) << "--resume needs a --checkpoint file to resume from\n";
+			return 1;
+		}
+
 		if (!(max_common_volume_ratio >= 0 && max_common_volume_ratio <= 1)) {
 			LOG(ERROR)
 				<< "Maximum common volume ratio should be in (0, 1).\n";
@@ -232,22 +346,13 @@ main(int argc, char **argv)
 		}
 	}
 
-	// flags to control OCCT's unwanted use of background threads
-	if (enable_intel_tbb) {
-		OSD_Parallel::SetUseOcctThreads (false);
-	} else {
-		OSD_Parallel::SetUseOcctThreads (true);
-
-		// disable OCCT thread pool, reinitialising if needed
-		auto pool = OSD_ThreadPool::DefaultPool(1);
-		if (pool->NbThreads() != 1) {
-			pool->Init(1);
-		}
+	// worker processes would each start their own threads
+	if (hybrid_parallel && isolate) {
+		LOG(WARNING) << "--hybrid-parallel has no effect with --isolate\n";
+		hybrid_parallel = false;
 	}
 
-	LOG(TRACE)
-		<< "OSD_Parallel::ToUseOcctThreads() = " << OSD_Parallel::ToUseOcctThreads() << "\n"
-		<< "OSD_ThreadPool::NbThreads() = " << OSD_ThreadPool::DefaultPool()->NbThreads() << "\n";
+	configure_occt_threads(enable_intel_tbb, hybrid_parallel ? num_parallel_jobs : 1);
 
 	document doc;
 	doc.load_brep_file(path_in.c_str());
@@ -255,53 +360,353 @@ main(int argc, char **argv)
 	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
 	thread_pool pool(num_parallel_jobs);
 
-	LOG(INFO) << "calculating " << doc.solid_shapes.size() << " bounding boxes\n";
+	const bool use_cache = !path_result_cache.empty();
+	result_cache cache;
+	if (use_cache && !cache.open(path_result_cache.c_str(), hash_of_settings(imprint_tolerances))) {
+		LOG(FATAL) << "unable to open result cache " << path_result_cache << '\n';
+		return 1;
+	}
 
-	std::vector<Bnd_OBB> bounding_boxes(doc.solid_shapes.size());
-	std::vector<double> volumes(doc.solid_shapes.size());
+	// bounding boxes and volumes are saved by the tools that write BREP
+	// files, otherwise they're computed now
+	const auto solids = load_or_compute_properties(doc, path_in, pool);
 
-	{
+	std::vector<uint64_t> shape_hashes(use_cache ? doc.solid_shapes.size() : 0);
+	if (use_cache) {
 		parfor work;
-		size_t i = 0;
-		for (const auto &shape : doc.solid_shapes) {
-			work.submit(pool, [&bounding_boxes, &volumes, i, &shape]() {
-				BRepBndLib::AddOBB(shape, bounding_boxes[i]);
-
-				volumes[i] = volume_of_shape(shape);
+		for (size_t i = 0; i < doc.solid_shapes.size(); i++) {
+			work.submit(pool, [&doc, &shape_hashes, i]() {
+				shape_hashes[i] = hash_of_shape(doc.solid_shapes[i]);
 			});
-			i += 1;
 		}
 	}
 
+	auto candidates = find_candidate_pairs(solids, bbox_clearance);
+	auto &pairs = candidates.pairs;
+	auto &costs = candidates.costs;
+
+	const size_t num_solids = doc.solid_shapes.size();
+	const unsigned long num_pairs = num_solids < 2 ? 0 : num_solids * (num_solids - 1) / 2;
+
 	unsigned long
-		num_bbox_tests = 0,
+		num_cached = 0,
+		num_resumed = 0,
 		num_to_process = 0,
-		num_processed = 0,
-		num_failed = 0,
-		num_touching = 0,
-		num_overlaps = 0,
-		num_bad_overlaps = 0;
+		num_processed = 0;
+
+	result_reporter reporter{solids, max_common_volume_ratio, pave_time_seconds};
+
+	if (num_shards > 1) {
+		// balance the estimated work between shards
+		const auto shards = partition_by_cost(costs, num_shards);
+
+		std::vector<std::pair<size_t, size_t>> shard_pairs;
+		std::vector<double> shard_costs;
+		for (size_t i = 0; i < pairs.size(); i++) {
+			if (shards[i] == shard_index) {
+				shard_pairs.push_back(pairs[i]);
+				shard_costs.push_back(costs[i]);
+			}
+		}
+
+		LOG(INFO)
+			<< "shard " << (shard_index + 1) << '/' << num_shards << " contains "
+			<< shard_pairs.size() << " of " << pairs.size() << " pairs\n";
+
+		pairs.swap(shard_pairs);
+		costs.swap(shard_costs);
+	}
+
+	const auto order = order_by_decreasing_cost(costs);
+
+	// opened once the pairs are known, so they're part of the fingerprint
+	const bool use_checkpoint = !path_checkpoint.empty();
+	checkpoint_journal journal;
+	if (use_checkpoint) {
+		std::stringstream options;
+		options
+			<< std::hexfloat
+			<< approximate << ',' << approximate_deflection << ','
+			<< max_common_volume_ratio << ','
+			<< fast_classification << ','
+			<< distance_prefilter << ',' << distance_time_millisecs << ','
+			<< split_num_faces << ','
+			<< pave_time_seconds << ','
+			<< adaptive_tolerance;
+
+		// logs why it couldn't be opened
+		if (!journal.open(
+				path_checkpoint.c_str(),
+				hash_of_run(hash_of_settings(imprint_tolerances), options.str(), solids, pairs),
+				resume)) {
+			return 1;
+		}
+	}
+
+	// each solid is meshed once, however many pairs it's in
+	std::vector<triangle_mesh> meshes(approximate ? num_solids : 0);
+	if (approximate) {
+		std::vector<bool> needed(num_solids);
+		for (const auto &pair : pairs) {
+			needed[pair.first] = needed[pair.second] = true;
+		}
+
+		{
+			parfor work;
+			for (size_t i = 0; i < num_solids; i++) {
+				if (!needed[i]) {
+					continue;
+				}
+				work.submit(pool, [&doc, &meshes, approximate_deflection, i]() {
+					meshes[i] = mesh_of_solid(doc.solid_shapes[i], approximate_deflection);
+				});
+			}
+		}
+
+		size_t num_meshed = 0, num_invalid = 0;
+		for (size_t i = 0; i < num_solids; i++) {
+			if (needed[i]) {
+				num_meshed += 1;
+				if (!meshes[i].valid) {
+					LOG(WARNING) << "unable to mesh solid " << i << ", pairs including it will be paved\n";
+					num_invalid += 1;
+				}
+			}
+		}
+		LOG(INFO) << "meshed " << num_meshed << " solids, " << num_invalid << " failed\n";
+	}
+
+	std::ofstream cost_report;
+	if (!path_cost_report.empty()) {
+		cost_report.open(path_cost_report);
+		if (!cost_report.is_open()) {
+			LOG(FATAL) << "unable to open cost report " << path_cost_report << '\n';
+			return 1;
+		}
+		cost_report << "hi,lo,predicted_cost,pave_time_seconds,elapsed_seconds\n";
+	}
 
 	{
-		const struct worker_state state{doc, imprint_tolerances, pave_time_seconds * 1000};
-		asyncmap<worker_output> map;
+		struct worker_state state{doc, imprint_tolerances, pave_time_seconds * 1000};
+		state.distance_prefilter = distance_prefilter;
+		state.distance_time_millisecs = distance_time_millisecs;
+		state.derive_cut_volumes = fast_classification;
 
-		for (size_t hi = 1; hi < doc.solid_shapes.size(); hi++) {
-			for (size_t lo = 0; lo < hi; lo++) {
-				num_bbox_tests += 1;
+		state.solids = &solids;
 
-				// seems reasonable to assume majority of shapes aren't close to
-				// overlapping, so check with coarser limit first
-				if (are_bboxs_disjoint(
-						bounding_boxes[hi], bounding_boxes[lo], bbox_clearance)) {
+		// worker processes don't have the pool's threads
+		if (split_num_faces > 0 && !isolate) {
+			state.split_pool = &pool;
+			state.split_num_faces = split_num_faces;
+		}
+
+		// each job has its own cache, see context_cache
+		if (context_cache_bytes > 0) {
+			state.context_cache_faces = std::max<size_t>(
+				1, context_cache_bytes / std::max(num_parallel_jobs, 1u) / bytes_per_cached_face);
+			LOG(DEBUG)
+				<< "caching contexts for up to " << state.context_cache_faces
+				<< " faces per job\n";
+		}
+
+		// only set once few pairs are left to start, so the slowest pairs,
+		// started first, don't compete with each other for threads
+		std::atomic<bool> in_tail{false};
+		if (hybrid_parallel) {
+			state.run_parallel = &in_tail;
+		}
+
+		// which surfaces each solid has decides the kind of each pair
+		std::vector<uint32_t> surface_types;
+		std::unique_ptr<tolerance_learner> learner;
+		if (adaptive_tolerance && imprint_tolerances.size() > 1) {
+			surface_types.resize(num_solids);
+			{
+				parfor work;
+				for (size_t i = 0; i < num_solids; i++) {
+					work.submit(pool, [&doc, &surface_types, i]() {
+						surface_types[i] = surface_types_of_shape(doc.solid_shapes[i]);
+					});
+				}
+			}
+			learner.reset(new tolerance_learner{imprint_tolerances.size()});
+			state.learner = learner.get();
+			state.surface_types = &surface_types;
+		}
+		const approximate_state approx{meshes, solids, max_common_volume_ratio, approximate_resolution};
+		asyncmap<std::pair<size_t, worker_output>> map;
+		std::vector<std::pair<size_t, worker_output>> cached;
+		// from the checkpoint, and whether they'd come from the cache then
+		std::vector<std::tuple<size_t, worker_output, bool>> resumed;
+
+		// common solids are kept when they're found while classifying, any
+		// others are computed once all pairs have been checked
+		const bool write_common = !path_common.empty();
+		std::vector<TopoDS_Shape> commons(write_common ? pairs.size() : 0);
+		std::vector<std::pair<size_t, double>> overlapping;
+
+		auto note_overlap = [&](size_t i, const worker_output &output) {
+			if (write_common && output.result.status == intersect_status::overlap) {
+				overlapping.emplace_back(
+					i, output.approximated ? imprint_tolerances.front() : output.result.fuzzy_value);
+			}
+		};
+
+		// for fitting elapsed = seconds_per_cost * predicted
+		double sum_pp = 0, sum_pt = 0, sum_tt = 0;
+
+		// --split-faces is wasted on pairs that are paved anyway
+		double split_seconds = 0, split_wasted_seconds = 0;
+		unsigned long num_split_wasted = 0;
+
+		std::vector<size_t> to_process;
+		for (const auto i : order) {
+			const size_t hi = pairs[i].first, lo = pairs[i].second;
+
+			if (use_checkpoint) {
+				worker_output output{hi, lo, {}};
+				bool was_cached;
+				if (journal.lookup(i, output, was_cached) && output.hi == hi && output.lo == lo) {
+					if (learner) {
+						learn_tolerances(*learner, state, output);
+					}
+					resumed.emplace_back(i, output, was_cached);
 					continue;
 				}
+			}
 
-				map.submit(pool, [&state, hi, lo]() {
-					return shape_classifier(state, hi, lo);
-				});
-				num_to_process += 1;
+			if (use_cache) {
+				worker_output output{hi, lo, {}};
+				if (cache.lookup(shape_hashes[hi], shape_hashes[lo], output.result)) {
+					// start from what worked last time
+					if (learner) {
+						learn_tolerances(*learner, state, output);
+					}
+					cached.emplace_back(i, output);
+					continue;
+				}
+			}
+
+			to_process.push_back(i);
+		}
+		num_to_process = to_process.size();
+
+		std::vector<double> memory_estimates(costs.size());
+		for (size_t i = 0; i < costs.size(); i++) {
+			memory_estimates[i] = costs[i] * bytes_per_unit_cost;
+		}
+		admission_queue admission{to_process, memory_estimates, double(max_memory)};
+		// read by workers, the admission queue is only used by this thread
+		std::atomic<size_t> num_unadmitted{to_process.size()};
+
+		// called as each pair starts on a worker. once fewer pairs are waiting
+		// to start than there are jobs, workers will go idle as running pairs
+		// finish, so the pairs starting now can use their threads
+		auto note_started = [&]() {
+			if (hybrid_parallel && pool.num_pending() + num_unadmitted.load() < num_parallel_jobs) {
+				in_tail = true;
 			}
+		};
+
+		auto classify = [&state, &approx, &pairs, &costs, &commons, approximate, write_common](size_t i) {
+			const size_t hi = pairs[i].first, lo = pairs[i].second;
+			TopoDS_Shape *common = write_common ? &commons[i] : nullptr;
+			auto output = approximate ?
+				classify_pair_approximately(state, approx, hi, lo, common) :
+				classify_pair(state, hi, lo, common);
+			output.predicted_cost = costs[i];
+			return output;
+		};
+
+		// forked after everything the workers need has been set up
+		std::unique_ptr<process_map<worker_output>> processes;
+		if (isolate) {
+			LOG(DEBUG) << "forking " << num_parallel_jobs << " worker processes\n";
+			processes.reset(new process_map<worker_output>{num_parallel_jobs, classify});
+		}
+
+		// booleans after paving aren't covered by the time limit, so give
+		// each attempt some leeway before killing it. without a time limit
+		// pairs are left to run for as long as they take
+		const std::chrono::milliseconds deadline = pave_time_seconds == 0 ?
+			process_pool::no_deadline :
+			std::chrono::seconds{
+				(2 * long(pave_time_seconds) + 10) * long(imprint_tolerances.size())};
+
+		auto submit_pairs = [&](const std::vector<size_t> &admitted) {
+			for (const auto i : admitted) {
+				if (processes) {
+					processes->submit(i, deadline);
+				} else if (state.context_cache_faces > 0) {
+					// pairs are cached by the solid with more faces, see
+					// classify_pair, so keep each one's pairs on one thread
+					const auto [hi, lo] = pairs[i];
+					const size_t key = solids[hi].num_faces >= solids[lo].num_faces ? hi : lo;
+					map.submit_to(pool, key, [&classify, &note_started, i]() {
+						note_started();
+						return std::make_pair(i, classify(i));
+					});
+				} else {
+					map.submit(pool, [&classify, &note_started, i]() {
+						note_started();
+						return std::make_pair(i, classify(i));
+					});
+				}
+			}
+			num_unadmitted = admission.num_pending();
+		};
+
+		auto next_output = [&]() -> std::pair<size_t, worker_output> {
+			if (!processes) {
+				return map.get();
+			}
+
+			auto c = processes->get();
+			if (c.status == process_pool::job_status::done) {
+				return {c.job, c.result};
+			}
+
+			worker_output output{pairs[c.job].first, pairs[c.job].second, {}};
+			output.result.status = c.status == process_pool::job_status::timeout ?
+				intersect_status::timeout : intersect_status::failed;
+			output.predicted_cost = costs[c.job];
+			output.worker_died = true;
+			return {c.job, output};
+		};
+
+		auto busy = [&map, &processes]() {
+			return processes ? !processes->empty() : !map.empty();
+		};
+
+		submit_pairs(admission.admit());
+
+		if (use_cache) {
+			LOG(INFO)
+				<< "reusing " << cached.size() << " results from cache, "
+				<< cache.size() << " entries loaded\n";
+		}
+
+		if (use_checkpoint && resume) {
+			LOG(INFO) << "resuming with " << resumed.size() << " pairs from checkpoint\n";
+		}
+
+		// counted as they were in the interrupted run, so the summary is the
+		// same as if it had finished
+		for (const auto &[i, output, was_cached] : resumed) {
+			reporter.report(output);
+			note_overlap(i, output);
+			if (was_cached) {
+				num_cached += 1;
+			} else {
+				num_resumed += 1;
+			}
+		}
+
+		for (const auto &[i, output] : cached) {
+			journal.record(i, output, true);
+			reporter.report(output);
+			note_overlap(i, output);
+			num_cached += 1;
 		}
 
 		LOG(INFO) << "checking for overlaps between " << num_to_process << " pairs\n";
@@ -309,9 +714,14 @@ main(int argc, char **argv)
 		const std::chrono::seconds reporting_interval{5};
 		auto report_when = std::chrono::steady_clock::now() + reporting_interval;
 
-		while (!map.empty()) {
-			worker_output output = map.get();
+		profile_scope checking{"check pairs"};
+		while (busy()) {
+			auto [index, output] = next_output();
 			num_processed += 1;
+			profile_counter("pairs remaining", double(num_to_process - num_processed));
+
+			admission.finished(index);
+			submit_pairs(admission.admit());
 
 			// something weird is causing this to get set to hex formatting,
 			// reset it here
@@ -326,89 +736,86 @@ main(int argc, char **argv)
 				report_when += reporting_interval;
 			}
 
-			size_t hi = output.hi, lo = output.lo;
-			const auto hi_lo = indexpair_to_string(hi, lo);
-
-			if (output.result.pave_time_seconds > 1) {
-				LOG(TRACE) << hi_lo << " took " << output.result.pave_time_seconds << " seconds to pave\n";
+			// timeouts might succeed if given longer, so don't remember them.
+			// approximate results shouldn't be reused by exact runs
+			if (use_cache && !output.approximated && !output.worker_died &&
+				output.result.status != intersect_status::timeout) {
+				cache.insert(shape_hashes[output.hi], shape_hashes[output.lo], output.result);
 			}
 
-			switch (output.result.status) {
-			case intersect_status::failed:
-				LOG(ERROR) << hi_lo << " failed to classify overlap\n";
-				num_failed += 1;
-				break;
-			case intersect_status::timeout:
-				LOG(ERROR)
-					<< hi_lo << " failed to classify overlap, "
-					<< "due to timeout of " << pave_time_seconds << " seconds\n";
-				num_failed += 1;
-				break;
-			case intersect_status::distinct:
-				LOG(DEBUG) << hi_lo << " are distinct\n";
-				break;
-			case intersect_status::touching:
-				std::cout << hi << ',' << lo << ",touch\n";
-				num_touching += 1;
-				break;
-			case intersect_status::overlap: {
+			{
 				const double
-					vol_common = output.result.vol_common,
-					min_vol = std::min(volumes[hi], volumes[lo]),
-					max_overlap = min_vol * max_common_volume_ratio;
-
-				std::stringstream overlap_msg;
-				overlap_msg
-					<< max_common_volume_ratio * 100 << "%, "
-					<< std::fixed << std::setprecision(2) << vol_common / min_vol * 100
-					<< "% of smaller shape. " << std::setprecision(1)
-					<< "vol_" << hi << '=' << volumes[hi]
-					<< ", vol_" << lo << '=' << volumes[lo]
-					<< ", common=" << vol_common;
-
-				const char * state = "overlap";
-
-				if (vol_common > max_overlap) {
-					LOG(ERROR)
-						<< hi_lo << " overlap by more than " << overlap_msg.str() << '\n';
-					state = "bad_overlap";
-					num_bad_overlaps += 1;
-				} else {
-					LOG(INFO)
-						<< hi_lo << " overlap by less than " << overlap_msg.str() << '\n';
-					num_overlaps += 1;
+					predicted = output.predicted_cost,
+					elapsed = output.elapsed_seconds;
+
+				sum_pp += predicted * predicted;
+				sum_pt += predicted * elapsed;
+				sum_tt += elapsed * elapsed;
+
+				if (cost_report.is_open()) {
+					cost_report
+						<< output.hi << ',' << output.lo << ','
+						<< predicted << ','
+						<< output.result.pave_time_seconds << ','
+						<< elapsed << '\n';
 				}
-				auto ss = std::cout.precision(2);
-				std::cout
-					<< hi << ',' << lo << ','
-					<< state << ','
-					<< std::fixed
-					<< vol_common << ','
-					<< volumes[hi] << ','
-					<< volumes[lo] << '\n';
-				std::cout.precision(ss);
-				break;
 			}
+
+			split_seconds += output.split_seconds;
+			if (output.split_seconds > 0 && !output.skipped_by_split) {
+				split_wasted_seconds += output.split_seconds;
+				num_split_wasted += 1;
+			}
+
+			if (learner) {
+				learn_tolerances(*learner, state, output);
 			}
 
-			// flush any CSV output
-			std::cout << std::flush;
+			journal.record(index, output, false);
+			reporter.report(output);
+			note_overlap(index, output);
+		}
+
+		if (write_common && !write_common_solids(
+				path_common, doc, pairs, overlapping, commons, pool)) {
+			return 1;
+		}
+
+		if (sum_pp > 0 && sum_tt > 0) {
+			LOG(DEBUG)
+				<< "cost model: " << (sum_pt / sum_pp) << " seconds per unit of cost, "
+				<< "uncentred correlation=" << (sum_pt / std::sqrt(sum_pp * sum_tt)) << '\n';
+		}
+
+		if (split_seconds > 0) {
+			LOG(INFO)
+				<< "splitting by face took " << split_seconds << " seconds, "
+				<< split_wasted_seconds << " of them on " << num_split_wasted
+				<< " pairs that were paved anyway\n";
 		}
 
 		LOG(INFO)
 			<< "processing summary: "
-			<< "bbox tests=" << num_bbox_tests << ", "
-			<< "intersection tests=" << num_processed << ", "
-			<< "touching=" << num_touching << ", "
-			<< "overlapping=" << num_overlaps << ", "
-			<< "bad overlaps=" << num_bad_overlaps << ", "
-			<< "tests failed=" << num_failed << '\n';
-
-		if (num_failed || num_bad_overlaps) {
+			<< "bbox tests=" << candidates.num_bbox_tests << ", "
+			<< "skipped by broad phase=" << (num_pairs - candidates.num_bbox_tests) << ", "
+			<< "intersection tests=" << (num_resumed + num_processed) << ", "
+			<< "skipped by distance=" << reporter.num_distance_skipped << ", "
+			<< "skipped by splitting=" << reporter.num_split_skipped << ", "
+			<< "approximated=" << reporter.num_approximated << ", "
+			<< "retries=" << reporter.num_retries << ", "
+			<< "run in parallel=" << reporter.num_ran_parallel << ", "
+			<< "reused contexts=" << reporter.num_reused_contexts << ", "
+			<< "cached results=" << num_cached << ", "
+			<< "touching=" << reporter.num_touching << ", "
+			<< "overlapping=" << reporter.num_overlaps << ", "
+			<< "bad overlaps=" << reporter.num_bad_overlaps << ", "
+			<< "tests failed=" << reporter.num_failed << '\n';
+
+		if (reporter.num_failed || reporter.num_bad_overlaps) {
 			LOG(ERROR)
 				<< "errors occurred while processing: "
-				<< "intersection tests failed=" << num_failed << ", "
-				<< "overlapped by too much=" << num_bad_overlaps << '\n';
+				<< "intersection tests failed=" << reporter.num_failed << ", "
+				<< "overlapped by too much=" << reporter.num_bad_overlaps << '\n';
 			return 1;
 		}
 	}
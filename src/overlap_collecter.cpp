@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cassert>
+#include <sstream>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <TopoDS_Builder.hxx>
 #include <TopoDS_Compound.hxx>
@@ -12,53 +15,96 @@
 
 #include "geometry.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
-static int
-merge_into(const document &doc, TopoDS_Compound &merged)
+// read the CSV up front so that only the solids it mentions need loading
+static bool
+read_pairs(std::vector<std::pair<size_t, size_t>> &pairs)
 {
-	TopoDS_Builder builder;
-	builder.MakeCompound(merged);
-
+	csv_reader reader{std::cin};
 	input_status status;
-	std::vector<std::string> fields;
-	while ((status = parse_next_row(std::cin, fields)) == input_status::success) {
-		if (fields.size() < 2) {
-			LOG(FATAL) << "CSV input does not contain two fields\n";
+	size_t first, second;
+	while ((status = reader.next_pair(first, second)) == input_status::success) {
+		pairs.emplace_back(first, second);
+	}
+
+	if (status != input_status::end_of_file) {
+		LOG(FATAL) << "failed to read CSV input\n";
+		return false;
+	}
+	return true;
+}
+
+static std::vector<size_t>
+solids_in_pairs(const std::vector<std::pair<size_t, size_t>> &pairs)
+{
+	std::vector<size_t> indices;
+	for (const auto &[first, second] : pairs) {
+		// invalid indices are reported once the document is loaded
+		indices.push_back(first);
+		indices.push_back(second);
+	}
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	return indices;
+}
+
+static int
+merge_into(
+	const document &doc,
+	const std::vector<std::pair<size_t, size_t>> &pairs,
+	const std::vector<double> &fuzzy_values,
+	thread_pool &pool,
+	TopoDS_Compound &merged)
+{
+	for (const auto &[first, second] : pairs) {
+		if (first >= doc.solid_shapes.size()) {
+			LOG(FATAL) << "first value (" << first << ") is not a valid shape index\n";
 			return 1;
 		}
 
-		ssize_t first, second;
-		if ((first = doc.lookup_solid(fields[0])) < 0) {
-			LOG(FATAL) << "first value (" << fields[0] << ") is not a valid shape index\n";
+		if (second >= doc.solid_shapes.size()) {
+			LOG(FATAL) << "second value (" << second << ") is not a valid shape index\n";
 			return 1;
 		}
+	}
 
-		if ((second = doc.lookup_solid(fields[1])) < 0) {
-			LOG(FATAL) << "second value (" << fields[1] << ") is not a valid shape index\n";
-			return 1;
+	std::vector<TopoDS_Shape> commons(pairs.size());
+	{
+		parfor work;
+		for (size_t i = 0; i < pairs.size(); i++) {
+			work.submit(pool, [&doc, &pairs, &commons, &fuzzy_values, i]() {
+				const size_t first = pairs[i].first, second = pairs[i].second;
+
+				LOG(INFO) << indexpair_to_string(first, second) << " processing\n";
+
+				// same fuzzy values as overlap_checker tries
+				for (const auto fuzzy_value : fuzzy_values) {
+					commons[i] = common_of_solids(
+						doc.solid_shapes[first], doc.solid_shapes[second], fuzzy_value);
+					if (!commons[i].IsNull()) {
+						break;
+					}
+				}
+			});
 		}
+	}
 
-		LOG(INFO)
-			<< indexpair_to_string((size_t)first, (size_t)second) << " processing\n";
+	// added in CSV order, whatever order they finished in
+	TopoDS_Builder builder;
+	builder.MakeCompound(merged);
 
-		boolean_op op{
-			BOPAlgo_COMMON,
-			doc.solid_shapes[(size_t)first], doc.solid_shapes[(size_t)second]};
-		op.Build();
-		if(!op.IsDone()) {
-			LOG(FATAL) << "unable determine solid common to shapes\n";
+	for (size_t i = 0; i < pairs.size(); i++) {
+		if (commons[i].IsNull()) {
+			LOG(FATAL)
+				<< indexpair_to_string(pairs[i].first, pairs[i].second)
+				<< " unable determine solid common to shapes\n";
 			return 1;
 		}
-
-		builder.Add(merged, op.Shape());
+		builder.Add(merged, commons[i]);
 	}
 
-	if (status == input_status::end_of_file) {
-		return 0;
-	} else {
-		LOG(FATAL) << "failed to read line\n";
-		return 1;
-	}
+	return 0;
 }
 
 int
@@ -66,13 +112,28 @@ main(int argc, char **argv)
 {
 	configure_aixlog();
 
+	profile_writer profile;
+
 	std::string path_in, path_out;
+	unsigned num_parallel_jobs = 1;
+	std::vector<double> imprint_tolerances = {0.001, 0};
 
 	{
 		const char *doc = "Collect overlapping areas of solids and write to BREP file.";
 		const char *usage = "input.brep output.brep";
 
+		std::stringstream stream;
+		stream
+			<< "Faces, edges, and verticies will be merged when closer than T[="
+			<< imprint_tolerances[0] << "], should match overlap_checker";
+		auto help_imp_tol = stream.str();
+
 		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
+		argp.add_option(
+			{"imprint-tolerance", 1025, "T", 0, help_imp_tol.c_str(), 0}, imprint_tolerances);
+
 		if (!argp.parse(argc, argv, usage, doc)) {
 			return 1;
 		}
@@ -81,13 +142,30 @@ main(int argc, char **argv)
 		assert(args.size() == 2);
 		path_in = args[0];
 		path_out = args[1];
+
+		for (const auto tolerance : imprint_tolerances) {
+			if (tolerance < 0) {
+				LOG(ERROR)
+					<< "Imprinting tolerance should not be negative, "
+					<< tolerance << " < 0\n";
+				return 1;
+			}
+		}
+	}
+
+	std::vector<std::pair<size_t, size_t>> pairs;
+	if (!read_pairs(pairs)) {
+		return 1;
 	}
 
 	document doc;
-	doc.load_brep_file(path_in.c_str());
+	doc.load_brep_subset(path_in.c_str(), solids_in_pairs(pairs));
+
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
 
 	TopoDS_Compound merged;
-	const int status = merge_into(doc, merged);
+	const int status = merge_into(doc, pairs, imprint_tolerances, pool, merged);
 	if (status != 0) {
 		return status;
 	}
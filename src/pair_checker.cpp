@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <ios>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+
+#include <OSD_Parallel.hxx>
+#include <OSD_ThreadPool.hxx>
+#include <gp_Pnt.hxx>
+
+#include <aixlog.hpp>
+
+#include "pair_checker.hpp"
+#include "profiling.hpp"
+#include "utils.hpp"
+
+
+void
+configure_occt_threads(bool enable_intel_tbb, unsigned num_threads)
+{
+	if (enable_intel_tbb) {
+		OSD_Parallel::SetUseOcctThreads (false);
+	} else {
+		OSD_Parallel::SetUseOcctThreads (true);
+
+		// only algorithms that are SetRunParallel(true) use these threads, so
+		// it's normally disabled. reinitialising if needed
+		const int n = int(std::max(num_threads, 1u));
+		auto pool = OSD_ThreadPool::DefaultPool(n);
+		if (pool->NbThreads() != n) {
+			pool->Init(n);
+		}
+	}
+
+	LOG(TRACE)
+		<< "OSD_Parallel::ToUseOcctThreads() = " << OSD_Parallel::ToUseOcctThreads() << "\n"
+		<< "OSD_ThreadPool::NbThreads() = " << OSD_ThreadPool::DefaultPool()->NbThreads() << "\n";
+}
+
+// each worker thread keeps its own, as contexts aren't thread safe
+static context_cache &
+context_cache_of_thread(size_t max_faces)
+{
+	thread_local std::unique_ptr<context_cache> cache;
+	if (!cache) {
+		cache.reset(new context_cache{max_faces});
+	}
+	return *cache;
+}
+
+worker_output
+classify_pair(const worker_state& state, size_t hi, size_t lo, TopoDS_Shape *common)
+{
+	profile_scope scope{"classify pair"};
+	const auto &shape = state.doc.solid_shapes[hi];
+	const auto &tool = state.doc.solid_shapes[lo];
+
+	intersect_result result;
+
+	std::stringstream msg;
+	msg << "CSI(" << hi << ", " << lo << ")";
+
+	const auto start = std::chrono::steady_clock::now();
+
+	// the largest fuzzy value is most likely to find them touching
+	const double max_fuzzy_value = state.fuzzy_values.empty() ? 0 :
+		*std::max_element(state.fuzzy_values.begin(), state.fuzzy_values.end());
+
+	// for pairs found apart without paving
+	auto distinct_output = [&]() {
+		result = {
+			intersect_status::distinct,
+			max_fuzzy_value,
+			0, 0, 0,
+			-1.0, -1.0, -1.0,
+			0.0,
+		};
+
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return worker_output{hi, lo, result, elapsed.count()};
+	};
+
+	if (state.distance_prefilter && !state.fuzzy_values.empty()) {
+		switch (check_solids_apart(shape, tool, max_fuzzy_value, state.distance_time_millisecs)) {
+		case distance_status::apart: {
+			LOG(TRACE) << msg.str() << " apart, skipping pave\n";
+
+			auto output = distinct_output();
+			output.skipped_by_distance = true;
+			return output;
+		}
+		case distance_status::near:
+			break;
+		case distance_status::unknown:
+			LOG(DEBUG)
+				<< indexpair_to_string(hi, lo)
+				<< " distance check failed or ran out of time, paving instead\n";
+			break;
+		}
+	}
+
+	double split_seconds = 0;
+	if (state.split_pool && !state.fuzzy_values.empty()) {
+		const auto &props_hi = (*state.solids)[hi], &props_lo = (*state.solids)[lo];
+		if (size_t(props_hi.num_faces + props_lo.num_faces) >= state.split_num_faces) {
+			LOG(DEBUG)
+				<< indexpair_to_string(hi, lo) << " has "
+				<< (props_hi.num_faces + props_lo.num_faces)
+				<< " faces, checking for contact in parallel\n";
+
+			const auto split_start = std::chrono::steady_clock::now();
+			const auto status = check_solids_apart_split(
+				shape, props_hi.obb, tool, props_lo.obb,
+				max_fuzzy_value, state.split_faces_per_task, *state.split_pool);
+			split_seconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - split_start).count();
+			if (status == distance_status::apart) {
+				LOG(TRACE) << msg.str() << " faces apart, skipping pave\n";
+
+				auto output = distinct_output();
+				output.skipped_by_split = true;
+				output.split_seconds = split_seconds;
+				return output;
+			}
+		}
+	}
+
+	// shared between attempts so retries don't start from nothing, and with
+	// a context cache between pairs sharing a solid
+	Handle(IntTools_Context) context;
+	bool reused_context = false;
+	context_cache *cache = nullptr;
+	size_t cached_solid = 0, num_split_shapes = 0;
+	if (state.context_cache_faces > 0 && state.solids) {
+		const size_t
+			faces_hi = size_t((*state.solids)[hi].num_faces),
+			faces_lo = size_t((*state.solids)[lo].num_faces);
+		cache = &context_cache_of_thread(state.context_cache_faces);
+		cached_solid = faces_hi >= faces_lo ? hi : lo;
+		context = faces_hi >= faces_lo ?
+			cache->context_for(hi, faces_hi, faces_lo, reused_context) :
+			cache->context_for(lo, faces_lo, faces_hi, reused_context);
+	} else {
+		context = new IntTools_Context;
+	}
+	double first_pave_time = -1;
+
+	// volumes were measured up front, so cuts can be derived from them
+	const bool derive_cut_volumes = state.derive_cut_volumes && state.solids;
+	const double
+		shape_volume = derive_cut_volumes ? (*state.solids)[hi].volume : -1,
+		tool_volume = derive_cut_volumes ? (*state.solids)[lo].volume : -1;
+
+	std::vector<size_t> order(state.fuzzy_values.size());
+	std::iota(order.begin(), order.end(), size_t{0});
+	if (state.learner) {
+		order = state.learner->order(pair_kind(*state.surface_types, hi, lo));
+	}
+
+	int tolerance_index = -1;
+	uint32_t failed_tolerances = 0;
+	bool ran_parallel = false;
+
+	bool first = true;
+	for (const auto index : order) {
+		const double fuzzy_value = state.fuzzy_values[index];
+		if (!first) {
+			LOG(INFO)
+				<< indexpair_to_string(hi, lo) << " imprint failed with "
+				<< '(' << result.num_filler_warnings << " filler and "
+				<< result.num_common_warnings << " common) "
+				<< "warnings, retrying with tolerance=" << fuzzy_value << '\n';
+		}
+
+		const bool run_parallel = state.run_parallel && state.run_parallel->load();
+		ran_parallel = ran_parallel || run_parallel;
+
+		try {
+			result = classify_solid_intersection(
+				shape, tool, fuzzy_value, state.pave_time_millisecs,
+				msg.str().c_str(), context, shape_volume, tool_volume, common,
+				run_parallel, cache ? &num_split_shapes : nullptr);
+		} catch (const std::exception &ex) {
+			LOG(FATAL)
+				<< indexpair_to_string(hi, lo)
+				<< " classifying intersection failed: "
+				<< ex.what() << '\n';
+			abort();
+		}
+
+		if (first) {
+			first_pave_time = result.pave_time_seconds;
+		} else {
+			LOG(DEBUG)
+				<< indexpair_to_string(hi, lo) << " retry with tolerance=" << fuzzy_value
+				<< " took " << result.pave_time_seconds << " seconds to pave, "
+				<< "first attempt took " << first_pave_time << " seconds\n";
+		}
+		first = false;
+		tolerance_index = int(index);
+
+		// try again with the next tolerance
+		if (result.status != intersect_status::failed) {
+			break;
+		}
+		if (index < 32) {
+			failed_tolerances |= uint32_t{1} << index;
+		}
+	}
+
+	release_thread_arena();
+	if (cache) {
+		cache->charge(cached_solid, num_split_shapes);
+	}
+
+	if (result.status == intersect_status::failed) {
+		LOG(WARNING)
+			<< indexpair_to_string(hi, lo) << " imprint failed with "
+			<< '(' << result.num_filler_warnings << " filler and "
+			<< result.num_common_warnings << " common) "
+			<< "warnings\n";
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	worker_output output{hi, lo, result, elapsed.count()};
+	output.tolerance_index = tolerance_index;
+	output.failed_tolerances = failed_tolerances;
+	output.ran_parallel = ran_parallel;
+	output.reused_context = reused_context;
+	output.split_seconds = split_seconds;
+	return output;
+}
+
+uint32_t
+pair_kind(const std::vector<uint32_t> &surface_types, size_t hi, size_t lo)
+{
+	// pairs are unordered, so use surfaces either has and those both have
+	const uint32_t a = surface_types[hi], b = surface_types[lo];
+	return (a | b) ^ ((a & b) << 16);
+}
+
+void
+learn_tolerances(
+	tolerance_learner &learner, const worker_state &state, const worker_output &output)
+{
+	// nothing was paved for these, or how isn't known
+	if (output.skipped_by_distance || output.skipped_by_split ||
+		output.worker_died || output.approximated) {
+		return;
+	}
+
+	const auto &fuzzy_values = state.fuzzy_values;
+	const uint32_t kind = pair_kind(*state.surface_types, output.hi, output.lo);
+
+	int index = output.tolerance_index;
+	uint32_t failed = output.failed_tolerances;
+	if (index < 0) {
+		// from the result cache, which only has the value that worked
+		if (output.result.status == intersect_status::failed) {
+			for (size_t i = 0; i < fuzzy_values.size() && i < 32; i++) {
+				failed |= uint32_t{1} << i;
+			}
+		} else {
+			for (size_t i = 0; i < fuzzy_values.size(); i++) {
+				if (are_vals_close(fuzzy_values[i], output.result.fuzzy_value)) {
+					index = int(i);
+					break;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < fuzzy_values.size() && i < 32; i++) {
+		if (failed & (uint32_t{1} << i)) {
+			learner.record(kind, i, false);
+		}
+	}
+	if (index >= 0 && output.result.status != intersect_status::failed) {
+		// timeouts didn't fail, but didn't get an answer either
+		learner.record(
+			kind, size_t(index), output.result.status != intersect_status::timeout);
+	}
+}
+
+
+// "OBB" stands for "orientated bounding-box", i.e. aligned to the shape
+// rather than the axis
+static bool
+are_bboxs_disjoint(const Bnd_OBB &b1, const Bnd_OBB& b2, double tolerance)
+{
+	if (tolerance > 0) {
+		Bnd_OBB e1{b1}, e2{b2};
+		e1.Enlarge(tolerance);
+		e2.Enlarge(tolerance);
+		return e1.IsOut(e2);
+	}
+	return b1.IsOut(b2);
+}
+
+worker_output
+classify_pair_approximately(
+	const worker_state& state, const approximate_state &approx, size_t hi, size_t lo,
+	TopoDS_Shape *common)
+{
+	const auto &mesh_hi = approx.meshes[hi], &mesh_lo = approx.meshes[lo];
+	if (!mesh_hi.valid || !mesh_lo.valid) {
+		return classify_pair(state, hi, lo, common);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+
+	const bool intersect = meshes_intersect(mesh_hi, mesh_lo);
+	const auto est = estimate_common_volume(mesh_hi, mesh_lo, approx.resolution);
+
+	const double
+		vol_hi = approx.solids[hi].volume,
+		vol_lo = approx.solids[lo].volume,
+		max_overlap = std::min(vol_hi, vol_lo) * approx.max_common_volume_ratio;
+
+	intersect_result result = {
+		intersect_status::distinct,
+		0.0,
+		0, 0, 0,
+		-1.0, -1.0, -1.0,
+		0.0,
+	};
+
+	if (intersect || est.volume > 0) {
+		const bool certain =
+			est.volume + est.uncertainty <= max_overlap ||
+			est.volume - est.uncertainty > max_overlap;
+
+		if (!certain) {
+			LOG(DEBUG)
+				<< indexpair_to_string(hi, lo) << " estimated common volume of "
+				<< est.volume << " +/- " << est.uncertainty
+				<< " is too close to " << max_overlap << ", paving instead\n";
+			return classify_pair(state, hi, lo, common);
+		}
+
+		if (est.volume - est.uncertainty > 0) {
+			result.status = intersect_status::overlap;
+			result.vol_common = est.volume;
+			result.vol_cut = std::max(0.0, vol_hi - est.volume);
+			result.vol_cut12 = std::max(0.0, vol_lo - est.volume);
+		} else {
+			result.status = intersect_status::touching;
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	worker_output output{hi, lo, result, elapsed.count()};
+	output.approximated = true;
+	return output;
+}
+
+Bnd_Box
+aabb_of_obb(const Bnd_OBB &obb, double tolerance)
+{
+	Bnd_Box result;
+	if (obb.IsVoid()) {
+		return result;
+	}
+
+	Bnd_OBB enlarged{obb};
+	if (tolerance > 0) {
+		enlarged.Enlarge(tolerance);
+	}
+
+	gp_Pnt corners[8];
+	enlarged.GetVertex(corners);
+	for (const auto &pnt : corners) {
+		result.Add(pnt);
+	}
+	return result;
+}
+
+static double
+volume_of_box(const Bnd_Box &box)
+{
+	if (box.IsVoid()) {
+		return 0;
+	}
+	double xmin, ymin, zmin, xmax, ymax, zmax;
+	box.Get(xmin, ymin, zmin, xmax, ymax, zmax);
+	return (xmax - xmin) * (ymax - ymin) * (zmax - zmin);
+}
+
+// volume of the region common to both boxes, zero if they don't overlap
+static double
+overlap_of_boxes(const Bnd_Box &a, const Bnd_Box &b)
+{
+	if (a.IsVoid() || b.IsVoid()) {
+		return 0;
+	}
+	double
+		axmin, aymin, azmin, axmax, aymax, azmax,
+		bxmin, bymin, bzmin, bxmax, bymax, bzmax;
+	a.Get(axmin, aymin, azmin, axmax, aymax, azmax);
+	b.Get(bxmin, bymin, bzmin, bxmax, bymax, bzmax);
+
+	auto extent = [](double amin, double amax, double bmin, double bmax) {
+		return std::max(0., std::min(amax, bmax) - std::max(amin, bmin));
+	};
+	return
+		extent(axmin, axmax, bxmin, bxmax) *
+		extent(aymin, aymax, bymin, bymax) *
+		extent(azmin, azmax, bzmin, bzmax);
+}
+
+candidate_pairs
+find_candidate_pairs(const std::vector<solid_properties> &solids, double bbox_clearance)
+{
+	profile_scope scope{"candidate pairs"};
+	std::vector<Bnd_Box> aligned_boxes;
+	aligned_boxes.reserve(solids.size());
+	for (const auto &props : solids) {
+		aligned_boxes.push_back(aabb_of_obb(props.obb, bbox_clearance));
+	}
+
+	// axis-aligned boxes are cheap to compare, so use them to throw away
+	// most pairs before doing the more precise OBB tests
+	const auto candidates = overlapping_bbox_pairs(aligned_boxes);
+
+	const size_t num_solids = solids.size();
+	const unsigned long num_pairs = num_solids < 2 ? 0 : num_solids * (num_solids - 1) / 2;
+
+	LOG(INFO)
+		<< "broad phase found " << candidates.size() << " candidate pairs out of "
+		<< num_pairs << '\n';
+
+	candidate_pairs result;
+	for (const auto &candidate : candidates) {
+		result.num_bbox_tests += 1;
+
+		// seems reasonable to assume majority of shapes aren't close to
+		// overlapping, so check with coarser limit first
+		if (!are_bboxs_disjoint(
+				solids[candidate.first].obb, solids[candidate.second].obb,
+				bbox_clearance)) {
+			result.pairs.push_back(candidate);
+		}
+	}
+
+	result.costs.reserve(result.pairs.size());
+	for (const auto &pair : result.pairs) {
+		const auto &a = aligned_boxes[pair.first], &b = aligned_boxes[pair.second];
+		result.costs.push_back(estimate_intersection_cost(
+			solids[pair.first], volume_of_box(a),
+			solids[pair.second], volume_of_box(b),
+			overlap_of_boxes(a, b)));
+	}
+
+	return result;
+}
+
+std::vector<size_t>
+order_by_decreasing_cost(const std::vector<double> &costs)
+{
+	std::vector<size_t> order(costs.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&costs](size_t i, size_t j) {
+		return costs[i] > costs[j];
+	});
+	return order;
+}
+
+void
+result_reporter::report(const worker_output &output)
+{
+	const size_t hi = output.hi, lo = output.lo;
+	const auto hi_lo = indexpair_to_string(hi, lo);
+
+	if (output.result.pave_time_seconds > 1) {
+		LOG(TRACE) << hi_lo << " took " << output.result.pave_time_seconds << " seconds to pave\n";
+	}
+
+	switch (output.result.status) {
+	case intersect_status::failed:
+		LOG(ERROR) << hi_lo << " failed to classify overlap\n";
+		num_failed += 1;
+		break;
+	case intersect_status::timeout:
+		LOG(ERROR)
+			<< hi_lo << " failed to classify overlap, "
+			<< "due to timeout of " << pave_time_seconds << " seconds\n";
+		num_failed += 1;
+		break;
+	case intersect_status::distinct:
+		// most pairs, so don't format messages that won't be seen
+		if (debug_logging_enabled()) {
+			LOG(DEBUG) << hi_lo << " are distinct\n";
+		}
+		if (output.skipped_by_distance) {
+			num_distance_skipped += 1;
+		}
+		if (output.skipped_by_split) {
+			num_split_skipped += 1;
+		}
+		break;
+	case intersect_status::touching:
+		csv.field(hi).field(lo).field("touch").end_row();
+		num_touching += 1;
+		break;
+	case intersect_status::overlap: {
+		const double
+			vol_common = output.result.vol_common,
+			vol_hi = solids[hi].volume,
+			vol_lo = solids[lo].volume,
+			min_vol = std::min(vol_hi, vol_lo),
+			max_overlap = min_vol * max_common_volume_ratio;
+
+		std::stringstream overlap_msg;
+		overlap_msg
+			<< max_common_volume_ratio * 100 << "%, "
+			<< std::fixed << std::setprecision(2) << vol_common / min_vol * 100
+			<< "% of smaller shape. " << std::setprecision(1)
+			<< "vol_" << hi << '=' << vol_hi
+			<< ", vol_" << lo << '=' << vol_lo
+			<< ", common=" << vol_common;
+
+		const char * state = "overlap";
+
+		if (vol_common > max_overlap) {
+			LOG(ERROR)
+				<< hi_lo << " overlap by more than " << overlap_msg.str() << '\n';
+			state = "bad_overlap";
+			num_bad_overlaps += 1;
+		} else {
+			LOG(INFO)
+				<< hi_lo << " overlap by less than " << overlap_msg.str() << '\n';
+			num_overlaps += 1;
+		}
+		csv.field(hi).field(lo).field(state)
+			.field(vol_common, 2)
+			.field(vol_hi, 2)
+			.field(vol_lo, 2)
+			.end_row();
+		break;
+	}
+	}
+
+	if (output.approximated) {
+		num_approximated += 1;
+	}
+	if (output.ran_parallel) {
+		num_ran_parallel += 1;
+	}
+	if (output.reused_context) {
+		num_reused_contexts += 1;
+	}
+
+	for (uint32_t failed = output.failed_tolerances; failed; failed &= failed - 1) {
+		num_retries += 1;
+	}
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <Bnd_Box.hxx>
+#include <Bnd_OBB.hxx>
+
+#include "geometry.hpp"
+#include "triangle_mesh.hpp"
+#include "utils.hpp"
+
+
+/* the parts of overlap checking shared between overlap_checker and
+ * check_and_imprint: picking which pairs need checking, classifying a pair
+ * and reporting the result as CSV.
+ */
+
+// flags to control OCCT's unwanted use of background threads, call before
+// doing anything parallel. num_threads sizes OCCT's own pool, for pairs
+// allowed to run in parallel, see worker_state::run_parallel
+void configure_occt_threads(bool enable_intel_tbb, unsigned num_threads = 1);
+
+struct worker_state {
+	const document &doc;
+	std::vector<double> &fuzzy_values;
+	unsigned pave_time_millisecs;
+
+	// measure distance between solids before paving, see check_solids_apart
+	bool distance_prefilter = false;
+	unsigned distance_time_millisecs = 0;
+
+	// see classify_solid_intersection
+	bool derive_cut_volumes = false;
+
+	// when set, fuzzy values are tried in the order learner suggests for the
+	// pair's kind, see pair_kind
+	const tolerance_learner *learner = nullptr;
+	const std::vector<uint32_t> *surface_types = nullptr;
+
+	// needed by split_pool, context_cache_faces and derive_cut_volumes
+	const std::vector<solid_properties> *solids = nullptr;
+
+	// when set, pairs of solids with at least split_num_faces faces between
+	// them are first checked for contact by check_solids_apart_split, spread
+	// over split_pool, so the few giant pairs aren't left to a single thread
+	thread_pool *split_pool = nullptr;
+	size_t split_num_faces = 0;
+	size_t split_faces_per_task = 64;
+
+	// set by the scheduler once fewer pairs remain than there are workers,
+	// attempts started after this let OCCT use its own threads to make use
+	// of the idle cores
+	const std::atomic<bool> *run_parallel = nullptr;
+
+	// when non-zero, each thread keeps a context_cache of up to this many
+	// faces so a solid's preprocessing is reused by later pairs including it
+	size_t context_cache_faces = 0;
+};
+
+struct worker_output {
+	size_t hi, lo;
+	intersect_result result;
+
+	// wall-clock time for all attempts, including the boolean operations
+	double elapsed_seconds = 0;
+
+	// from estimate_intersection_cost, so the model can be checked
+	double predicted_cost = 0;
+
+	// found distinct by check_solids_apart, without paving
+	bool skipped_by_distance = false;
+
+	// found distinct by check_solids_apart_split, without paving
+	bool skipped_by_split = false;
+
+	// time spent in check_solids_apart_split, wasted if it wasn't skipped
+	double split_seconds = 0;
+
+	// at least one attempt used OCCT's threads
+	bool ran_parallel = false;
+
+	// paved with a context cached from an earlier pair
+	bool reused_context = false;
+
+	// classified from meshes, so volumes are estimates
+	bool approximated = false;
+
+	// the worker process running this was killed or crashed, the result
+	// isn't cached as it might not happen again
+	bool worker_died = false;
+
+	// index into fuzzy_values of the attempt that gave result, or -1 if
+	// nothing was paved, and a bit for each index that failed first
+	int tolerance_index = -1;
+	uint32_t failed_tolerances = 0;
+};
+
+// tries each fuzzy value in turn until one succeeds, after the distance
+// prefilter if it's enabled. common is passed to classify_solid_intersection
+worker_output classify_pair(
+	const worker_state& state, size_t hi, size_t lo, TopoDS_Shape *common = nullptr);
+
+// kind of pair for tolerance_learner, from surface_types_of_shape of each
+uint32_t pair_kind(const std::vector<uint32_t> &surface_types, size_t hi, size_t lo);
+
+// records which tolerances failed and which succeeded for an output, or a
+// cached result where only the fuzzy value that succeeded is known
+void learn_tolerances(
+	tolerance_learner &learner, const worker_state &state, const worker_output &output);
+
+struct approximate_state {
+	// one for each solid, invalid meshes always fall back to paving
+	const std::vector<triangle_mesh> &meshes;
+	const std::vector<solid_properties> &solids;
+	double max_common_volume_ratio;
+
+	// passed to estimate_common_volume
+	unsigned resolution;
+};
+
+// classifies a pair using their meshes, only calling classify_pair when the
+// common volume is too close to max_common_volume_ratio to be sure which
+// side it's on. touching solids that don't quite intersect are reported
+// as distinct
+worker_output classify_pair_approximately(
+	const worker_state& state, const approximate_state &approx, size_t hi, size_t lo,
+	TopoDS_Shape *common = nullptr);
+
+// axis-aligned box containing the (enlarged) OBB, used for the broad phase
+Bnd_Box aabb_of_obb(const Bnd_OBB &obb, double tolerance);
+
+struct candidate_pairs {
+	// in the same order as a nested loop would visit them
+	std::vector<std::pair<size_t, size_t>> pairs;
+
+	// from estimate_intersection_cost, one for each pair
+	std::vector<double> costs;
+
+	// number of OBB tests done after the broad phase
+	unsigned long num_bbox_tests = 0;
+};
+
+// pairs of solids whose bounding boxes are within bbox_clearance
+candidate_pairs find_candidate_pairs(
+	const std::vector<solid_properties> &solids, double bbox_clearance);
+
+// indices of costs, most expensive first. a single slow pair picked up at
+// the end leaves every other worker idle, so these should be started first
+std::vector<size_t> order_by_decreasing_cost(const std::vector<double> &costs);
+
+// writes a CSV row to stdout for each pair that intersects, logging anything
+// interesting and keeping track of the summary counters
+struct result_reporter {
+	const std::vector<solid_properties> &solids;
+	double max_common_volume_ratio;
+	unsigned pave_time_seconds;
+
+	unsigned long
+		num_failed = 0,
+		num_touching = 0,
+		num_overlaps = 0,
+		num_bad_overlaps = 0,
+		num_distance_skipped = 0,
+		num_split_skipped = 0,
+		num_ran_parallel = 0,
+		num_reused_contexts = 0,
+		num_approximated = 0,
+		num_retries = 0;
+
+	// flushed every so often rather than after each row
+	csv_writer csv{std::cout};
+
+	void report(const worker_output &output);
+};
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef INCLUDE_TESTS
+#include <thread>
+#include <catch2/catch_test_macros.hpp>
+#endif
+
+#include <aixlog.hpp>
+
+#include "process_pool.hpp"
+
+
+// both return false on end of file or error, with errno zero on end of file
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = static_cast<char *>(buf);
+	while (len > 0) {
+		const ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = 0;
+			}
+			return false;
+		}
+		p += n;
+		len -= size_t(n);
+	}
+	return true;
+}
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = static_cast<const char *>(buf);
+	while (len > 0) {
+		// don't want SIGPIPE when a worker has died
+		const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= size_t(n);
+	}
+	return true;
+}
+
+process_pool::process_pool(size_t num_workers, size_t result_size, job_fn fn) :
+	result_size{result_size}, fn{std::move(fn)}, workers(std::max(num_workers, size_t{1}))
+{
+	for (auto &w : workers) {
+		spawn(w);
+	}
+}
+
+process_pool::~process_pool()
+{
+	// closing the socket tells idle workers to exit, busy ones are killed
+	for (auto &w : workers) {
+		if (w.busy) {
+			kill(w.pid, SIGKILL);
+		}
+		close(w.fd);
+	}
+	for (auto &w : workers) {
+		int status;
+		while (waitpid(w.pid, &status, 0) < 0 && errno == EINTR) {
+		}
+	}
+}
+
+void
+process_pool::spawn(worker &w)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		throw std::runtime_error("unable to create socket for worker process");
+	}
+
+	// anything buffered would be written by both processes
+	std::cout.flush();
+	std::cerr.flush();
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		throw std::runtime_error("unable to fork worker process");
+	}
+
+	if (pid == 0) {
+		// other workers should see end of file when the parent closes their
+		// sockets, not have a copy held open by us
+		for (const auto &other : workers) {
+			if (other.fd >= 0) {
+				close(other.fd);
+			}
+		}
+		close(fds[0]);
+
+		std::vector<char> buf(sizeof(uint64_t) + result_size);
+		uint64_t job;
+		while (read_full(fds[1], &job, sizeof(job))) {
+			std::memcpy(buf.data(), &job, sizeof(job));
+			fn(size_t(job), buf.data() + sizeof(job));
+			if (!write_full(fds[1], buf.data(), buf.size())) {
+				break;
+			}
+		}
+		// skip destructors and atexit handlers belonging to the parent
+		_exit(0);
+	}
+
+	close(fds[1]);
+	w.pid = pid;
+	w.fd = fds[0];
+	w.busy = false;
+}
+
+void
+process_pool::reap(worker &w, job_status status)
+{
+	if (status == job_status::timeout) {
+		kill(w.pid, SIGKILL);
+	}
+	close(w.fd);
+
+	int wstatus = 0;
+	while (waitpid(w.pid, &wstatus, 0) < 0 && errno == EINTR) {
+	}
+
+	if (status == job_status::crashed) {
+		if (WIFSIGNALED(wstatus)) {
+			LOG(WARNING)
+				<< "worker process " << w.pid << " killed by signal "
+				<< WTERMSIG(wstatus) << " running job " << w.job << '\n';
+		} else {
+			LOG(WARNING)
+				<< "worker process " << w.pid << " exited with status "
+				<< WEXITSTATUS(wstatus) << " running job " << w.job << '\n';
+		}
+	} else {
+		LOG(WARNING)
+			<< "worker process " << w.pid << " killed after exceeding deadline "
+			<< "running job " << w.job << '\n';
+	}
+
+	completed.push_back({w.job, status, {}});
+	w.fd = -1;
+	spawn(w);
+}
+
+void
+process_pool::dispatch()
+{
+	for (auto &w : workers) {
+		if (queued.empty()) {
+			return;
+		}
+		if (w.busy) {
+			continue;
+		}
+
+		const auto next = queued.front();
+		queued.pop_front();
+
+		w.busy = true;
+		w.job = next.first;
+		// adding max() to now() would overflow
+		w.deadline = next.second == no_deadline ?
+			clock::time_point::max() : clock::now() + next.second;
+
+		const uint64_t job = next.first;
+		if (!write_full(w.fd, &job, sizeof(job))) {
+			reap(w, job_status::crashed);
+		}
+	}
+}
+
+void
+process_pool::wait_for_workers()
+{
+	std::vector<struct pollfd> fds;
+	std::vector<worker *> polled;
+	clock::time_point first_deadline = clock::time_point::max();
+
+	for (auto &w : workers) {
+		if (w.busy) {
+			fds.push_back({w.fd, POLLIN, 0});
+			polled.push_back(&w);
+			first_deadline = std::min(first_deadline, w.deadline);
+		}
+	}
+	if (fds.empty()) {
+		return;
+	}
+
+	const auto now = clock::now();
+	const auto wait = first_deadline <= now ? 0 :
+		std::chrono::duration_cast<std::chrono::milliseconds>(first_deadline - now).count() + 1;
+
+	if (poll(fds.data(), fds.size(), int(std::min<long long>(wait, 60 * 1000))) < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		throw std::runtime_error("unable to poll worker processes");
+	}
+
+	for (size_t i = 0; i < fds.size(); i++) {
+		worker &w = *polled[i];
+
+		if (fds[i].revents) {
+			std::vector<char> buf(sizeof(uint64_t) + result_size);
+			if (!read_full(w.fd, buf.data(), buf.size())) {
+				reap(w, job_status::crashed);
+				continue;
+			}
+			w.busy = false;
+			completed.push_back({
+				w.job, job_status::done,
+				std::vector<char>(buf.begin() + sizeof(uint64_t), buf.end())});
+		} else if (w.deadline <= clock::now()) {
+			reap(w, job_status::timeout);
+		}
+	}
+}
+
+void
+process_pool::submit(size_t job, std::chrono::milliseconds deadline)
+{
+	queued.emplace_back(job, deadline);
+	dispatch();
+}
+
+bool
+process_pool::empty() const
+{
+	return queued.empty() && completed.empty() &&
+		std::none_of(workers.begin(), workers.end(), [](const worker &w) {
+			return w.busy;
+		});
+}
+
+process_pool::completion
+process_pool::get()
+{
+	while (completed.empty()) {
+		if (empty()) {
+			throw std::logic_error("get() called on empty process_pool");
+		}
+		wait_for_workers();
+		dispatch();
+	}
+
+	auto result = std::move(completed.front());
+	completed.pop_front();
+	return result;
+}
+
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("process_map") {
+	using status = process_pool::job_status;
+	const std::chrono::milliseconds deadline{10 * 1000};
+
+	SECTION("results come back") {
+		process_map<long> map{2, [](size_t job) {
+			return long(job * job);
+		}};
+		constexpr size_t N = 20;
+		for (size_t i = 0; i < N; i++) {
+			map.submit(i, deadline);
+		}
+
+		int done[N] = {};
+		while (!map.empty()) {
+			const auto c = map.get();
+			REQUIRE(c.status == status::done);
+			CHECK(c.result == long(c.job * c.job));
+			done[c.job] += 1;
+		}
+		for (size_t i = 0; i < N; i++) {
+			CHECK(done[i] == 1);
+		}
+	}
+
+	SECTION("crashing and hung workers are replaced") {
+		process_map<int> map{1, [](size_t job) {
+			switch (job) {
+			case 1:
+				_exit(3);
+			case 2:
+				std::this_thread::sleep_for(std::chrono::seconds(60));
+				break;
+			}
+			return int(job);
+		}};
+
+		map.submit(0, deadline);
+		map.submit(1, deadline);
+		map.submit(2, std::chrono::milliseconds(100));
+		map.submit(3, deadline);
+
+		status statuses[4] = {};
+		while (!map.empty()) {
+			const auto c = map.get();
+			statuses[c.job] = c.status;
+		}
+
+		CHECK(statuses[0] == status::done);
+		CHECK(statuses[1] == status::crashed);
+		CHECK(statuses[2] == status::timeout);
+		CHECK(statuses[3] == status::done);
+	}
+
+	SECTION("jobs without a deadline aren't killed") {
+		process_map<int> map{1, [](size_t job) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			return int(job);
+		}};
+
+		map.submit(0, process_pool::no_deadline);
+		map.submit(1, process_pool::no_deadline);
+
+		while (!map.empty()) {
+			const auto c = map.get();
+			REQUIRE(c.status == status::done);
+			CHECK(c.result == int(c.job));
+		}
+	}
+}
+#endif
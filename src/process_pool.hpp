@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+
+/* runs jobs in forked worker processes, so a job that crashes, or never
+ * returns, can be killed without taking the rest of the run with it.
+ * workers are forked from the calling process, so see anything already
+ * loaded copy-on-write, and are replaced when they die. jobs are identified
+ * by an index and their results are returned as a fixed number of bytes.
+ *
+ * workers are forked while any threads in the calling process are running,
+ * so they should be idle and the job function shouldn't use them. you
+ * probably want to use process_map below.
+ */
+class process_pool {
+public:
+	using job_fn = std::function<void(size_t job, void *result)>;
+
+	enum class job_status {
+		done,
+
+		// worker exited or was killed by a signal before returning a result
+		crashed,
+
+		// worker was killed for exceeding the job's deadline
+		timeout,
+	};
+
+	struct completion {
+		size_t job;
+		job_status status;
+		std::vector<char> result;
+	};
+
+	process_pool(size_t num_workers, size_t result_size, job_fn fn);
+	virtual ~process_pool();
+
+	process_pool(const process_pool &) = delete;
+	process_pool& operator=(const process_pool &) = delete;
+
+	// jobs submitted with no_deadline are never killed for taking too long
+	static constexpr std::chrono::milliseconds no_deadline =
+		std::chrono::milliseconds::max();
+
+	void submit(size_t job, std::chrono::milliseconds deadline);
+
+	// nothing queued, running or waiting to be collected
+	bool empty() const;
+
+	// waits for a job to complete, killing workers that pass their deadline
+	completion get();
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct worker {
+		pid_t pid = -1;
+		int fd = -1;
+
+		bool busy = false;
+		size_t job = 0;
+		clock::time_point deadline;
+	};
+
+	const size_t result_size;
+	const job_fn fn;
+
+	std::vector<worker> workers;
+	std::deque<std::pair<size_t, std::chrono::milliseconds>> queued;
+	std::deque<completion> completed;
+
+	void spawn(worker &w);
+	void reap(worker &w, job_status status);
+	void dispatch();
+	void wait_for_workers();
+};
+
+/* like asyncmap, but jobs run in a process_pool and results are returned
+ * along with how the job finished. T is copied between processes as bytes,
+ * so can't contain pointers to anything the worker allocated
+ */
+template<typename T>
+class process_map {
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "results are copied between processes as bytes");
+
+	process_pool pool;
+
+public:
+	struct completion {
+		size_t job;
+		process_pool::job_status status;
+		// only valid if status is done
+		T result;
+	};
+
+	process_map(size_t num_workers, std::function<T(size_t job)> fn) :
+		pool{num_workers, sizeof(T), [fn = std::move(fn)](size_t job, void *out) {
+			const T result = fn(job);
+			std::memcpy(out, &result, sizeof(T));
+		}} {}
+
+	void submit(size_t job, std::chrono::milliseconds deadline) {
+		pool.submit(job, deadline);
+	}
+
+	bool empty() const {
+		return pool.empty();
+	}
+
+	completion get() {
+		auto c = pool.get();
+		completion result{c.job, c.status, {}};
+		if (c.status == process_pool::job_status::done) {
+			std::memcpy(&result.result, c.result.data(), sizeof(T));
+		}
+		return result;
+	}
+};
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/resource.h>
+
+#ifdef INCLUDE_TESTS
+#include <sstream>
+#include <thread>
+#include <catch2/catch_test_macros.hpp>
+#endif
+
+#include <aixlog.hpp>
+
+#include "profiling.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+std::atomic<bool> profiling_active{false};
+
+// durations up to 2^i microseconds go in bucket i, the last catches the rest
+static constexpr size_t num_buckets = 32;
+
+namespace {
+struct phase_stats {
+	unsigned long count = 0;
+	double
+		total = 0,
+		min = std::numeric_limits<double>::infinity(),
+		max = 0;
+	unsigned long buckets[num_buckets] = {};
+
+	void add(double seconds) {
+		count += 1;
+		total += seconds;
+		min = std::min(min, seconds);
+		max = std::max(max, seconds);
+
+		size_t bucket = 0;
+		for (double limit = 1e-6; seconds > limit && bucket < num_buckets - 1; limit *= 2) {
+			bucket += 1;
+		}
+		buckets[bucket] += 1;
+	}
+
+	void merge(const phase_stats &other) {
+		count += other.count;
+		total += other.total;
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+		for (size_t i = 0; i < num_buckets; i++) {
+			buckets[i] += other.buckets[i];
+		}
+	}
+};
+
+struct counter_stats {
+	unsigned long count = 0;
+	double
+		total = 0,
+		min = std::numeric_limits<double>::infinity(),
+		max = -std::numeric_limits<double>::infinity(),
+		last = 0;
+
+	void add(double value) {
+		count += 1;
+		total += value;
+		min = std::min(min, value);
+		max = std::max(max, value);
+		last = value;
+	}
+
+	void merge(const counter_stats &other) {
+		count += other.count;
+		total += other.total;
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+		last = other.last;
+	}
+};
+
+struct event {
+	const char *name;
+	clock_type::time_point start;
+	clock_type::duration duration;
+	// only for counter samples
+	bool is_counter;
+	double value;
+};
+
+// the mutex is only contended by writing out the profile
+struct thread_recorder {
+	size_t index;
+	std::mutex mutex;
+	std::unordered_map<const char *, phase_stats> phases;
+	std::unordered_map<const char *, counter_stats> counters;
+	std::vector<event> events;
+};
+}
+
+static std::mutex registry_mutex;
+// never freed, so threads exiting after main can still record
+static auto &recorders = *new std::vector<std::unique_ptr<thread_recorder>>;
+static clock_type::time_point epoch;
+static bool keep_events = false;
+
+static thread_local thread_recorder *current_recorder = nullptr;
+
+static thread_recorder &
+recorder_of_thread()
+{
+	if (!current_recorder) {
+		std::unique_lock<std::mutex> mlock(registry_mutex);
+		recorders.emplace_back(new thread_recorder);
+		current_recorder = recorders.back().get();
+		current_recorder->index = recorders.size() - 1;
+	}
+	return *current_recorder;
+}
+
+void
+enable_profiling(bool keep)
+{
+	if (!profiling_enabled()) {
+		epoch = clock_type::now();
+		// the calling thread, normally main, is always thread zero
+		recorder_of_thread();
+	}
+	keep_events = keep_events || keep;
+	profiling_active = true;
+}
+
+void
+profile_record_scope(const char *name, clock_type::time_point start, clock_type::time_point end)
+{
+	auto &rec = recorder_of_thread();
+	std::unique_lock<std::mutex> mlock(rec.mutex);
+	rec.phases[name].add(std::chrono::duration<double>(end - start).count());
+	if (keep_events) {
+		rec.events.push_back({name, start, end - start, false, 0});
+	}
+}
+
+void
+profile_record_counter(const char *name, double value)
+{
+	auto &rec = recorder_of_thread();
+	std::unique_lock<std::mutex> mlock(rec.mutex);
+	rec.counters[name].add(value);
+	if (keep_events) {
+		rec.events.push_back({name, clock_type::now(), {}, true, value});
+	}
+}
+
+// names are literals in our code, but don't want a stray quote to break
+// the whole file
+static void
+write_json_string(std::ostream &out, const char *s)
+{
+	out << '"';
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			out << '\\' << *s;
+		} else if ((unsigned char)*s < 0x20) {
+			out << ' ';
+		} else {
+			out << *s;
+		}
+	}
+	out << '"';
+}
+
+static double
+microseconds_since_epoch(clock_type::time_point t)
+{
+	return std::chrono::duration<double, std::micro>(t - epoch).count();
+}
+
+bool
+write_profile_summary(std::ostream &out)
+{
+	std::unique_lock<std::mutex> rlock(registry_mutex);
+
+	std::map<std::string, phase_stats> phases;
+	std::map<std::string, counter_stats> counters;
+	std::vector<std::map<std::string, double>> thread_phases;
+
+	for (const auto &rec : recorders) {
+		std::unique_lock<std::mutex> mlock(rec->mutex);
+		thread_phases.emplace_back();
+		for (const auto &[name, stats] : rec->phases) {
+			phases[name].merge(stats);
+			thread_phases.back()[name] += stats.total;
+		}
+		for (const auto &[name, stats] : rec->counters) {
+			counters[name].merge(stats);
+		}
+	}
+
+	const double wall_seconds = profiling_enabled() ?
+		std::chrono::duration<double>(clock_type::now() - epoch).count() : 0;
+
+	// linux reports these in kilobytes. children are worker processes, e.g.
+	// overlap_checker --isolate
+	struct rusage self = {}, children = {};
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	out << std::setprecision(6);
+	out
+		<< "{\n\"wall_seconds\": " << wall_seconds
+		<< ",\n\"peak_rss_bytes\": " << (self.ru_maxrss * 1024L)
+		<< ",\n\"peak_child_rss_bytes\": " << (children.ru_maxrss * 1024L)
+		<< ",\n\"phases\": {";
+
+	const char *sep = "\n";
+	for (const auto &[name, stats] : phases) {
+		out << sep << "  ";
+		write_json_string(out, name.c_str());
+		out
+			<< ": {\"count\": " << stats.count
+			<< ", \"total_seconds\": " << stats.total
+			<< ", \"min_seconds\": " << stats.min
+			<< ", \"max_seconds\": " << stats.max
+			<< ", \"histogram\": [";
+		// pairs of bucket upper bound in seconds and count, skipping empty
+		// buckets. the last bucket has no upper bound
+		const char *bsep = "";
+		double limit = 1e-6;
+		for (size_t i = 0; i < num_buckets; i++, limit *= 2) {
+			if (stats.buckets[i]) {
+				out << bsep << '[';
+				if (i == num_buckets - 1) {
+					out << "null";
+				} else {
+					out << limit;
+				}
+				out << ", " << stats.buckets[i] << ']';
+				bsep = ", ";
+			}
+		}
+		out << "]}";
+		sep = ",\n";
+	}
+
+	out << "\n},\n\"threads\": [";
+	sep = "\n";
+	for (const auto &thread : thread_phases) {
+		out << sep << "  {";
+		const char *psep = "";
+		for (const auto &[name, total] : thread) {
+			out << psep;
+			write_json_string(out, name.c_str());
+			out << ": " << total;
+			psep = ", ";
+		}
+		out << '}';
+		sep = ",\n";
+	}
+
+	out << "\n],\n\"counters\": {";
+	sep = "\n";
+	for (const auto &[name, stats] : counters) {
+		out << sep << "  ";
+		write_json_string(out, name.c_str());
+		out
+			<< ": {\"count\": " << stats.count
+			<< ", \"mean\": " << (stats.total / double(stats.count))
+			<< ", \"min\": " << stats.min
+			<< ", \"max\": " << stats.max
+			<< ", \"last\": " << stats.last << '}';
+		sep = ",\n";
+	}
+	out << "\n}\n}\n";
+
+	return bool(out);
+}
+
+bool
+write_chrome_trace(std::ostream &out)
+{
+	std::unique_lock<std::mutex> rlock(registry_mutex);
+
+	out << std::fixed << std::setprecision(3);
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+	const char *sep = "\n";
+	for (const auto &rec : recorders) {
+		std::unique_lock<std::mutex> mlock(rec->mutex);
+
+		out
+			<< sep << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+			<< rec->index << ", \"args\": {\"name\": \"";
+		if (rec->index == 0) {
+			out << "main";
+		} else {
+			out << "thread " << rec->index;
+		}
+		out << "\"}}";
+		sep = ",\n";
+
+		for (const auto &ev : rec->events) {
+			out << sep << "{\"name\": ";
+			write_json_string(out, ev.name);
+			if (ev.is_counter) {
+				// counters are shown per process, so keep threads apart
+				out
+					<< ", \"ph\": \"C\", \"ts\": " << microseconds_since_epoch(ev.start)
+					<< ", \"pid\": 1, \"tid\": " << rec->index
+					<< ", \"args\": {\"value\": " << ev.value << "}}";
+			} else {
+				out
+					<< ", \"ph\": \"X\", \"ts\": " << microseconds_since_epoch(ev.start)
+					<< ", \"dur\": " << std::chrono::duration<double, std::micro>(ev.duration).count()
+					<< ", \"pid\": 1, \"tid\": " << rec->index << '}';
+			}
+		}
+	}
+	out << "\n]}\n";
+
+	return bool(out);
+}
+
+template<typename F>
+static bool
+write_to_file(const std::string &path, const char *what, F &&fn)
+{
+	std::ofstream out{path};
+	if (!out.is_open() || !fn(out)) {
+		LOG(ERROR) << "unable to write " << what << " to " << path << '\n';
+		return false;
+	}
+	LOG(DEBUG) << "wrote " << what << " to " << path << '\n';
+	return true;
+}
+
+bool
+write_profile_summary(const std::string &path)
+{
+	return write_to_file(path, "profile summary", [](std::ostream &out) {
+		return write_profile_summary(out);
+	});
+}
+
+bool
+write_chrome_trace(const std::string &path)
+{
+	return write_to_file(path, "trace", [](std::ostream &out) {
+		return write_chrome_trace(out);
+	});
+}
+
+profile_writer::~profile_writer()
+{
+	if (!summary_path.empty()) {
+		write_profile_summary(summary_path);
+	}
+	if (!trace_path.empty()) {
+		write_chrome_trace(trace_path);
+	}
+}
+
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("profiling") {
+	// recording is global, so only enabled once here
+	enable_profiling(true);
+	REQUIRE(profiling_enabled());
+
+	{
+		profile_scope scope{"test outer"};
+		std::thread worker{[]() {
+			profile_scope inner{"test inner"};
+			profile_counter("test depth", 3);
+		}};
+		worker.join();
+		profile_counter("test depth", 1);
+	}
+
+	// not in sections, as they'd each record everything again
+	{
+		std::stringstream out;
+		REQUIRE(write_profile_summary(out));
+		const auto s = out.str();
+		CHECK(s.find("\"test outer\": {\"count\": 1,") != std::string::npos);
+		CHECK(s.find("\"test inner\": {\"count\": 1,") != std::string::npos);
+		CHECK(s.find("\"test depth\": {\"count\": 2, \"mean\": 2, \"min\": 1, \"max\": 3,") != std::string::npos);
+	}
+
+	{
+		std::stringstream out;
+		REQUIRE(write_chrome_trace(out));
+		const auto s = out.str();
+		CHECK(s.find("{\"name\": \"test outer\", \"ph\": \"X\"") != std::string::npos);
+		CHECK(s.find("{\"name\": \"test depth\", \"ph\": \"C\"") != std::string::npos);
+		CHECK(s.find("\"tid\": 0, \"args\": {\"name\": \"main\"}") != std::string::npos);
+	}
+}
+#endif
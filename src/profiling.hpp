@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+#include <string>
+
+
+/* lightweight instrumentation of where time goes. scopes and counter samples
+ * are recorded into per-thread buffers so threads don't contend with each
+ * other, and cost a single relaxed load when profiling isn't enabled.
+ *
+ * names are compared by pointer while recording, so must be string literals
+ * (or otherwise outlive the program). they're merged by value when written
+ * out, so the same name used in different files ends up in the same phase
+ */
+
+// use the helpers below rather than these directly
+extern std::atomic<bool> profiling_active;
+
+void profile_record_scope(
+	const char *name,
+	std::chrono::steady_clock::time_point start,
+	std::chrono::steady_clock::time_point end);
+
+void profile_record_counter(const char *name, double value);
+
+inline bool
+profiling_enabled()
+{
+	return profiling_active.load(std::memory_order_relaxed);
+}
+
+// should be called before starting any threads, times are reported relative
+// to this call. keep_events records every scope and sample for
+// write_chrome_trace, rather than only the per-phase summaries
+void enable_profiling(bool keep_events);
+
+// times from construction to destruction, e.g. profile_scope scope{"pave"};
+class profile_scope {
+	using clock = std::chrono::steady_clock;
+
+	const char *name;
+	clock::time_point start;
+
+public:
+	explicit profile_scope(const char *name) :
+		name{profiling_enabled() ? name : nullptr} {
+		if (this->name) {
+			start = clock::now();
+		}
+	}
+
+	~profile_scope() {
+		if (name) {
+			profile_record_scope(name, start, clock::now());
+		}
+	}
+
+	profile_scope(const profile_scope &) = delete;
+	profile_scope& operator=(const profile_scope &) = delete;
+};
+
+// samples a quantity that changes over time, e.g. the depth of a queue
+inline void
+profile_counter(const char *name, double value)
+{
+	if (profiling_enabled()) {
+		profile_record_counter(name, value);
+	}
+}
+
+// JSON object with wall time, peak resident memory, then for each phase a
+// count, total, min and max time and a histogram of durations in power of
+// two buckets, per-thread time in each phase, and summaries of each counter
+bool write_profile_summary(std::ostream &out);
+bool write_profile_summary(const std::string &path);
+
+// chrome://tracing or https://ui.perfetto.dev JSON, only contains anything if
+// enabled with keep_events
+bool write_chrome_trace(std::ostream &out);
+bool write_chrome_trace(const std::string &path);
+
+/* set by the --profile and --trace-file options, see
+ * tool_argp_parser::add_profile_options, and writes them when destroyed. it
+ * should be declared before any thread_pool so their workers have finished
+ */
+struct profile_writer {
+	std::string summary_path, trace_path;
+
+	profile_writer() = default;
+	~profile_writer();
+
+	profile_writer(const profile_writer &) = delete;
+	profile_writer& operator=(const profile_writer &) = delete;
+};
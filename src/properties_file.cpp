@@ -0,0 +1,377 @@
+#include <cstring>
+#include <fstream>
+
+#include <sys/stat.h>
+
+#ifdef INCLUDE_TESTS
+#include <unistd.h>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/catch_approx.hpp>
+#endif
+
+#include <gp_Dir.hxx>
+#include <gp_Pnt.hxx>
+#include <gp_XYZ.hxx>
+
+#include <aixlog.hpp>
+
+#include "profiling.hpp"
+#include "properties_file.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+
+static const char magic[8] = {'S', 'O', 'L', 'P', 'R', 'O', 'P', '1'};
+static const uint64_t byte_order_marker = 0x0102030405060708ull;
+
+// identifies the version of the BREP file the properties were computed from
+struct brep_stamp {
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+
+	bool operator==(const brep_stamp &other) const {
+		return size == other.size &&
+			mtime_sec == other.mtime_sec &&
+			mtime_nsec == other.mtime_nsec;
+	}
+};
+
+static bool
+stamp_of_file(const std::string &path, brep_stamp &stamp)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return false;
+	}
+	stamp.size = (uint64_t)st.st_size;
+	stamp.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+	stamp.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+	return true;
+}
+
+template<typename T>
+static void
+write_val(std::ostream &out, T val)
+{
+	out.write(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+template<typename T>
+static bool
+read_val(std::istream &in, T &val)
+{
+	return bool(in.read(reinterpret_cast<char *>(&val), sizeof(val)));
+}
+
+static void
+write_xyz(std::ostream &out, const gp_XYZ &xyz)
+{
+	write_val(out, xyz.X());
+	write_val(out, xyz.Y());
+	write_val(out, xyz.Z());
+}
+
+static bool
+read_xyz(std::istream &in, gp_XYZ &xyz)
+{
+	double x, y, z;
+	if (!(read_val(in, x) && read_val(in, y) && read_val(in, z))) {
+		return false;
+	}
+	xyz.SetCoord(x, y, z);
+	return true;
+}
+
+static void
+write_obb(std::ostream &out, const Bnd_OBB &obb)
+{
+	write_val(out, uint8_t(obb.IsVoid()));
+	write_xyz(out, obb.Center());
+	write_xyz(out, obb.XDirection());
+	write_xyz(out, obb.YDirection());
+	write_xyz(out, obb.ZDirection());
+	write_val(out, obb.XHSize());
+	write_val(out, obb.YHSize());
+	write_val(out, obb.ZHSize());
+	write_val(out, uint8_t(obb.IsAABox()));
+}
+
+static bool
+read_obb(std::istream &in, Bnd_OBB &obb)
+{
+	uint8_t is_void, is_aabox;
+	gp_XYZ center, xdir, ydir, zdir;
+	double hx, hy, hz;
+	if (!(read_val(in, is_void) &&
+		  read_xyz(in, center) && read_xyz(in, xdir) &&
+		  read_xyz(in, ydir) && read_xyz(in, zdir) &&
+		  read_val(in, hx) && read_val(in, hy) && read_val(in, hz) &&
+		  read_val(in, is_aabox))) {
+		return false;
+	}
+	if (is_void) {
+		obb = Bnd_OBB{};
+	} else {
+		obb = Bnd_OBB{center, xdir, ydir, zdir, hx, hy, hz};
+		obb.SetAABox(is_aabox != 0);
+	}
+	return true;
+}
+
+static void
+write_box(std::ostream &out, const Bnd_Box &box)
+{
+	write_val(out, uint8_t(box.IsVoid()));
+	double xmin = 0, ymin = 0, zmin = 0, xmax = 0, ymax = 0, zmax = 0;
+	if (!box.IsVoid()) {
+		box.Get(xmin, ymin, zmin, xmax, ymax, zmax);
+	}
+	for (const auto val : {xmin, ymin, zmin, xmax, ymax, zmax}) {
+		write_val(out, val);
+	}
+}
+
+static bool
+read_box(std::istream &in, Bnd_Box &box)
+{
+	uint8_t is_void;
+	double xmin, ymin, zmin, xmax, ymax, zmax;
+	if (!(read_val(in, is_void) &&
+		  read_val(in, xmin) && read_val(in, ymin) && read_val(in, zmin) &&
+		  read_val(in, xmax) && read_val(in, ymax) && read_val(in, zmax))) {
+		return false;
+	}
+	box = Bnd_Box{};
+	if (!is_void) {
+		box.Update(xmin, ymin, zmin, xmax, ymax, zmax);
+	}
+	return true;
+}
+
+std::string
+properties_path_of(const std::string &brep_path)
+{
+	return brep_path + ".props";
+}
+
+bool
+read_properties_file(const std::string &brep_path, std::vector<solid_properties> &props)
+{
+	const auto path = properties_path_of(brep_path);
+
+	std::ifstream in{path, std::ios::binary};
+	if (!in.is_open()) {
+		LOG(DEBUG) << "no solid properties file " << path << '\n';
+		return false;
+	}
+
+	char buf[sizeof(magic)];
+	uint64_t marker, num_solids;
+	brep_stamp stamp, current;
+	if (!(in.read(buf, sizeof(buf)) &&
+		  std::memcmp(buf, magic, sizeof(magic)) == 0 &&
+		  read_val(in, marker) && marker == byte_order_marker &&
+		  read_val(in, stamp.size) &&
+		  read_val(in, stamp.mtime_sec) &&
+		  read_val(in, stamp.mtime_nsec) &&
+		  read_val(in, num_solids))) {
+		LOG(WARNING) << "ignoring invalid solid properties file " << path << '\n';
+		return false;
+	}
+
+	if (!stamp_of_file(brep_path, current) || !(stamp == current)) {
+		LOG(INFO) << "ignoring solid properties file " << path << ", BREP file has changed\n";
+		return false;
+	}
+
+	std::vector<solid_properties> result;
+	// don't trust the count to reserve
+	for (uint64_t i = 0; i < num_solids; i++) {
+		solid_properties p;
+		int32_t counts[4];
+		if (!(read_obb(in, p.obb) &&
+			  read_box(in, p.aabb) &&
+			  read_val(in, p.volume) &&
+			  read_val(in, counts))) {
+			LOG(WARNING) << "ignoring truncated solid properties file " << path << '\n';
+			return false;
+		}
+		p.num_faces = counts[0];
+		p.num_edges = counts[1];
+		p.num_verticies = counts[2];
+		p.num_curved_faces = counts[3];
+		result.push_back(p);
+	}
+
+	LOG(DEBUG) << "read properties of " << result.size() << " solids from " << path << '\n';
+
+	props.swap(result);
+	return true;
+}
+
+bool
+write_properties_file(const std::string &brep_path, const std::vector<solid_properties> &props)
+{
+	const auto path = properties_path_of(brep_path);
+
+	brep_stamp stamp;
+	if (!stamp_of_file(brep_path, stamp)) {
+		LOG(WARNING) << "unable to stat " << brep_path << ", not writing " << path << '\n';
+		return false;
+	}
+
+	std::ofstream out{path, std::ios::binary | std::ios::trunc};
+	if (!out.is_open()) {
+		LOG(WARNING) << "unable to open " << path << " for writing\n";
+		return false;
+	}
+
+	out.write(magic, sizeof(magic));
+	write_val(out, byte_order_marker);
+	write_val(out, stamp.size);
+	write_val(out, stamp.mtime_sec);
+	write_val(out, stamp.mtime_nsec);
+	write_val(out, (uint64_t)props.size());
+
+	for (const auto &p : props) {
+		write_obb(out, p.obb);
+		write_box(out, p.aabb);
+		write_val(out, p.volume);
+		const int32_t counts[4] = {
+			p.num_faces, p.num_edges, p.num_verticies, p.num_curved_faces,
+		};
+		write_val(out, counts);
+	}
+
+	out.close();
+	if (out.fail()) {
+		LOG(WARNING) << "failed to write " << path << '\n';
+		return false;
+	}
+
+	LOG(DEBUG) << "wrote properties of " << props.size() << " solids to " << path << '\n';
+	return true;
+}
+
+void
+update_properties(
+	const document &doc, const std::vector<size_t> &indices,
+	std::vector<solid_properties> &props, thread_pool &pool)
+{
+	props.resize(doc.solid_shapes.size());
+
+	parfor work;
+	for (const auto i : indices) {
+		work.submit(pool, [&doc, &props, i]() {
+			props[i] = properties_of_solid(doc.solid_shapes[i]);
+		});
+	}
+}
+
+std::vector<solid_properties>
+compute_properties(const document &doc, thread_pool &pool)
+{
+	std::vector<size_t> indices(doc.solid_shapes.size());
+	for (size_t i = 0; i < indices.size(); i++) {
+		indices[i] = i;
+	}
+
+	std::vector<solid_properties> props;
+	update_properties(doc, indices, props, pool);
+	return props;
+}
+
+std::vector<solid_properties>
+compute_properties(
+	const document &doc, const std::vector<double> &volumes, thread_pool &pool)
+{
+	std::vector<solid_properties> props(doc.solid_shapes.size());
+	{
+		parfor work;
+		for (size_t i = 0; i < props.size(); i++) {
+			work.submit(pool, [&doc, &volumes, &props, i]() {
+				const auto &shape = doc.solid_shapes[i];
+				props[i] = i < volumes.size() && volumes[i] >= 0 ?
+					properties_of_solid(shape, volumes[i]) :
+					properties_of_solid(shape);
+			});
+		}
+	}
+	return props;
+}
+
+std::vector<solid_properties>
+load_or_compute_properties(
+	const document &doc, const std::string &brep_path, thread_pool &pool)
+{
+	profile_scope scope{"load properties"};
+	std::vector<solid_properties> props;
+	if (read_properties_file(brep_path, props)) {
+		if (props.size() == doc.solid_shapes.size()) {
+			return props;
+		}
+		LOG(WARNING)
+			<< "ignoring solid properties file, it has " << props.size()
+			<< " solids rather than " << doc.solid_shapes.size() << '\n';
+	}
+
+	LOG(INFO) << "calculating properties of " << doc.solid_shapes.size() << " solids\n";
+	return compute_properties(doc, pool);
+}
+
+
+#ifdef INCLUDE_TESTS
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeCylinder.hxx>
+
+TEST_CASE("properties file") {
+	using Catch::Approx;
+
+	const temp_file file{"properties_file_test"};
+	const char *path = file.path();
+	std::ofstream{path} << "brep";
+
+	const std::vector<solid_properties> props = {
+		properties_of_solid(BRepPrimAPI_MakeBox(gp_Pnt(1, 2, 3), 1, 2, 3).Shape()),
+		properties_of_solid(BRepPrimAPI_MakeCylinder(1, 2).Shape()),
+	};
+
+	REQUIRE(write_properties_file(path, props));
+
+	SECTION("round trip") {
+		std::vector<solid_properties> result;
+		REQUIRE(read_properties_file(path, result));
+		REQUIRE(result.size() == 2);
+
+		for (size_t i = 0; i < props.size(); i++) {
+			CHECK(result[i].volume == props[i].volume);
+			CHECK(result[i].num_faces == props[i].num_faces);
+			CHECK(result[i].num_edges == props[i].num_edges);
+			CHECK(result[i].num_verticies == props[i].num_verticies);
+			CHECK(result[i].num_curved_faces == props[i].num_curved_faces);
+
+			CHECK(result[i].obb.Center().Distance(props[i].obb.Center()) == Approx(0));
+			CHECK(result[i].obb.XHSize() == props[i].obb.XHSize());
+			CHECK(result[i].obb.IsOut(props[i].obb) == false);
+
+			double a[6], b[6];
+			result[i].aabb.Get(a[0], a[1], a[2], a[3], a[4], a[5]);
+			props[i].aabb.Get(b[0], b[1], b[2], b[3], b[4], b[5]);
+			for (int j = 0; j < 6; j++) {
+				CHECK(a[j] == Approx(b[j]));
+			}
+		}
+	}
+
+	SECTION("stale after BREP file changes") {
+		{
+			std::ofstream out{path, std::ios::app};
+			out << " changed";
+		}
+		std::vector<solid_properties> result;
+		CHECK_FALSE(read_properties_file(path, result));
+	}
+
+	unlink(properties_path_of(path).c_str());
+}
+#endif
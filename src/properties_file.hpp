@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+
+
+/* binary "sidecar" file holding solid_properties for each solid in a BREP
+ * file, so tools don't need to compute bounding boxes and volumes again.
+ * it's kept next to the BREP file, e.g. model.brep has model.brep.props.
+ *
+ * the size and modification time of the BREP file are recorded when the
+ * sidecar is written, so it's ignored if the BREP file has been changed by
+ * something that didn't update it.
+ */
+
+std::string properties_path_of(const std::string &brep_path);
+
+// returns false if the sidecar is missing, invalid or stale
+bool read_properties_file(
+	const std::string &brep_path, std::vector<solid_properties> &props);
+
+// call after writing the BREP file, as its size and modification time are
+// recorded. returns false with a logged warning on failure
+bool write_properties_file(
+	const std::string &brep_path, const std::vector<solid_properties> &props);
+
+// computes properties of the given solids in parallel
+void update_properties(
+	const document &doc, const std::vector<size_t> &indices,
+	std::vector<solid_properties> &props, thread_pool &pool);
+
+// all solids in the document, in parallel
+std::vector<solid_properties> compute_properties(
+	const document &doc, thread_pool &pool);
+
+// as above, but reusing a volume for each solid when it's already known.
+// negative volumes are taken as unknown, and computed
+std::vector<solid_properties> compute_properties(
+	const document &doc, const std::vector<double> &volumes, thread_pool &pool);
+
+// uses the BREP file's sidecar if it's valid for this document, otherwise
+// computes everything
+std::vector<solid_properties> load_or_compute_properties(
+	const document &doc, const std::string &brep_path, thread_pool &pool);
@@ -0,0 +1,273 @@
+#include <cerrno>
+#include <cstdlib>
+#include <ios>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef INCLUDE_TESTS
+#include <catch2/catch_test_macros.hpp>
+#endif
+
+#include <aixlog.hpp>
+
+#include "result_cache.hpp"
+#include "utils.hpp"
+
+
+static const char *
+name_of_status(intersect_status status)
+{
+	switch (status) {
+	case intersect_status::failed: return "failed";
+	case intersect_status::timeout: return "timeout";
+	case intersect_status::distinct: return "distinct";
+	case intersect_status::touching: return "touching";
+	case intersect_status::overlap: return "overlap";
+	}
+	return "unknown";
+}
+
+static bool
+status_of_name(const std::string &name, intersect_status &status)
+{
+	for (const auto st : {
+			intersect_status::failed,
+			intersect_status::timeout,
+			intersect_status::distinct,
+			intersect_status::touching,
+			intersect_status::overlap}) {
+		if (name == name_of_status(st)) {
+			status = st;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+uint64_of_hex(const std::string &str, uint64_t &val)
+{
+	char *end;
+	errno = 0;
+	const auto l = std::strtoull(str.c_str(), &end, 16);
+	if (errno == ERANGE || str.empty() || *end != '\0') {
+		return false;
+	}
+	val = l;
+	return true;
+}
+
+bool
+double_of_string(const std::string &str, double &val)
+{
+	char *end;
+	errno = 0;
+	const double d = std::strtod(str.c_str(), &end);
+	if (errno == ERANGE || str.empty() || *end != '\0') {
+		return false;
+	}
+	val = d;
+	return true;
+}
+
+void
+write_result_fields(std::ostream &out, const intersect_result &result)
+{
+	out
+		<< name_of_status(result.status) << ','
+		<< std::hexfloat
+		<< result.fuzzy_value << ','
+		<< result.num_filler_warnings << ','
+		<< result.num_common_warnings << ','
+		<< result.num_section_warnings << ','
+		<< result.vol_common << ','
+		<< result.vol_cut << ','
+		<< result.vol_cut12 << ','
+		<< result.pave_time_seconds
+		<< std::defaultfloat;
+}
+
+bool
+parse_result_fields(
+	const std::vector<std::string> &fields, size_t first, intersect_result &result)
+{
+	if (fields.size() < first + num_result_fields) {
+		return false;
+	}
+	const std::string *f = fields.data() + first;
+	return
+		status_of_name(f[0], result.status) &&
+		double_of_string(f[1], result.fuzzy_value) &&
+		int_of_string(f[2].c_str(), result.num_filler_warnings) &&
+		int_of_string(f[3].c_str(), result.num_common_warnings) &&
+		int_of_string(f[4].c_str(), result.num_section_warnings) &&
+		double_of_string(f[5], result.vol_common) &&
+		double_of_string(f[6], result.vol_cut) &&
+		double_of_string(f[7], result.vol_cut12) &&
+		double_of_string(f[8], result.pave_time_seconds);
+}
+
+bool
+result_cache::open(const char *path, uint64_t settings_hash)
+{
+	settings = settings_hash;
+
+	size_t num_invalid = 0, num_other = 0;
+	bool needs_newline = false;
+
+	{
+		std::ifstream input{path};
+		std::string line;
+		while (std::getline(input, line)) {
+			const auto fields = parse_csv_row(line);
+
+			key k;
+			intersect_result res;
+			if (!(fields.size() == 3 + num_result_fields &&
+				  uint64_of_hex(fields[0], k.settings) &&
+				  uint64_of_hex(fields[1], k.shape) &&
+				  uint64_of_hex(fields[2], k.tool) &&
+				  parse_result_fields(fields, 3, res))) {
+				num_invalid += 1;
+				continue;
+			}
+
+			if (k.settings == settings) {
+				entries[k] = res;
+			} else {
+				num_other += 1;
+			}
+		}
+
+		// a previous run might have been killed part way through a line
+		if (input.eof() && !line.empty()) {
+			needs_newline = true;
+		}
+	}
+
+	LOG(DEBUG)
+		<< "loaded " << entries.size() << " entries from result cache " << path
+		<< ", ignoring " << num_other << " with other settings\n";
+
+	if (num_invalid > 0) {
+		LOG(WARNING)
+			<< "ignoring " << num_invalid << " invalid lines in result cache " << path << '\n';
+	}
+
+	output.open(path, std::ios::app);
+	if (!output.is_open()) {
+		return false;
+	}
+	if (needs_newline) {
+		output << '\n';
+	}
+	return true;
+}
+
+bool
+result_cache::lookup(uint64_t shape, uint64_t tool, intersect_result &result) const
+{
+	auto it = entries.find({settings, shape, tool});
+	if (it != entries.end()) {
+		result = it->second;
+		return true;
+	}
+
+	it = entries.find({settings, tool, shape});
+	if (it != entries.end()) {
+		result = it->second;
+		std::swap(result.vol_cut, result.vol_cut12);
+		return true;
+	}
+
+	return false;
+}
+
+void
+result_cache::insert(uint64_t shape, uint64_t tool, const intersect_result &result)
+{
+	entries[{settings, shape, tool}] = result;
+
+	if (!output.is_open()) {
+		return;
+	}
+
+	output
+		<< std::hex
+		<< settings << ',' << shape << ',' << tool << ','
+		<< std::dec;
+	write_result_fields(output, result);
+	output << '\n';
+
+	// results are expensive to compute, so don't want to lose them if we're
+	// killed
+	output.flush();
+}
+
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("result_cache") {
+	const temp_file file{"result_cache_test"};
+	const char *path = file.path();
+
+	const intersect_result overlap = {
+		intersect_status::overlap, 0.001, 1, 2, 3, 10.5, 0.1, 1.0/3, 2.5,
+	};
+
+	{
+		result_cache cache;
+		REQUIRE(cache.open(path, 42));
+		CHECK(cache.size() == 0);
+		cache.insert(1, 2, overlap);
+		CHECK(cache.size() == 1);
+	}
+
+	SECTION("entries persist") {
+		result_cache cache;
+		REQUIRE(cache.open(path, 42));
+		CHECK(cache.size() == 1);
+
+		intersect_result res;
+		REQUIRE(cache.lookup(1, 2, res));
+		CHECK(res.status == intersect_status::overlap);
+		CHECK(res.fuzzy_value == overlap.fuzzy_value);
+		CHECK(res.num_filler_warnings == 1);
+		CHECK(res.num_common_warnings == 2);
+		CHECK(res.num_section_warnings == 3);
+		CHECK(res.vol_common == overlap.vol_common);
+		CHECK(res.vol_cut == overlap.vol_cut);
+		CHECK(res.vol_cut12 == overlap.vol_cut12);
+		CHECK(res.pave_time_seconds == overlap.pave_time_seconds);
+
+		// swapped order
+		REQUIRE(cache.lookup(2, 1, res));
+		CHECK(res.vol_cut == overlap.vol_cut12);
+		CHECK(res.vol_cut12 == overlap.vol_cut);
+
+		CHECK_FALSE(cache.lookup(1, 3, res));
+	}
+
+	SECTION("other settings are ignored") {
+		result_cache cache;
+		REQUIRE(cache.open(path, 43));
+		CHECK(cache.size() == 0);
+	}
+
+	SECTION("truncated lines are ignored") {
+		{
+			std::ofstream out{path, std::ios::app};
+			out << "2a,3,4,touch";
+		}
+		{
+			result_cache cache;
+			REQUIRE(cache.open(path, 42));
+			CHECK(cache.size() == 1);
+			cache.insert(5, 6, overlap);
+		}
+		result_cache cache;
+		REQUIRE(cache.open(path, 42));
+		CHECK(cache.size() == 2);
+	}
+}
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "geometry.hpp"
+
+
+// intersect_result as CSV fields, with doubles in hex so they're read back
+// exactly. shared with checkpoint_journal
+static const size_t num_result_fields = 9;
+void write_result_fields(std::ostream &out, const intersect_result &result);
+bool parse_result_fields(
+	const std::vector<std::string> &fields, size_t first, intersect_result &result);
+
+bool uint64_of_hex(const std::string &str, uint64_t &val);
+bool double_of_string(const std::string &str, double &val);
+
+/* persistent cache of pair classifications, so that rechecking a model where
+ * only a few solids changed doesn't need to pave every pair again.
+ *
+ * entries are keyed by the content hash of both solids (see hash_of_shape)
+ * and a hash of the settings that could affect the result, e.g. fuzzy values
+ * and OCCT version. the file is CSV with one line per entry and is only ever
+ * appended to, so entries for other settings are kept and ignored.
+ */
+class result_cache {
+	struct key {
+		uint64_t settings, shape, tool;
+
+		bool operator==(const key &other) const {
+			return settings == other.settings &&
+				shape == other.shape &&
+				tool == other.tool;
+		}
+	};
+
+	struct key_hasher {
+		size_t operator()(const key &k) const {
+			return (size_t)(k.settings ^ (k.shape * 31) ^ (k.tool * 1009));
+		}
+	};
+
+	uint64_t settings;
+	std::unordered_map<key, intersect_result, key_hasher> entries;
+	std::ofstream output;
+
+public:
+	result_cache() : settings{0} {}
+
+	// loads any existing entries matching settings, returns false if the file
+	// can't be opened for appending
+	bool open(const char *path, uint64_t settings);
+
+	// results are symmetric, so a pair cached in the other order will be
+	// found with the cut volumes swapped
+	bool lookup(uint64_t shape, uint64_t tool, intersect_result &result) const;
+
+	void insert(uint64_t shape, uint64_t tool, const intersect_result &result);
+
+	size_t size() const {
+		return entries.size();
+	}
+};
@@ -25,9 +25,15 @@
 //
 
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <exception>
 #include <stdexcept>
 #include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <aixlog.hpp>
 
@@ -36,6 +42,8 @@
 #include <Standard_Boolean.hxx>
 #include <Standard_TypeDef.hxx>
 
+#include <Precision.hxx>
+
 #include <gp_Pnt.hxx>
 #include <gp_Pnt2d.hxx>
 
@@ -78,7 +86,15 @@
 #include <GeomAPI_ProjectPointOnSurf.hxx>
 #include <GeomAPI_ProjectPointOnCurve.hxx>
 
+#ifdef INCLUDE_TESTS
+#include <random>
+#include <BRepBuilderAPI_MakeVertex.hxx>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#endif
+
 #include "geom_gluer.hxx"
+#include "../thread_pool.hpp"
 
 // unnamed namespace for internal linkage
 namespace {
@@ -112,6 +128,27 @@ namespace {
 		}
 	}
 
+	// calls fn(begin, end) over contiguous ranges of [0, n) in parallel, a
+	// few per worker so uneven ranges still balance out
+	template<typename F>
+	void
+	parallel_ranges(thread_pool &pool, size_t n, F fn)
+	{
+		const size_t
+			num_ranges = std::min(n, pool.num_workers() * 8),
+			step = num_ranges ? (n + num_ranges - 1) / num_ranges : 0;
+
+		parfor work;
+		for (size_t begin = 0; begin < n; begin += step) {
+			const size_t end = std::min(n, begin + step);
+			work.submit(pool, [&fn, begin, end]() {
+				fn(begin, end);
+			});
+		}
+	}
+
+#ifdef INCLUDE_TESTS
+	// the tree based search VertexGrid replaced, kept to check it against
 	class BoundingSphere  {
 		gp_Pnt center;
 		Standard_Real radius;
@@ -193,6 +230,226 @@ namespace {
 			return indicies;
 		}
 	};
+#endif
+
+	/* finds verticies whose tolerance spheres, enlarged by a gap, touch. this
+	 * accepts exactly the verticies BoundingSphere::IsOut would.
+	 *
+	 * verticies are split into levels by tolerance, levels are uniform hash
+	 * grids with cells big enough that a query only needs to look at nearby
+	 * cells. coordinates are stored as separate arrays sorted by cell, so
+	 * each cell is a contiguous run that's cheap to scan. bulk building
+	 * avoids the per-insert cost of NCollection_UBTree, and queries don't
+	 * chase pointers or need a fence map
+	 */
+	class VertexGrid {
+		struct cell_key {
+			int64_t x, y, z;
+
+			bool operator==(const cell_key &other) const {
+				return x == other.x && y == other.y && z == other.z;
+			}
+			bool operator<(const cell_key &other) const {
+				if (x != other.x) return x < other.x;
+				if (y != other.y) return y < other.y;
+				return z < other.z;
+			}
+		};
+
+		struct cell_hasher {
+			size_t operator()(const cell_key &k) const {
+				return (size_t)(
+					(uint64_t)k.x * 73856093u ^
+					(uint64_t)k.y * 19349663u ^
+					(uint64_t)k.z * 83492791u);
+			}
+		};
+
+		struct level {
+			Standard_Real max_radius, cell_size;
+
+			std::vector<Standard_Real> xs, ys, zs, radii;
+			std::vector<Standard_Integer> indices;
+
+			// begin and end of each occupied cell in the arrays
+			std::unordered_map<cell_key, std::pair<size_t, size_t>, cell_hasher> cells;
+
+			cell_key key_of(Standard_Real x, Standard_Real y, Standard_Real z) const {
+				return {
+					(int64_t)std::floor(x / cell_size),
+					(int64_t)std::floor(y / cell_size),
+					(int64_t)std::floor(z / cell_size),
+				};
+			}
+		};
+
+		Standard_Real gap;
+		std::vector<level> levels;
+
+		// same arithmetic, in the same order, as BoundingSphere::IsOut
+		static void select_range(
+			const level &lvl, size_t begin, size_t end,
+			const gp_Pnt &pnt, Standard_Real radius_gap, Standard_Real gap,
+			std::vector<Standard_Integer> &result) {
+			for (size_t i = begin; i < end; i++) {
+				Standard_Real d = pnt.X() - lvl.xs[i], dist = d * d;
+				d = pnt.Y() - lvl.ys[i];
+				dist += d * d;
+				d = pnt.Z() - lvl.zs[i];
+				dist += d * d;
+
+				const Standard_Real od = radius_gap + lvl.radii[i] + gap;
+				if (!(dist > od * od)) {
+					result.push_back(lvl.indices[i]);
+				}
+			}
+		}
+
+	public:
+		VertexGrid(const TopTools_IndexedMapOfShape& verticies, Standard_Real gap);
+
+		// 1-based indices into verticies, in increasing order
+		void Select(const TopoDS_Vertex &vertex, std::vector<Standard_Integer> &result) const;
+	};
+
+	VertexGrid::VertexGrid(const TopTools_IndexedMapOfShape& verticies, Standard_Real gap) :
+		gap{gap}
+	{
+		const size_t num = (size_t)verticies.Extent();
+		if (num == 0) {
+			return;
+		}
+
+		std::vector<gp_Pnt> points;
+		std::vector<Standard_Real> radii;
+		points.reserve(num);
+		radii.reserve(num);
+		for (int i = 1; i <= verticies.Extent(); i++) {
+			const TopoDS_Vertex& v = TopoDS::Vertex(verticies(i));
+			points.push_back(BRep_Tool::Pnt(v));
+			radii.push_back(BRep_Tool::Tolerance(v));
+		}
+
+		// most verticies have similar tolerances, so the typical one sets
+		// the finest cell size. each level up allows 4 times larger
+		Standard_Real finest;
+		{
+			std::vector<Standard_Real> sorted{radii};
+			std::nth_element(sorted.begin(), sorted.begin() + num / 2, sorted.end());
+			finest = std::max(sorted[num / 2], Precision::Confusion());
+		}
+
+		const size_t max_levels = 32;
+		std::vector<size_t> level_of(num);
+		size_t num_levels = 1;
+		for (size_t i = 0; i < num; i++) {
+			size_t k = 0;
+			for (Standard_Real max_radius = finest; radii[i] > max_radius && k + 1 < max_levels; k++) {
+				max_radius *= 4;
+			}
+			level_of[i] = k;
+			num_levels = std::max(num_levels, k + 1);
+		}
+
+		levels.resize(num_levels);
+		for (size_t k = 0; k < num_levels; k++) {
+			auto &lvl = levels[k];
+			lvl.max_radius = finest * std::pow(4., (double)k);
+			lvl.cell_size = 2 * (lvl.max_radius + gap);
+		}
+		// anything too big for the top level still gets found, queries just
+		// visit more cells
+		for (size_t i = 0; i < num; i++) {
+			auto &lvl = levels[level_of[i]];
+			lvl.max_radius = std::max(lvl.max_radius, radii[i]);
+		}
+
+		for (size_t k = 0; k < num_levels; k++) {
+			auto &lvl = levels[k];
+
+			std::vector<std::pair<cell_key, size_t>> members;
+			for (size_t i = 0; i < num; i++) {
+				if (level_of[i] == k) {
+					const auto &p = points[i];
+					members.emplace_back(lvl.key_of(p.X(), p.Y(), p.Z()), i);
+				}
+			}
+			std::sort(members.begin(), members.end(), [](const auto &a, const auto &b) {
+				if (a.first == b.first) {
+					return a.second < b.second;
+				}
+				return a.first < b.first;
+			});
+
+			lvl.xs.reserve(members.size());
+			lvl.ys.reserve(members.size());
+			lvl.zs.reserve(members.size());
+			lvl.radii.reserve(members.size());
+			lvl.indices.reserve(members.size());
+
+			for (size_t j = 0; j < members.size(); j++) {
+				const size_t i = members[j].second;
+				lvl.xs.push_back(points[i].X());
+				lvl.ys.push_back(points[i].Y());
+				lvl.zs.push_back(points[i].Z());
+				lvl.radii.push_back(radii[i]);
+				lvl.indices.push_back((Standard_Integer)i + 1);
+
+				if (j == 0 || !(members[j - 1].first == members[j].first)) {
+					lvl.cells.emplace(members[j].first, std::make_pair(j, j + 1));
+				} else {
+					lvl.cells[members[j].first].second = j + 1;
+				}
+			}
+		}
+	}
+
+	void
+	VertexGrid::Select(const TopoDS_Vertex &vertex, std::vector<Standard_Integer> &result) const
+	{
+		result.clear();
+
+		const gp_Pnt pnt = BRep_Tool::Pnt(vertex);
+		const Standard_Real radius_gap = BRep_Tool::Tolerance(vertex) + gap;
+
+		for (const auto &lvl : levels) {
+			if (lvl.indices.empty()) {
+				continue;
+			}
+
+			// furthest any accepted vertex can be along each axis, a little
+			// extra so rounding can't lose one on a cell boundary
+			const Standard_Real reach = (radius_gap + lvl.max_radius + gap) * (1 + 1e-9);
+
+			const auto
+				lo = lvl.key_of(pnt.X() - reach, pnt.Y() - reach, pnt.Z() - reach),
+				hi = lvl.key_of(pnt.X() + reach, pnt.Y() + reach, pnt.Z() + reach);
+
+			const double num_cells =
+				double(hi.x - lo.x + 1) * double(hi.y - lo.y + 1) * double(hi.z - lo.z + 1);
+
+			// very large tolerances would visit lots of empty cells
+			if (num_cells > (double)lvl.cells.size()) {
+				select_range(lvl, 0, lvl.indices.size(), pnt, radius_gap, gap, result);
+				continue;
+			}
+
+			for (int64_t x = lo.x; x <= hi.x; x++) {
+				for (int64_t y = lo.y; y <= hi.y; y++) {
+					for (int64_t z = lo.z; z <= hi.z; z++) {
+						const auto it = lvl.cells.find({x, y, z});
+						if (it != lvl.cells.end()) {
+							select_range(
+								lvl, it->second.first, it->second.second,
+								pnt, radius_gap, gap, result);
+						}
+					}
+				}
+			}
+		}
+
+		std::sort(result.begin(), result.end());
+	}
 
 	class MultiShapeKey {
 		TopTools_MapOfShape key;
@@ -273,23 +530,24 @@ namespace {
 		}
 	}
 
+	// the context caches projectors and isn't thread safe, so each thread
+	// needs its own merger
 	class shape_merger {
 		IntTools_Context &ctx;
 		Standard_Real tolerance;
 
 		std::optional<gp_Pnt> ProjectPointOnShape(const gp_Pnt& point, const TopoDS_Shape& shape);
 		TopTools_ListOfShape FindNearby(const TopoDS_Shape& shape, const TopTools_ListOfShape& others);
-		TopTools_IndexedDataMapOfShapeListOfShape FindNearbyPairwise(const TopTools_ListOfShape& shapes);
 
 	public:
-		typedef MultiShapeKeyedList<TopTools_ListOfShape> ShapeKeyedShapeList;
-
 		shape_merger(IntTools_Context &context, Standard_Real tol) :
 			ctx{context}, tolerance{tol} {}
 
-		void RefineCoincidentShapes(ShapeKeyedShapeList& coincident_shapes);
+		TopTools_IndexedDataMapOfShapeListOfShape FindNearbyPairwise(const TopTools_ListOfShape& shapes);
 	};
 
+	typedef MultiShapeKeyedList<TopTools_ListOfShape> ShapeKeyedShapeList;
+
 	std::optional<gp_Pnt>
  	shape_merger::ProjectPointOnShape(
 		const gp_Pnt& point, const TopoDS_Shape& shape)
@@ -385,14 +643,38 @@ namespace {
 		return result;
 	}
 
-	void shape_merger::RefineCoincidentShapes(ShapeKeyedShapeList& coincident_shapes)
+	// check geometric coincidence of each group of shapes in parallel, the
+	// results are then applied in order so the output doesn't depend on the
+	// number of threads
+	void
+	RefineCoincidentShapes(
+		ShapeKeyedShapeList& coincident_shapes, Standard_Real tolerance, thread_pool &pool)
 	{
+		const size_t num_groups = (size_t)coincident_shapes.Extent();
+		std::vector<TopTools_IndexedDataMapOfShapeListOfShape> found(num_groups);
+		std::vector<std::exception_ptr> errors(num_groups);
+
+		parallel_ranges(pool, num_groups, [&coincident_shapes, &found, &errors, tolerance](size_t begin, size_t end) {
+			Handle(IntTools_Context) context = new IntTools_Context;
+			shape_merger merger{*context, tolerance};
+			for (size_t i = begin; i < end; i++) {
+				try {
+					found[i] = merger.FindNearbyPairwise(
+						coincident_shapes.FindFromIndex((Standard_Integer)i + 1));
+				} catch (...) {
+					errors[i] = std::current_exception();
+				}
+			}
+		});
+
 		TopTools_IndexedDataMapOfShapeListOfShape refined;
-		for (ShapeKeyedShapeList::Iterator it{coincident_shapes}; it.More(); it.Next()) {
-			TopTools_ListOfShape& shapes = it.ChangeValue();
+		for (size_t i = 0; i < num_groups; i++) {
+			if (errors[i]) {
+				std::rethrow_exception(errors[i]);
+			}
+			TopTools_ListOfShape& shapes = coincident_shapes.ChangeFromIndex((Standard_Integer)i + 1);
 			//
-			auto found = FindNearbyPairwise(shapes);
-			decltype(found)::Iterator found_it{found};
+			decltype(found)::value_type::Iterator found_it{found[i]};
 			if (!found_it.More()) {
 				continue;
 			}
@@ -576,10 +858,10 @@ namespace {
 
 	class gluedetector {
 	public:
-		gluedetector(const TopoDS_Shape& theShape, const Standard_Real aT, IntTools_Context &ctx) :
+		gluedetector(const TopoDS_Shape& theShape, const Standard_Real aT, thread_pool &pool) :
 			myArgument{theShape},
 			myTolerance{aT},
-			merger{ctx, aT} {
+			myPool{pool} {
 
 			// perform detection
 			DetectVertices();
@@ -601,7 +883,7 @@ namespace {
 
 		TopoDS_Shape myArgument;
 		Standard_Real myTolerance;
-		shape_merger merger;
+		thread_pool &myPool;
 
 		TopTools_DataMapOfShapeListOfShape myImages;
 		TopTools_DataMapOfShapeShape myOrigins;
@@ -618,8 +900,8 @@ namespace {
 			throw std::runtime_error("no vertices in source shape");
 		}
 
-		VertexTree bounding_tree;
-		fill_tree_with_verticies(bounding_tree, verticies, myTolerance);
+		const VertexGrid grid{verticies, myTolerance};
+		std::vector<Standard_Integer> nearby;
 
 		//
 		//---------------------------------------------------
@@ -645,10 +927,9 @@ namespace {
 							continue;
 						}
 
-						VertexSelector nearby{vertex, myTolerance};
-						bounding_tree.Select(nearby);
+						grid.Select(vertex, nearby);
 
-						for (auto idx : nearby.Indices()) {
+						for (auto idx : nearby) {
 							if (!processing.Contains(idx)) {
 								remaining.Add(idx);
 							}
@@ -727,10 +1008,19 @@ namespace {
 		//
 		TopExp::MapShapes(myArgument, type, aMF);
 		//
-		for (decltype(aMF)::Iterator it{aMF}; it.More(); it.Next()) {
-			const TopoDS_Shape& shape = it.Value();
+		// keys only read myOrigins, so can be made in parallel and then
+		// grouped in order
+		std::vector<std::optional<MultiShapeKey>> keys((size_t)aMF.Extent());
+		parallel_ranges(myPool, keys.size(), [this, &aMF, &keys](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				keys[i] = ShapePassKey(aMF((Standard_Integer)i + 1));
+			}
+		});
+		//
+		for (size_t i = 0; i < keys.size(); i++) {
+			const TopoDS_Shape& shape = aMF((Standard_Integer)i + 1);
 
-			MultiShapeKey aPKF = ShapePassKey(shape);
+			const MultiShapeKey &aPKF = *keys[i];
 			//
 			if (coincident_shapes.Contains(aPKF)) {
 				TopTools_ListOfShape& aLSDF = coincident_shapes.ChangeFromKey(aPKF);
@@ -744,7 +1034,7 @@ namespace {
 		LOG(TRACE) << "before RefineCoincidentShapes!\n";
 		// check geometric coincidence, note this ~50% of total execution time for
 		// me
-		merger.RefineCoincidentShapes(coincident_shapes);
+		RefineCoincidentShapes(coincident_shapes, myTolerance, myPool);
 		LOG(TRACE) << "after RefineCoincidentShapes!\n";
 		//
 		// Images/Origins
@@ -778,9 +1068,10 @@ namespace {
 
 	class geomgluer2 {
 	public:
-		geomgluer2(const TopoDS_Shape& theShape) :
+		geomgluer2(const TopoDS_Shape& theShape, thread_pool &pool) :
 			myArgument{theShape},
-			myContext{new IntTools_Context{}} {
+			myContext{new IntTools_Context{}},
+			myPool{pool} {
 		}
 
 		TopoDS_Shape Perform(Standard_Real tolerance);
@@ -804,6 +1095,7 @@ namespace {
 	protected:
 		const TopoDS_Shape myArgument;
 		const Handle(IntTools_Context) myContext;
+		thread_pool &myPool;
 
 		TopTools_DataMapOfShapeListOfShape myImagesToWork;
 		TopTools_DataMapOfShapeShape myOriginsToWork;
@@ -844,7 +1136,7 @@ namespace {
 	TopoDS_Shape
 	geomgluer2::Perform(Standard_Real tolerance)
 	{
-		gluedetector detector{myArgument, tolerance, *myContext};
+		gluedetector detector{myArgument, tolerance, myPool};
 
 		myImagesToWork = detector.Images();
 		myOriginsToWork.Clear();
@@ -1156,13 +1448,111 @@ namespace {
 }
 
 TopoDS_Shape
-salome_glue_shape(const TopoDS_Shape &shape, Standard_Real tolerance)
+salome_glue_shape(const TopoDS_Shape &shape, Standard_Real tolerance, thread_pool &pool)
 {
 	try {
-		geomgluer2 gluer(shape);
+		geomgluer2 gluer(shape, pool);
 		return gluer.Perform(tolerance);
 	} catch (std::exception &err) {
 		LOG(FATAL) << "failed to glue shapes: " << err.what() << '\n';
 		std::exit(1);
 	}
 }
+
+
+#ifdef INCLUDE_TESTS
+static TopTools_IndexedMapOfShape
+random_verticies(size_t num, Standard_Real extent, unsigned seed)
+{
+	std::mt19937 rng{seed};
+	std::uniform_real_distribution<Standard_Real> coord{0, extent}, tolerance{1e-7, 1e-3};
+
+	BRep_Builder builder;
+	TopTools_IndexedMapOfShape result;
+	for (size_t i = 0; i < num; i++) {
+		TopoDS_Vertex vertex = BRepBuilderAPI_MakeVertex(gp_Pnt{coord(rng), coord(rng), coord(rng)});
+		// a few much looser verticies, like after fixing shapes
+		builder.UpdateVertex(vertex, i % 50 == 0 ? 0.5 : tolerance(rng));
+		result.Add(vertex);
+	}
+	// and some exactly coincident ones
+	for (size_t i = 0; i < num / 10; i++) {
+		const TopoDS_Vertex &vertex = TopoDS::Vertex(result(int(i * 7 % num) + 1));
+		result.Add(BRepBuilderAPI_MakeVertex(BRep_Tool::Pnt(vertex)).Vertex());
+	}
+	return result;
+}
+
+static std::vector<Standard_Integer>
+select_with_tree(const VertexTree &tree, const TopoDS_Vertex &vertex, Standard_Real tolerance)
+{
+	VertexSelector selector{vertex, tolerance};
+	tree.Select(selector);
+	std::vector<Standard_Integer> result;
+	for (const auto idx : selector.Indices()) {
+		result.push_back(idx);
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+TEST_CASE("VertexGrid matches NCollection_UBTree") {
+	SECTION("random verticies") {
+		for (const Standard_Real tolerance : {0., 1e-3, 0.1}) {
+			const auto verticies = random_verticies(2000, 10, 42);
+
+			VertexTree tree;
+			fill_tree_with_verticies(tree, verticies, tolerance);
+			const VertexGrid grid{verticies, tolerance};
+
+			std::vector<Standard_Integer> found;
+			size_t num_mismatched = 0, num_found = 0;
+			for (int i = 1; i <= verticies.Extent(); i++) {
+				const auto &vertex = TopoDS::Vertex(verticies(i));
+				grid.Select(vertex, found);
+				if (found != select_with_tree(tree, vertex, tolerance)) {
+					num_mismatched += 1;
+				}
+				num_found += found.size();
+			}
+			CHECK(num_mismatched == 0);
+			// every vertex finds itself
+			CHECK(num_found > (size_t)verticies.Extent());
+		}
+	}
+
+	SECTION("empty") {
+		const VertexGrid grid{TopTools_IndexedMapOfShape{}, 0.1};
+		std::vector<Standard_Integer> found{1, 2};
+		grid.Select(BRepBuilderAPI_MakeVertex(gp_Pnt{0, 0, 0}), found);
+		CHECK(found.empty());
+	}
+}
+
+TEST_CASE("vertex search benchmark", "[.][benchmark]") {
+	const Standard_Real tolerance = 1e-3;
+	const auto verticies = random_verticies(100000, 1000, 1);
+
+	BENCHMARK("NCollection_UBTree") {
+		VertexTree tree;
+		fill_tree_with_verticies(tree, verticies, tolerance);
+		size_t num_found = 0;
+		for (int i = 1; i <= verticies.Extent(); i++) {
+			VertexSelector selector{TopoDS::Vertex(verticies(i)), tolerance};
+			num_found += (size_t)tree.Select(selector);
+		}
+		return num_found;
+	};
+
+	BENCHMARK("VertexGrid") {
+		const VertexGrid grid{verticies, tolerance};
+		std::vector<Standard_Integer> found;
+		size_t num_found = 0;
+		for (int i = 1; i <= verticies.Extent(); i++) {
+			grid.Select(TopoDS::Vertex(verticies(i)), found);
+			num_found += found.size();
+		}
+		return num_found;
+	};
+}
+#endif
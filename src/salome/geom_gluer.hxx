@@ -1,4 +1,8 @@
 #include <TopoDS_Shape.hxx>
 
+class thread_pool;
+
+// detecting coincident edges and faces is spread over the pool, the result
+// doesn't depend on the number of workers
 TopoDS_Shape
-salome_glue_shape(const TopoDS_Shape &shape, Standard_Real tolerance);
+salome_glue_shape(const TopoDS_Shape &shape, Standard_Real tolerance, thread_pool &pool);
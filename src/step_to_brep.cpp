@@ -1,9 +1,12 @@
 #include <array>
 #include <cstdlib>
 #include <cassert>
+#include <deque>
+#include <exception>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <STEPCAFControl_Reader.hxx>
 #include <XCAFApp_Application.hxx>
@@ -36,7 +39,9 @@
 #include <aixlog.hpp>
 
 #include "geometry.hpp"
+#include "properties_file.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
 
 static void
 assign_cstring(std::string &dst, const TCollection_ExtendedString &src) {
@@ -128,11 +133,34 @@ get_material_info(const TDF_Label &label, std::string &name, double &density)
 
 class collector {
 	document doc;
+	// of each solid in doc, or negative once fixing has changed it
+	std::vector<double> volumes;
 
 	double minimum_volume;
 
 	int label_num, n_small, n_negative_volume;
 
+	thread_pool &pool;
+
+	// solids found while walking the labels, their volumes are computed in
+	// parallel while the walk carries on
+	struct pending_solid {
+		int label_num;
+		std::string label_name, color, material_name;
+		double material_density;
+		TopoDS_Shape shape;
+
+		double volume = 0;
+		// rethrown in order, so failures are reported as if serial
+		std::exception_ptr error;
+	};
+
+	// a deque so tasks can hold on to their solid as more are added
+	std::deque<pending_solid> pending;
+
+	// after pending, so it's waited for before they're destroyed
+	parfor volume_work;
+
 	void add_solids(const TDF_Label &label) {
 		std::string color;
 		std::string label_name{"unnammed"};
@@ -151,44 +179,26 @@ class collector {
 
 		// add the solids to our list of things to do
 		for (TopExp_Explorer ex{doc_shape, TopAbs_SOLID}; ex.More(); ex.Next()) {
-			LOG(TRACE) << "calculating volume of shape\n";
-			const TopoDS_Shape &shape = ex.Current();
-			const auto volume = volume_of_shape(shape);
-			LOG(TRACE) << "done calculating volume of shape\n";
-			if (volume < minimum_volume) {
-				if (volume < 0) {
-					n_negative_volume += 1;
-					LOG(INFO)
-						<< "ignoring part of shape '" << label_name << "' "
-						<< "due to negative volume, " << volume << '\n';
-				} else {
-					n_small += 1;
-					LOG(INFO)
-						<< "ignoring part of shape '" << label_name << "' "
-						<< "because it's too small, " << volume
-						<< " < " << minimum_volume << '\n';
+			pending.push_back({
+				label_num, label_name, color, material_name, material_density,
+				ex.Current()});
+
+			auto &solid = pending.back();
+			volume_work.submit(pool, [&solid]() {
+				try {
+					solid.volume = volume_of_shape(solid.shape);
+				} catch (...) {
+					solid.error = std::current_exception();
 				}
-				continue;
-			}
-
-			doc.solid_shapes.emplace_back(shape);
-
-			const auto ss = std::cout.precision(1);
-			std::cout
-				<< label_num << ','
-				<< label_name << ','
-				<< std::fixed << volume << ','
-				<< color << ','
-				<< material_name << ','
-				<< material_density << '\n';
-			std::cout.precision(ss);
+			});
 		}
 	}
 
 public:
-	collector(double minimum_volume) :
+	collector(double minimum_volume, thread_pool &pool) :
 		minimum_volume{minimum_volume},
-		label_num{0}, n_small{0}, n_negative_volume{0} {
+		label_num{0}, n_small{0}, n_negative_volume{0},
+		pool{pool} {
 	}
 
 	void add_label(XCAFDoc_ShapeTool &shapetool, const TDF_Label &label) {
@@ -208,6 +218,50 @@ public:
 		}
 	}
 
+	// filters out small solids and writes CSV rows, in the same order as
+	// they were found
+	void add_pending_solids() {
+		volume_work.wait();
+
+		for (const auto &solid : pending) {
+			if (solid.error) {
+				std::rethrow_exception(solid.error);
+			}
+
+			const auto volume = solid.volume;
+			if (volume < minimum_volume) {
+				if (volume < 0) {
+					n_negative_volume += 1;
+					LOG(INFO)
+						<< "ignoring part of shape '" << solid.label_name << "' "
+						<< "due to negative volume, " << volume << '\n';
+				} else {
+					n_small += 1;
+					LOG(INFO)
+						<< "ignoring part of shape '" << solid.label_name << "' "
+						<< "because it's too small, " << volume
+						<< " < " << minimum_volume << '\n';
+				}
+				continue;
+			}
+
+			doc.solid_shapes.emplace_back(solid.shape);
+			volumes.push_back(volume);
+
+			const auto ss = std::cout.precision(1);
+			std::cout
+				<< solid.label_num << ','
+				<< solid.label_name << ','
+				<< std::fixed << volume << ','
+				<< solid.color << ','
+				<< solid.material_name << ','
+				<< solid.material_density << '\n';
+			std::cout.precision(ss);
+		}
+
+		pending.clear();
+	}
+
 	void log_summary() {
 		LOG(INFO)
 			<< "enumerated " << label_num << " labels, "
@@ -222,15 +276,33 @@ public:
 		}
 	}
 
-	void fix_shapes(double precision, double max_tolerance) {
-		for (auto &shape : doc.solid_shapes) {
+	// shapes sharing verticies could be modified through each other, so
+	// each group is processed serially in index order
+	template<typename F>
+	void for_each_shape(thread_pool &pool, F fn) {
+		const auto groups = groups_sharing_verticies(doc.solid_shapes);
+		parfor work;
+		for (const auto &group : groups) {
+			work.submit(pool, [&fn, &group]() {
+				for (const auto i : group) {
+					fn(i);
+				}
+			});
+		}
+	}
+
+	void fix_shapes(thread_pool &pool, double precision, double max_tolerance) {
+		std::vector<std::string> messages(doc.solid_shapes.size());
+
+		for_each_shape(pool, [this, &messages, precision, max_tolerance](size_t i) {
+			auto &shape = doc.solid_shapes[i];
 			ShapeFix_Shape fixer{shape};
 			fixer.SetPrecision(precision);
 			fixer.SetMaxTolerance(max_tolerance);
 			auto fixed = fixer.Perform();
 			if (fixed) {
-				auto &log = LOG(INFO)
-					<< "shapefixer=" << fixed;
+				std::ostringstream log;
+				log << "shapefixer=" << fixed;
 				if (fixer.Status(ShapeExtend_DONE1)) log << ", some free edges were fixed";
 				if (fixer.Status(ShapeExtend_DONE2)) log << ", some free wires were fixed";
 				if (fixer.Status(ShapeExtend_DONE3)) log << ", some free faces were fixed";
@@ -238,15 +310,25 @@ public:
 				if (fixer.Status(ShapeExtend_DONE5)) log << ", some free solids were fixed";
 				if (fixer.Status(ShapeExtend_DONE6)) log << ", shapes in compound(s) were fixed";
 				log << '\n';
+				messages[i] = log.str();
 
 				shape = fixer.Shape();
+				volumes[i] = -1;
+			}
+		});
+
+		for (const auto &msg : messages) {
+			if (!msg.empty()) {
+				LOG(INFO) << msg;
 			}
 		}
 	}
 
-	void fix_wireframes(double precision, double max_tolerance) {
-		int nshape = 0;
-		for (auto &shape : doc.solid_shapes) {
+	void fix_wireframes(thread_pool &pool, double precision, double max_tolerance) {
+		std::vector<std::string> messages(doc.solid_shapes.size());
+
+		for_each_shape(pool, [this, &messages, precision, max_tolerance](size_t i) {
+			auto &shape = doc.solid_shapes[i];
 			ShapeFix_Wireframe fixer{shape};
 			fixer.SetPrecision(precision);
 			fixer.SetMaxTolerance(max_tolerance);
@@ -255,11 +337,10 @@ public:
 			auto gap_res = fixer.FixWireGaps();
 
 			if (!(small_res || gap_res)) {
-				continue;
+				return;
 			}
 
-			auto &log = LOG(INFO)
-				<< "Fixing shape " << nshape++;
+			std::ostringstream log;
 
 			if (small_res) {
 				if (fixer.StatusSmallEdges(ShapeExtend_OK)) log << ", no small edges were found";
@@ -276,13 +357,23 @@ public:
 			}
 
 			log << '\n';
+			messages[i] = log.str();
 
 			shape = fixer.Shape();
+			volumes[i] = -1;
+		});
+
+		// numbered as they're logged, as before
+		int nshape = 0;
+		for (const auto &msg : messages) {
+			if (!msg.empty()) {
+				LOG(INFO) << "Fixing shape " << nshape++ << msg;
+			}
 		}
 	}
 
-	bool check_geometry() {
-		auto ninvalid = doc.count_invalid_shapes();
+	bool check_geometry(thread_pool &pool) {
+		auto ninvalid = doc.count_invalid_shapes(pool);
 		if (ninvalid) {
 			LOG(FATAL) << ninvalid << " shapes were not valid\n";
 			return false;
@@ -291,8 +382,13 @@ public:
 		return true;
 	}
 
-	void write_brep_file(const char *path) {
+	// properties are computed after fixing, as that can change the shapes,
+	// but volumes of solids it didn't change are reused
+	void write_brep_file(thread_pool &pool, const char *path) {
 		doc.write_brep_file(path);
+
+		LOG(DEBUG) << "writing solid properties\n";
+		write_properties_file(path, compute_properties(doc, volumes, pool));
 	}
 };
 
@@ -314,6 +410,11 @@ load_step_file(const char* path, collector &col) {
 
 	LOG(DEBUG) << "transferring into doc\n";
 
+	// this is usually most of the time taken, but can't be overlapped with
+	// anything that uses the solids. names, colours and materials are only
+	// attached to labels once every root has been transferred, and the
+	// reader's model and OCCT's static parameters can't be shared between
+	// threads transferring roots separately
 	Handle(TDocStd_Document) doc;
 	app->NewDocument("MDTV-XCAF", doc);
 	if (!reader.Transfer(doc)) {
@@ -342,8 +443,11 @@ main(int argc, char **argv)
 {
 	configure_aixlog();
 
+	profile_writer profile;
+
 	std::string path_in, path_out;
 	double minimum_volume = 1;
+	unsigned num_parallel_jobs = 1;
 	bool check_geometry{true}, fix_geometry{false};
 
 	{
@@ -364,6 +468,8 @@ main(int argc, char **argv)
 		auto fix_geometry_help = stream.str();
 
 		tool_argp_parser argp(2);
+		argp.add_jobs_option(num_parallel_jobs);
+		argp.add_profile_options(profile);
 		argp.add_option(
 			{"min-volume", 1023, "volume", 0, min_volume_help.c_str(), 0},
 			minimum_volume);
@@ -397,28 +503,34 @@ main(int argc, char **argv)
 		return 1;
 	}
 
-	collector doc(minimum_volume);
+	LOG(DEBUG) << "launching " << num_parallel_jobs << " worker threads\n";
+	thread_pool pool(num_parallel_jobs);
+
+	collector doc(minimum_volume, pool);
 	if (!load_step_file(path_in.c_str(), doc)) {
 		return 1;
 	}
 
+	LOG(DEBUG) << "waiting for volumes\n";
+	doc.add_pending_solids();
+
 	doc.log_summary();
 
 	if (fix_geometry) {
 		LOG(DEBUG) << "fixing wireframes\n";
-		doc.fix_wireframes(0.01, 0.00001);
+		doc.fix_wireframes(pool, 0.01, 0.00001);
 		LOG(DEBUG) << "fixing shapes\n";
-		doc.fix_shapes(0.01, 0.00001);
+		doc.fix_shapes(pool, 0.01, 0.00001);
 	}
 
 	if (check_geometry) {
 		LOG(DEBUG) << "checking geometry\n";
-		if (!doc.check_geometry()) {
+		if (!doc.check_geometry(pool)) {
 			return 1;
 		}
 	}
 
-	doc.write_brep_file(path_out.c_str());
+	doc.write_brep_file(pool, path_out.c_str());
 
 	LOG(DEBUG) << "done\n";
 
@@ -1,57 +1,162 @@
-#include "thread_pool.hpp"
+#include <algorithm>
 
 #ifdef INCLUDE_TESTS
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
 #endif
 
-thread_pool::thread_pool(size_t num_workers) : running(true)
+#include "profiling.hpp"
+#include "thread_pool.hpp"
+
+// lets tasks submitted from a worker go onto its own queue
+static thread_local const thread_pool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+thread_pool::thread_pool(size_t num_workers) :
+	num_queued{0}, num_sleeping{0}, next_queue{0}, running(true)
 {
+	// always have a queue so submit() has somewhere to put things
+	for (size_t i = 0; i < std::max(num_workers, size_t{1}); i++) {
+		queues.emplace_back(new worker_queue);
+	}
 	for (size_t i = 0; i < num_workers; i++) {
-		workers.emplace_back(&thread_pool::worker, this);
+		workers.emplace_back(&thread_pool::worker, this, i);
 	}
 }
 
 thread_pool::~thread_pool()
 {
-	running = false;
+	{
+		std::unique_lock<std::mutex> mlock(sleep_mutex);
+		running = false;
+	}
+	sleep_cond.notify_all();
 
 	for (auto &worker : workers) {
-		// I think I might be able to get away with doing this once! but
-		// given the costs it doesn't seem worth it
-		cond.notify_all();
-
 		worker.join();
 	}
 }
 
-void thread_pool::worker()
+bool thread_pool::try_pop(size_t index, task &out)
 {
-	std::unique_lock<std::mutex> mlock(mutex);
+	// start with our own queue, then try stealing from the others
+	for (size_t i = 0; i < queues.size(); i++) {
+		auto &queue = *queues[(index + i) % queues.size()];
 
-	while(running) {
-		if (queue.empty()) {
-			cond.wait(mlock);
+		std::unique_lock<std::mutex> mlock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			out = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			num_queued -= 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void thread_pool::worker(size_t index)
+{
+	current_pool = this;
+	current_index = index;
+
+	while (true) {
+		task fn;
+		if (try_pop(index, fn)) {
+			profile_scope scope{"thread_pool task"};
+			fn();
 			continue;
 		}
 
-		auto task = queue.front();
-		queue.pop_front();
-		mlock.unlock();
-		task();
-		mlock.lock();
+		profile_scope idle{"thread_pool idle"};
+		std::unique_lock<std::mutex> mlock(sleep_mutex);
+		// submit() checks this after queueing, so either it sees we're
+		// sleeping and notifies us, or we see its task here
+		num_sleeping += 1;
+		while (running && num_queued == 0) {
+			sleep_cond.wait(mlock);
+		}
+		num_sleeping -= 1;
+
+		// finish anything that's still queued before exiting
+		if (!running && num_queued == 0) {
+			break;
+		}
 	}
 }
 
-void thread_pool::submit(std::function<void(void)> task)
+void thread_pool::submit(task fn)
 {
-	std::unique_lock<std::mutex> mlock(mutex);
+	const size_t index = current_pool == this ?
+		current_index : next_queue++ % queues.size();
+	push(index, std::move(fn));
+}
 
-	queue.emplace_back(task);
-	cond.notify_one();
+void thread_pool::submit_to(size_t worker, task fn)
+{
+	push(worker % queues.size(), std::move(fn));
+}
+
+void thread_pool::push(size_t index, task fn)
+{
+	size_t depth;
+	{
+		auto &queue = *queues[index];
+		std::unique_lock<std::mutex> mlock(queue.mutex);
+		queue.tasks.emplace_back(std::move(fn));
+		// counted under the lock, otherwise a worker could pop the task and
+		// decrement first, wrapping num_queued around
+		depth = ++num_queued;
+	}
+	profile_counter("thread_pool queued", double(depth));
+
+	// avoid touching the shared lock when everyone is busy
+	if (num_sleeping > 0) {
+		std::unique_lock<std::mutex> mlock(sleep_mutex);
+		sleep_cond.notify_one();
+	}
 }
 
 
 #ifdef INCLUDE_TESTS
+TEST_CASE("cooperative_for") {
+	SECTION("every index runs once") {
+		thread_pool pool(3);
+		std::vector<std::atomic<int>> counts(100);
+		cooperative_for(pool, counts.size(), [&counts](size_t i) {
+			counts[i] += 1;
+		});
+		for (const auto &count : counts) {
+			CHECK(count == 1);
+		}
+	}
+
+	SECTION("nesting inside tasks doesn't deadlock") {
+		// every worker blocks in the outer loop, so the inner loops can only
+		// finish if their callers do the work
+		thread_pool pool(2);
+		std::atomic<int> total{0};
+		parfor work;
+		for (int i = 0; i < 4; i++) {
+			work.submit(pool, [&pool, &total]() {
+				cooperative_for(pool, 10, [&total](size_t) {
+					total += 1;
+				});
+			});
+		}
+		work.wait();
+		CHECK(total == 40);
+	}
+
+	SECTION("no workers") {
+		thread_pool pool(0);
+		int total = 0;
+		cooperative_for(pool, 5, [&total](size_t i) {
+			total += int(i);
+		});
+		CHECK(total == 10);
+	}
+}
+
 TEST_CASE("thread_pool") {
 	thread_pool pool(1);
 
@@ -72,7 +177,7 @@ TEST_CASE("thread_pool") {
 		asyncmap<int> map;
 		constexpr int N = 5;
 		// run a few jobs asynchronously
-		for (size_t i = 0; i < N; i++) {
+		for (int i = 0; i < N; i++) {
 			map.submit(pool, [i]() {
 				return i;
 			});
@@ -87,5 +192,109 @@ TEST_CASE("thread_pool") {
 			CHECK(d == 1);
 		}
 	};
+
+	SECTION("move-only tasks and results") {
+		asyncmap<std::unique_ptr<int>> map;
+		auto value = std::make_unique<int>(42);
+		map.submit(pool, [value = std::move(value)]() mutable {
+			return std::move(value);
+		});
+		auto result = map.get();
+		REQUIRE(result);
+		CHECK(*result == 42);
+	};
+}
+
+TEST_CASE("thread_pool work stealing") {
+	thread_pool pool(4);
+	CHECK(pool.num_workers() == 4);
+
+	SECTION("all tasks run") {
+		constexpr int N = 10000;
+		std::atomic<int> count{0};
+		// a task popped before it was counted would wrap the count around
+		std::atomic<bool> wrapped{false};
+		{
+			parfor work;
+			for (int i = 0; i < N; i++) {
+				work.submit(pool, [&pool, &count, &wrapped]() {
+					count += 1;
+					if (pool.num_pending() > size_t(N)) {
+						wrapped = true;
+					}
+				});
+			}
+		}
+		CHECK(count == N);
+		CHECK_FALSE(wrapped);
+		CHECK(pool.num_pending() == 0);
+	};
+
+	SECTION("tasks submitted from tasks") {
+		constexpr int N = 100;
+		std::atomic<int> count{0};
+		{
+			parfor outer, inner;
+			for (int i = 0; i < N; i++) {
+				outer.submit(pool, [&pool, &inner, &count]() {
+					inner.submit(pool, [&count]() {
+						count += 1;
+					});
+				});
+			}
+			outer.wait();
+			inner.wait();
+		}
+		CHECK(count == N);
+	};
+
+	SECTION("tasks submitted to a worker") {
+		// any index is fine, and idle workers can still steal them
+		asyncmap<int> map;
+		constexpr int N = 100;
+		for (int i = 0; i < N; i++) {
+			map.submit_to(pool, size_t(i) * 7, [i]() {
+				return i;
+			});
+		}
+		int sum = 0;
+		while (!map.empty()) {
+			sum += map.get();
+		}
+		CHECK(sum == N * (N - 1) / 2);
+		CHECK(pool.num_pending() == 0);
+	};
+}
+
+TEST_CASE("thread_pool benchmark", "[.][benchmark]") {
+	// lots of tiny tasks, like computing bounding boxes of every solid
+	constexpr int N = 20000;
+	thread_pool pool(std::max(2u, std::thread::hardware_concurrency()));
+
+	BENCHMARK("parfor of tiny tasks") {
+		std::atomic<int> count{0};
+		parfor work;
+		for (int i = 0; i < N; i++) {
+			work.submit(pool, [&count]() {
+				count += 1;
+			});
+		}
+		work.wait();
+		return count.load();
+	};
+
+	BENCHMARK("asyncmap of tiny tasks") {
+		asyncmap<int> map;
+		for (int i = 0; i < N; i++) {
+			map.submit(pool, [i]() {
+				return i;
+			});
+		}
+		long sum = 0;
+		while (!map.empty()) {
+			sum += map.get();
+		}
+		return sum;
+	};
 }
 #endif
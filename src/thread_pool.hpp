@@ -1,34 +1,116 @@
+#pragma once
+
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <functional>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "profiling.hpp"
+
+
+/* type-erased callable like std::function, but move-only so the callable
+ * never gets copied and can capture move-only values
+ */
+class task {
+	struct base {
+		virtual ~base() = default;
+		virtual void run() = 0;
+	};
+
+	template<typename F>
+	struct impl : base {
+		F fn;
+		explicit impl(F &&f) : fn{std::move(f)} {}
+		void run() override { fn(); }
+	};
+
+	std::unique_ptr<base> ptr;
+
+public:
+	task() = default;
+
+	template<typename F, typename = std::enable_if_t<
+		!std::is_same<std::decay_t<F>, task>::value>>
+	task(F &&fn) : ptr{new impl<std::decay_t<F>>{std::decay_t<F>{std::forward<F>(fn)}}} {}
+
+	task(task &&) = default;
+	task& operator=(task &&) = default;
+
+	void operator()() {
+		ptr->run();
+	}
+
+	explicit operator bool() const {
+		return bool(ptr);
+	}
+};
 
 /* simple thread pool, threads are created in the constructor and joined in
  * the destructor. you can submit() lambdas and they'll be executed
  * asynchronously.
  *
+ * each worker has its own queue so submitting lots of small tasks doesn't
+ * contend on a single lock. tasks are spread over these round-robin, or
+ * pushed onto the current worker's queue when submitted from within a task,
+ * and idle workers steal from the others. tasks are started roughly in the
+ * order they're submitted.
+ *
  * note that this class isn't very user friendly, you probably want to use one
  * of the helpers below to make sure these tasks get executed by some
  * deterministic point
  */
 class thread_pool {
+	struct worker_queue {
+		std::mutex mutex;
+		std::deque<task> tasks;
+	};
+
+	std::vector<std::unique_ptr<worker_queue>> queues;
 	std::vector<std::thread> workers;
 
-	std::mutex mutex;
-	std::condition_variable cond;
-	std::deque<std::function<void(void)>> queue;
+	// tasks in all queues, so workers know when to sleep
+	std::atomic<size_t> num_queued;
+	std::atomic<size_t> num_sleeping;
+	std::atomic<size_t> next_queue;
+
+	// only used for sleeping when there's nothing to do, running is
+	// protected by this
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_cond;
 	bool running;
 
-	void worker();
+	bool try_pop(size_t index, task &out);
+	void push(size_t index, task fn);
+	void worker(size_t index);
 
 public:
 	thread_pool(size_t num_workers);
 	virtual ~thread_pool();
 
-	void submit(std::function<void(void)> task);
+	thread_pool(const thread_pool &) = delete;
+	thread_pool& operator=(const thread_pool &) = delete;
+
+	void submit(task fn);
+
+	// queues onto a particular worker, modulo the number of workers, e.g. so
+	// related tasks can share thread-local caches. idle workers still steal
+	// it when that worker is busy
+	void submit_to(size_t worker, task fn);
+
+	size_t num_workers() const {
+		return workers.size();
+	}
+
+	// tasks submitted but not yet started
+	size_t num_pending() const {
+		return num_queued.load();
+	}
 };
 
 /* modelled after a "parallel for loop", you submit() jobs in a for loop,
@@ -49,26 +131,77 @@ public:
 	}
 
 	void wait() {
+		profile_scope scope{"parfor wait"};
 		std::unique_lock<std::mutex> mlock(mutex);
 		while(num_inflight > 0) {
 			cond.wait(mlock);
 		}
 	}
 
-	void submit(thread_pool &pool, std::function<void(void)> fn) {
-		pool.submit([this, fn]() {
+	template<typename F>
+	void submit(thread_pool &pool, F &&fn) {
+		{
+			std::unique_lock<std::mutex> mlock(mutex);
+			num_inflight += 1;
+		}
+
+		pool.submit([this, fn = std::forward<F>(fn)]() mutable {
 			fn();
 
 			std::unique_lock<std::mutex> mlock(mutex);
 			num_inflight -= 1;
-			cond.notify_all();
+			if (num_inflight == 0) {
+				cond.notify_all();
+			}
 		});
-
-		std::unique_lock<std::mutex> mlock(mutex);
-		num_inflight += 1;
 	}
 };
 
+/* runs fn(i) for each i in [0, n), spread over the pool with the calling
+ * thread taking part. unlike parfor this is safe to call from within a task:
+ * the caller runs whatever hasn't been started, so only ever waits for items
+ * other threads are already running. helpers that start after everything's
+ * been taken return without calling fn
+ */
+template<typename F>
+void
+cooperative_for(thread_pool &pool, size_t n, F &&fn)
+{
+	struct shared {
+		std::atomic<size_t> next{0};
+		size_t n, num_done = 0;
+		std::function<void(size_t)> fn;
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+
+	auto state = std::make_shared<shared>();
+	state->n = n;
+	state->fn = std::forward<F>(fn);
+
+	auto work = [state]() {
+		for (size_t i; (i = state->next++) < state->n; ) {
+			state->fn(i);
+
+			std::unique_lock<std::mutex> mlock(state->mutex);
+			state->num_done += 1;
+			if (state->num_done == state->n) {
+				state->cond.notify_all();
+			}
+		}
+	};
+
+	for (size_t i = 1; i < std::min(n, pool.num_workers() + 1); i++) {
+		pool.submit(work);
+	}
+	work();
+
+	std::unique_lock<std::mutex> mlock(state->mutex);
+	while (state->num_done < state->n) {
+		state->cond.wait(mlock);
+	}
+}
+
 /* modelled after map_async from Python's multiprocessing library. you
  * submit() jobs and these are executed by the pool, and this code allows you
  * to get results from each job as soon as it completes.
@@ -101,23 +234,39 @@ public:
 		}
 	}
 
-	void submit(thread_pool &pool, std::function<T(void)> fn) {
-		pool.submit([this, fn]() {
-			auto result = fn();
+	template<typename F>
+	void submit(thread_pool &pool, F &&fn) {
+		pool.submit(wrap(std::forward<F>(fn)));
+	}
+
+	// see thread_pool::submit_to
+	template<typename F>
+	void submit_to(thread_pool &pool, size_t worker, F &&fn) {
+		pool.submit_to(worker, wrap(std::forward<F>(fn)));
+	}
+
+private:
+	template<typename F>
+	task wrap(F &&fn) {
+		{
+			std::unique_lock<std::mutex> mlock(mutex);
+			num_inflight += 1;
+		}
+
+		return [this, fn = std::forward<F>(fn)]() mutable {
+			T result = fn();
 
 			std::unique_lock<std::mutex> mlock(mutex);
 			num_inflight -= 1;
-			results.emplace_back(result);
+			results.emplace_back(std::move(result));
 			cond_res.notify_one();
 			if (num_inflight == 0) {
 				cond_done.notify_all();
 			}
-		});
-
-		std::unique_lock<std::mutex> mlock(mutex);
-		num_inflight += 1;
+		};
 	}
 
+public:
 	bool empty() {
 		std::unique_lock<std::mutex> mlock(mutex);
 		return results.empty() && num_inflight == 0;
@@ -125,10 +274,14 @@ public:
 
 	T get() {
 		std::unique_lock<std::mutex> mlock(mutex);
-		while (results.empty()) {
-			cond_res.wait(mlock);
+		if (results.empty()) {
+			// time the caller spends waiting on workers
+			profile_scope scope{"asyncmap wait"};
+			while (results.empty()) {
+				cond_res.wait(mlock);
+			}
 		}
-		auto result = results.front();
+		T result = std::move(results.front());
 		results.pop_front();
 		return result;
 	}
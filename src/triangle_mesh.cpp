@@ -0,0 +1,671 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+#ifdef INCLUDE_TESTS
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/catch_approx.hpp>
+#endif
+
+#include <BRepBndLib.hxx>
+#include <BRepBuilderAPI_Copy.hxx>
+#include <BRepMesh_IncrementalMesh.hxx>
+#include <BRep_Tool.hxx>
+#include <Bnd_Box.hxx>
+#include <Poly_Triangulation.hxx>
+#include <Standard_Version.hxx>
+#include <TopExp_Explorer.hxx>
+#include <TopLoc_Location.hxx>
+#include <TopoDS.hxx>
+#include <TopoDS_Face.hxx>
+
+#include "profiling.hpp"
+#include "triangle_mesh.hpp"
+
+
+void
+triangle_mesh::add_triangle(const double p0[3], const double p1[3], const double p2[3])
+{
+	if (size() == 0) {
+		for (int k = 0; k < 3; k++) {
+			lower[k] = upper[k] = p0[k];
+		}
+	}
+	for (const double *p : {p0, p1, p2}) {
+		for (int k = 0; k < 3; k++) {
+			lower[k] = std::min(lower[k], p[k]);
+			upper[k] = std::max(upper[k], p[k]);
+		}
+	}
+
+	x0.push_back(p0[0]); y0.push_back(p0[1]); z0.push_back(p0[2]);
+	x1.push_back(p1[0]); y1.push_back(p1[1]); z1.push_back(p1[2]);
+	x2.push_back(p2[0]); y2.push_back(p2[1]); z2.push_back(p2[2]);
+}
+
+double
+triangle_mesh::volume() const
+{
+	// sum of signed tetrahedra from the origin to each triangle
+	double sum = 0;
+	for (size_t i = 0; i < size(); i++) {
+		sum +=
+			x0[i] * (y1[i] * z2[i] - z1[i] * y2[i]) +
+			y0[i] * (z1[i] * x2[i] - x1[i] * z2[i]) +
+			z0[i] * (x1[i] * y2[i] - y1[i] * x2[i]);
+	}
+	return sum / 6;
+}
+
+triangle_mesh
+mesh_of_solid(const TopoDS_Shape &solid, double relative_deflection)
+{
+	profile_scope scope{"mesh"};
+	triangle_mesh mesh;
+
+	Bnd_Box box;
+	BRepBndLib::Add(solid, box, false);
+	if (box.IsVoid()) {
+		return mesh;
+	}
+	const double deflection = relative_deflection * std::sqrt(box.SquareExtent());
+
+	// meshing stores the triangulation in the faces, which might be in use
+	// by other threads
+	BRepBuilderAPI_Copy copier(solid, Standard_True, Standard_False);
+	const TopoDS_Shape copy = copier.Shape();
+
+	BRepMesh_IncrementalMesh mesher(copy, deflection, Standard_False, 0.5, Standard_False);
+	if (!mesher.IsDone()) {
+		return mesh;
+	}
+
+	for (TopExp_Explorer ex{copy, TopAbs_FACE}; ex.More(); ex.Next()) {
+		const TopoDS_Face &face = TopoDS::Face(ex.Current());
+
+		TopLoc_Location loc;
+		const Handle(Poly_Triangulation) &tri = BRep_Tool::Triangulation(face, loc);
+		if (tri.IsNull()) {
+			return mesh;
+		}
+
+		const gp_Trsf trsf = loc.Transformation();
+		const bool reversed = face.Orientation() == TopAbs_REVERSED;
+
+		for (Standard_Integer i = 1; i <= tri->NbTriangles(); i++) {
+			Standard_Integer n[3];
+			tri->Triangle(i).Get(n[0], n[1], n[2]);
+			if (reversed) {
+				std::swap(n[1], n[2]);
+			}
+
+			double p[3][3];
+			for (int k = 0; k < 3; k++) {
+#if OCC_VERSION_HEX >= 0x070600
+				const gp_Pnt pt = tri->Node(n[k]).Transformed(trsf);
+#else
+				const gp_Pnt pt = tri->Nodes()(n[k]).Transformed(trsf);
+#endif
+				p[k][0] = pt.X();
+				p[k][1] = pt.Y();
+				p[k][2] = pt.Z();
+			}
+			mesh.add_triangle(p[0], p[1], p[2]);
+		}
+	}
+
+	mesh.deflection = deflection;
+	mesh.valid = mesh.size() > 0;
+	return mesh;
+}
+
+namespace {
+	struct vec3 {
+		double x, y, z;
+
+		vec3 operator-(const vec3 &o) const { return {x - o.x, y - o.y, z - o.z}; }
+	};
+
+	double dot(const vec3 &a, const vec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+	vec3 cross(const vec3 &a, const vec3 &b) {
+		return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+	}
+
+	struct box3 {
+		double lower[3], upper[3];
+
+		bool empty() const {
+			return lower[0] > upper[0] || lower[1] > upper[1] || lower[2] > upper[2];
+		}
+	};
+}
+
+static box3
+overlap_of_meshes(const triangle_mesh &a, const triangle_mesh &b)
+{
+	box3 box;
+	for (int k = 0; k < 3; k++) {
+		box.lower[k] = std::max(a.lower[k], b.lower[k]);
+		box.upper[k] = std::min(a.upper[k], b.upper[k]);
+	}
+	return box;
+}
+
+static void
+corners_of(const triangle_mesh &mesh, size_t i, vec3 p[3])
+{
+	p[0] = {mesh.x0[i], mesh.y0[i], mesh.z0[i]};
+	p[1] = {mesh.x1[i], mesh.y1[i], mesh.z1[i]};
+	p[2] = {mesh.x2[i], mesh.y2[i], mesh.z2[i]};
+}
+
+// indices of triangles whose bounding box overlaps box, written as a single
+// pass over each array so the comparisons are vectorised
+static std::vector<uint32_t>
+triangles_in_box(const triangle_mesh &mesh, const box3 &box, int num_axes)
+{
+	const double *coords[3][3] = {
+		{mesh.x0.data(), mesh.x1.data(), mesh.x2.data()},
+		{mesh.y0.data(), mesh.y1.data(), mesh.y2.data()},
+		{mesh.z0.data(), mesh.z1.data(), mesh.z2.data()},
+	};
+
+	const size_t n = mesh.size();
+	std::vector<uint8_t> inside(n, 1);
+	for (int k = 0; k < num_axes; k++) {
+		const double *c0 = coords[k][0], *c1 = coords[k][1], *c2 = coords[k][2];
+		const double lo = box.lower[k], hi = box.upper[k];
+		uint8_t *in = inside.data();
+		for (size_t i = 0; i < n; i++) {
+			const double
+				tlo = std::min(std::min(c0[i], c1[i]), c2[i]),
+				thi = std::max(std::max(c0[i], c1[i]), c2[i]);
+			in[i] = in[i] && tlo <= hi && thi >= lo;
+		}
+	}
+
+	std::vector<uint32_t> result;
+	for (size_t i = 0; i < n; i++) {
+		if (inside[i]) {
+			result.push_back(uint32_t(i));
+		}
+	}
+	return result;
+}
+
+// separating axis test, triangles that only touch count as intersecting
+static bool
+triangles_intersect(const vec3 a[3], const vec3 b[3])
+{
+	const vec3
+		ea[3] = {a[1] - a[0], a[2] - a[1], a[0] - a[2]},
+		eb[3] = {b[1] - b[0], b[2] - b[1], b[0] - b[2]},
+		na = cross(ea[0], ea[1]),
+		nb = cross(eb[0], eb[1]);
+
+	auto separated = [a, b](const vec3 &axis) {
+		const double
+			a0 = dot(axis, a[0]), a1 = dot(axis, a[1]), a2 = dot(axis, a[2]),
+			b0 = dot(axis, b[0]), b1 = dot(axis, b[1]), b2 = dot(axis, b[2]);
+		return
+			std::max(std::max(a0, a1), a2) < std::min(std::min(b0, b1), b2) ||
+			std::max(std::max(b0, b1), b2) < std::min(std::min(a0, a1), a2);
+	};
+
+	if (separated(na) || separated(nb)) {
+		return false;
+	}
+
+	// relative threshold for treating edges or planes as parallel
+	const double eps = 1e-12;
+
+	for (const auto &u : ea) {
+		for (const auto &v : eb) {
+			const vec3 axis = cross(u, v);
+			if (dot(axis, axis) <= eps * dot(u, u) * dot(v, v)) {
+				continue;
+			}
+			if (separated(axis)) {
+				return false;
+			}
+		}
+	}
+
+	// coplanar triangles can only be separated within their plane
+	const vec3 nn = cross(na, nb);
+	if (dot(nn, nn) <= eps * dot(na, na) * dot(nb, nb)) {
+		for (const auto &u : ea) {
+			if (separated(cross(na, u))) {
+				return false;
+			}
+		}
+		for (const auto &v : eb) {
+			if (separated(cross(nb, v))) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool
+meshes_intersect(const triangle_mesh &a, const triangle_mesh &b)
+{
+	profile_scope scope{"mesh intersection"};
+	const box3 box = overlap_of_meshes(a, b);
+	if (box.empty()) {
+		return false;
+	}
+
+	const auto cand_a = triangles_in_box(a, box, 3);
+	const auto cand_b = triangles_in_box(b, box, 3);
+	if (cand_a.empty() || cand_b.empty()) {
+		return false;
+	}
+
+	// bin b's triangles into a uniform grid over the overlap so each of a's
+	// triangles is only tested against nearby ones
+	const size_t grid = std::max(
+		size_t(1), std::min(size_t(32), size_t(std::cbrt(double(cand_b.size())))));
+
+	double scale[3];
+	for (int k = 0; k < 3; k++) {
+		const double extent = box.upper[k] - box.lower[k];
+		scale[k] = extent > 0 ? double(grid) / extent : 0;
+	}
+
+	auto cell_range = [&box, &scale, grid](const vec3 p[3], size_t lo[3], size_t hi[3]) {
+		const double
+			mins[3] = {
+				std::min(std::min(p[0].x, p[1].x), p[2].x),
+				std::min(std::min(p[0].y, p[1].y), p[2].y),
+				std::min(std::min(p[0].z, p[1].z), p[2].z),
+			},
+			maxs[3] = {
+				std::max(std::max(p[0].x, p[1].x), p[2].x),
+				std::max(std::max(p[0].y, p[1].y), p[2].y),
+				std::max(std::max(p[0].z, p[1].z), p[2].z),
+			};
+		auto clamp = [grid](double c) {
+			return c <= 0 ? size_t(0) : std::min(grid - 1, size_t(c));
+		};
+		for (int k = 0; k < 3; k++) {
+			lo[k] = clamp((mins[k] - box.lower[k]) * scale[k]);
+			hi[k] = clamp((maxs[k] - box.lower[k]) * scale[k]);
+		}
+	};
+
+	std::vector<std::vector<uint32_t>> cells(grid * grid * grid);
+	for (const auto j : cand_b) {
+		vec3 p[3];
+		corners_of(b, j, p);
+		size_t lo[3], hi[3];
+		cell_range(p, lo, hi);
+		for (size_t x = lo[0]; x <= hi[0]; x++) {
+			for (size_t y = lo[1]; y <= hi[1]; y++) {
+				for (size_t z = lo[2]; z <= hi[2]; z++) {
+					cells[(x * grid + y) * grid + z].push_back(j);
+				}
+			}
+		}
+	}
+
+	for (const auto i : cand_a) {
+		vec3 p[3];
+		corners_of(a, i, p);
+		size_t lo[3], hi[3];
+		cell_range(p, lo, hi);
+		for (size_t x = lo[0]; x <= hi[0]; x++) {
+			for (size_t y = lo[1]; y <= hi[1]; y++) {
+				for (size_t z = lo[2]; z <= hi[2]; z++) {
+					for (const auto j : cells[(x * grid + y) * grid + z]) {
+						vec3 q[3];
+						corners_of(b, j, q);
+						if (triangles_intersect(p, q)) {
+							return true;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+namespace {
+	struct crossing {
+		double z;
+		// +1 entering the solid moving up the column, -1 leaving
+		int direction;
+
+		bool operator<(const crossing &o) const { return z < o.z; }
+	};
+
+	struct column_grid {
+		box3 box;
+		size_t nx, ny;
+		double hx, hy;
+
+		// moves sample points off the regular lattice, meshes of boxes tend
+		// to have edges exactly where the samples would otherwise be
+		double jitter_x, jitter_y;
+
+		double x_of(size_t i) const { return box.lower[0] + (double(i) + 0.5) * hx + jitter_x; }
+		double y_of(size_t j) const { return box.lower[1] + (double(j) + 0.5) * hy + jitter_y; }
+	};
+}
+
+// where each column passes through the mesh, with the solid's inside being
+// where the winding count is positive
+static std::vector<std::vector<crossing>>
+crossings_of_columns(const triangle_mesh &mesh, const column_grid &grid)
+{
+	std::vector<std::vector<crossing>> columns(grid.nx * grid.ny);
+
+	auto index_range = [](double lo, double hi, double origin, double h, double jitter, size_t n, size_t &first, size_t &last) {
+		const double
+			f = std::ceil((lo - origin - jitter) / h - 0.5),
+			l = std::floor((hi - origin - jitter) / h - 0.5);
+		if (l < 0 || f > double(n - 1) || f > l) {
+			return false;
+		}
+		first = f < 0 ? 0 : size_t(f);
+		last = std::min(n - 1, size_t(l));
+		return true;
+	};
+
+	for (const auto t : triangles_in_box(mesh, grid.box, 2)) {
+		const double
+			x0 = mesh.x0[t], y0 = mesh.y0[t], z0 = mesh.z0[t],
+			x1 = mesh.x1[t], y1 = mesh.y1[t], z1 = mesh.z1[t],
+			x2 = mesh.x2[t], y2 = mesh.y2[t], z2 = mesh.z2[t];
+
+		// twice the area projected onto the xy-plane, positive when the
+		// triangle faces up
+		const double area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+		if (area == 0) {
+			continue;
+		}
+
+		size_t i0, i1, j0, j1;
+		if (!index_range(std::min(std::min(x0, x1), x2), std::max(std::max(x0, x1), x2),
+						 grid.box.lower[0], grid.hx, grid.jitter_x, grid.nx, i0, i1) ||
+			!index_range(std::min(std::min(y0, y1), y2), std::max(std::max(y0, y1), y2),
+						 grid.box.lower[1], grid.hy, grid.jitter_y, grid.ny, j0, j1)) {
+			continue;
+		}
+
+		for (size_t i = i0; i <= i1; i++) {
+			const double px = grid.x_of(i);
+			for (size_t j = j0; j <= j1; j++) {
+				const double py = grid.y_of(j);
+
+				// edge functions, all the same sign as area when inside
+				const double
+					w0 = (x1 - x0) * (py - y0) - (y1 - y0) * (px - x0),
+					w1 = (x2 - x1) * (py - y1) - (y2 - y1) * (px - x1),
+					w2 = (x0 - x2) * (py - y2) - (y0 - y2) * (px - x2);
+
+				const bool inside = area > 0 ?
+					(w0 > 0 && w1 > 0 && w2 > 0) :
+					(w0 < 0 && w1 < 0 && w2 < 0);
+				if (!inside) {
+					continue;
+				}
+
+				const double z = (w1 * z0 + w2 * z1 + w0 * z2) / area;
+				columns[i * grid.ny + j].push_back({z, area > 0 ? -1 : 1});
+			}
+		}
+	}
+
+	return columns;
+}
+
+// intervals along a column that are inside the solid
+static std::vector<std::pair<double, double>>
+intervals_of_column(std::vector<crossing> &crossings)
+{
+	std::sort(crossings.begin(), crossings.end());
+
+	std::vector<std::pair<double, double>> result;
+	int winding = 0;
+	double start = 0;
+	for (const auto &c : crossings) {
+		const int next = winding + c.direction;
+		if (winding <= 0 && next > 0) {
+			start = c.z;
+		} else if (winding > 0 && next <= 0) {
+			result.emplace_back(start, c.z);
+		}
+		winding = next;
+	}
+	return result;
+}
+
+static double
+length_of_common(
+	const std::vector<std::pair<double, double>> &a,
+	const std::vector<std::pair<double, double>> &b)
+{
+	double length = 0;
+	size_t i = 0, j = 0;
+	while (i < a.size() && j < b.size()) {
+		const double
+			lo = std::max(a[i].first, b[j].first),
+			hi = std::min(a[i].second, b[j].second);
+		if (lo < hi) {
+			length += hi - lo;
+		}
+		if (a[i].second < b[j].second) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+	return length;
+}
+
+// total area of the triangles that could contribute to the common volume
+static double
+area_in_box(const triangle_mesh &mesh, const box3 &box)
+{
+	double area = 0;
+	for (const auto t : triangles_in_box(mesh, box, 3)) {
+		vec3 p[3];
+		corners_of(mesh, t, p);
+		const vec3 n = cross(p[1] - p[0], p[2] - p[0]);
+		area += std::sqrt(dot(n, n)) / 2;
+	}
+	return area;
+}
+
+common_volume_estimate
+estimate_common_volume(
+	const triangle_mesh &a, const triangle_mesh &b, unsigned resolution)
+{
+	profile_scope scope{"estimate common volume"};
+	column_grid grid;
+	grid.box = overlap_of_meshes(a, b);
+
+	const double
+		dx = grid.box.upper[0] - grid.box.lower[0],
+		dy = grid.box.upper[1] - grid.box.lower[1];
+
+	if (grid.box.empty() || !(dx > 0 && dy > 0) || resolution == 0) {
+		return {0, 0};
+	}
+
+	{
+		const double h = std::max(dx, dy) / resolution;
+		grid.nx = std::max(size_t(1), size_t(std::ceil(dx / h)));
+		grid.ny = std::max(size_t(1), size_t(std::ceil(dy / h)));
+		grid.hx = dx / double(grid.nx);
+		grid.hy = dy / double(grid.ny);
+		grid.jitter_x = grid.hx * 1.2345e-6;
+		grid.jitter_y = grid.hy * 2.3456e-6;
+	}
+
+	auto cols_a = crossings_of_columns(a, grid);
+	auto cols_b = crossings_of_columns(b, grid);
+
+	std::vector<double> lengths(grid.nx * grid.ny);
+	for (size_t i = 0; i < lengths.size(); i++) {
+		lengths[i] = length_of_common(
+			intervals_of_column(cols_a[i]), intervals_of_column(cols_b[i]));
+	}
+
+	const double cell_area = grid.hx * grid.hy;
+
+	common_volume_estimate result{0, 0};
+	for (size_t i = 0; i < grid.nx; i++) {
+		for (size_t j = 0; j < grid.ny; j++) {
+			const double len = lengths[i * grid.ny + j];
+			result.volume += len * cell_area;
+
+			// assume the volume could change linearly towards each
+			// neighbouring column. the common volume can't extend past the
+			// grid, so its edges are only uncertain where lengths change
+			double change = 0;
+			if (i > 0) {
+				change = std::max(change, std::abs(len - lengths[(i - 1) * grid.ny + j]));
+			}
+			if (i + 1 < grid.nx) {
+				change = std::max(change, std::abs(len - lengths[(i + 1) * grid.ny + j]));
+			}
+			if (j > 0) {
+				change = std::max(change, std::abs(len - lengths[i * grid.ny + j - 1]));
+			}
+			if (j + 1 < grid.ny) {
+				change = std::max(change, std::abs(len - lengths[i * grid.ny + j + 1]));
+			}
+			result.uncertainty += change * cell_area / 2;
+		}
+	}
+
+	// surfaces of the mesh could be off by up to the deflection
+	result.uncertainty +=
+		a.deflection * area_in_box(a, grid.box) +
+		b.deflection * area_in_box(b, grid.box);
+
+	return result;
+}
+
+
+#ifdef INCLUDE_TESTS
+#include <BRepPrimAPI_MakeBox.hxx>
+#include <BRepPrimAPI_MakeSphere.hxx>
+
+static triangle_mesh
+box_mesh(double x, double y, double z, double dx, double dy, double dz)
+{
+	const double p[8][3] = {
+		{x, y, z}, {x + dx, y, z}, {x + dx, y + dy, z}, {x, y + dy, z},
+		{x, y, z + dz}, {x + dx, y, z + dz}, {x + dx, y + dy, z + dz}, {x, y + dy, z + dz},
+	};
+	// anti-clockwise quads when seen from outside
+	const int quads[6][4] = {
+		{0, 3, 2, 1}, {4, 5, 6, 7},
+		{0, 1, 5, 4}, {2, 3, 7, 6},
+		{1, 2, 6, 5}, {0, 4, 7, 3},
+	};
+
+	triangle_mesh mesh;
+	for (const auto &q : quads) {
+		mesh.add_triangle(p[q[0]], p[q[1]], p[q[2]]);
+		mesh.add_triangle(p[q[0]], p[q[2]], p[q[3]]);
+	}
+	mesh.valid = true;
+	return mesh;
+}
+
+TEST_CASE("triangle mesh volume") {
+	using Catch::Approx;
+
+	CHECK(box_mesh(1, 2, 3, 2, 3, 4).volume() == Approx(2*3*4));
+
+	const auto cube = mesh_of_solid(BRepPrimAPI_MakeBox(gp_Pnt(1, 2, 3), 2, 3, 4).Shape(), 0.01);
+	REQUIRE(cube.valid);
+	CHECK(cube.volume() == Approx(2*3*4));
+
+	const auto sphere = mesh_of_solid(BRepPrimAPI_MakeSphere(5).Shape(), 0.0005);
+	REQUIRE(sphere.valid);
+	CHECK(sphere.volume() == Approx(4. / 3 * M_PI * 5*5*5).epsilon(0.01));
+}
+
+TEST_CASE("meshes_intersect") {
+	const auto a = box_mesh(0, 0, 0, 5, 5, 5);
+
+	SECTION("overlapping") {
+		CHECK(meshes_intersect(a, box_mesh(4, 4, 4, 5, 5, 5)));
+	}
+	SECTION("touching face") {
+		CHECK(meshes_intersect(a, box_mesh(0, 0, 5, 5, 5, 5)));
+	}
+	SECTION("touching edge") {
+		CHECK(meshes_intersect(a, box_mesh(5, 5, 0, 5, 5, 5)));
+	}
+	SECTION("gap") {
+		CHECK_FALSE(meshes_intersect(a, box_mesh(0, 0, 5.1, 5, 5, 5)));
+	}
+	SECTION("overlapping bounding boxes") {
+		// plane through the cube
+		const double p0[3] = {6, 0, 0}, p1[3] = {0, 6, 0}, p2[3] = {0, 0, 6};
+		triangle_mesh b;
+		b.add_triangle(p0, p1, p2);
+		CHECK(meshes_intersect(a, b));
+
+		// only the bounding boxes overlap
+		const double q0[3] = {16, 0, 0}, q1[3] = {0, 16, 0}, q2[3] = {0, 0, 16};
+		triangle_mesh c;
+		c.add_triangle(q0, q1, q2);
+		CHECK_FALSE(meshes_intersect(a, c));
+	}
+	SECTION("contained without surfaces meeting") {
+		CHECK_FALSE(meshes_intersect(a, box_mesh(1, 1, 1, 3, 3, 3)));
+	}
+}
+
+TEST_CASE("estimate_common_volume") {
+	using Catch::Approx;
+
+	const auto a = box_mesh(0, 0, 0, 5, 5, 5);
+
+	SECTION("partial overlap") {
+		const auto est = estimate_common_volume(a, box_mesh(1, 2, 3, 5, 5, 5), 16);
+		CHECK(est.volume == Approx(4*3*2));
+		CHECK(est.uncertainty < 1);
+	}
+	SECTION("contained") {
+		const auto est = estimate_common_volume(a, box_mesh(1, 1, 1, 2, 2, 2), 16);
+		CHECK(est.volume == Approx(2*2*2));
+	}
+	SECTION("touching") {
+		const auto est = estimate_common_volume(a, box_mesh(0, 0, 5, 5, 5, 5), 16);
+		CHECK(est.volume == Approx(0).margin(1e-9));
+	}
+	SECTION("distinct") {
+		const auto est = estimate_common_volume(a, box_mesh(6, 6, 6, 5, 5, 5), 16);
+		CHECK(est.volume == 0);
+		CHECK(est.uncertainty == 0);
+	}
+	SECTION("spheres") {
+		const double r = 5, d = 6;
+		const auto s1 = mesh_of_solid(BRepPrimAPI_MakeSphere(r).Shape(), 0.001);
+		const auto s2 = mesh_of_solid(BRepPrimAPI_MakeSphere(gp_Pnt(d, 0, 0), r).Shape(), 0.001);
+		REQUIRE(s1.valid);
+		REQUIRE(s2.valid);
+
+		// lens formed by two equal spheres
+		const double expected = M_PI * (4*r + d) * (2*r - d) * (2*r - d) / 12;
+
+		const auto est = estimate_common_volume(s1, s2, 64);
+		CHECK(std::abs(est.volume - expected) <= est.uncertainty);
+		CHECK(est.uncertainty < expected * 0.2);
+	}
+}
+#endif
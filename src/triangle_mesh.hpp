@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+#include <TopoDS_Shape.hxx>
+
+
+/* approximate geometry for quickly ruling pairs of solids in or out, before
+ * falling back to exact boolean operations when the answer is close.
+ */
+
+// triangles are stored with each coordinate of each corner in its own array
+// so loops testing many triangles against a point or box can be vectorised
+struct triangle_mesh {
+	std::vector<double>
+		x0, y0, z0,
+		x1, y1, z1,
+		x2, y2, z2;
+
+	// bounding box of all corners
+	double lower[3], upper[3];
+
+	// maximum distance between the mesh and the surface it approximates
+	double deflection = 0;
+
+	// false if the solid couldn't be triangulated, in which case the mesh
+	// shouldn't be used
+	bool valid = false;
+
+	size_t size() const { return x0.size(); }
+
+	// corners should be anti-clockwise when seen from outside the solid
+	void add_triangle(const double p0[3], const double p1[3], const double p2[3]);
+
+	// signed volume enclosed, positive for a closed, outward facing mesh
+	double volume() const;
+};
+
+// triangulates a copy of solid, so the original can be used by other threads.
+// deflection is relative to the size of the solid's bounding box
+triangle_mesh mesh_of_solid(const TopoDS_Shape &solid, double relative_deflection);
+
+// true when any triangle of a intersects or touches a triangle of b
+bool meshes_intersect(const triangle_mesh &a, const triangle_mesh &b);
+
+struct common_volume_estimate {
+	double volume;
+
+	// bound on the error due to discretisation and meshing, the real common
+	// volume should be within volume +/- uncertainty
+	double uncertainty;
+};
+
+// integrates along columns parallel to the z axis, resolution columns spanning
+// the longer side of the overlap of the meshes' bounding boxes
+common_volume_estimate estimate_common_volume(
+	const triangle_mesh &a, const triangle_mesh &b, unsigned resolution);
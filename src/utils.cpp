@@ -1,12 +1,22 @@
 #include <cerrno>
+#include <charconv>
 #include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cassert>
 
 #include <algorithm>
 #include <iomanip>
 #include <limits>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <unistd.h>
 
 #ifdef INCLUDE_TESTS
 #include <catch2/catch_test_macros.hpp>
@@ -21,6 +31,9 @@ static auto aixlog_severity = AixLog::Severity::info;
 static std::shared_ptr<AixLog::Sink> aixlog_sink;
 
 #define OPT_USAGE -3
+#define OPT_PROFILE -4
+#define OPT_TRACE_FILE -5
+#define OPT_DISTANCE_PREFILTER -6
 
 tool_argp_parser::tool_argp_parser(size_t expected_args) : cxx_argp::parser(expected_args)
 {
@@ -69,6 +82,97 @@ tool_argp_parser::tool_argp_parser(size_t expected_args) : cxx_argp::parser(expe
 		});
 }
 
+void
+tool_argp_parser::add_jobs_option(unsigned &num_parallel_jobs)
+{
+	std::stringstream stream;
+	stream
+		<< "Parallelise over N[=" << num_parallel_jobs << "] threads, leave N blank "
+		"to use all (" << std::thread::hardware_concurrency() << ") cores.";
+	help_text.push_back(stream.str());
+
+	auto parse_parallel = [&num_parallel_jobs](int, const char* arg, struct argp_state* state) {
+		if (!arg) {
+			num_parallel_jobs = std::thread::hardware_concurrency();
+			LOG(DEBUG)
+				<< "Using " << num_parallel_jobs << " threads for parallel computation\n";
+			return 0;
+		}
+
+		// sanity checking user input
+		const long parallel_job_limit = 9999;
+		long n;
+		size_t end;
+		try {
+			n = std::stol(arg, &end);
+		} catch(std::exception &err) {
+			argp_error(
+				state, "not a valid number: '%s'",
+				arg);
+		}
+		if (arg[end] != '\0') {
+			argp_error(
+				state, "trailing characters after number in '%s'",
+				arg);
+		}
+		// make sure the user isn't doing anything silly
+		else if (n < 1 || n > parallel_job_limit) {
+			argp_error(
+				state, "number of parallel jobs should be between 1 and %li, not %li",
+				parallel_job_limit, n);
+		} else {
+			num_parallel_jobs = unsigned(n);
+		}
+		return 0;
+	};
+
+	add_option(
+		{"jobs", 'j', "N", OPTION_ARG_OPTIONAL, help_text.back().c_str(), 0},
+		std::function{parse_parallel});
+}
+
+void
+tool_argp_parser::add_profile_options(profile_writer &writer)
+{
+	add_option(
+		{"profile", OPT_PROFILE, "FILE", 0, "Write JSON summary of time spent in each phase to FILE", -1},
+		[&writer](int, const char *arg, struct argp_state*) {
+			writer.summary_path = arg;
+			enable_profiling(false);
+			return 0;
+		});
+
+	add_option(
+		{"trace-file", OPT_TRACE_FILE, "FILE", 0, "Write every timed phase to FILE in Chrome trace format, for chrome://tracing or Perfetto", -1},
+		[&writer](int, const char *arg, struct argp_state*) {
+			writer.trace_path = arg;
+			enable_profiling(true);
+			return 0;
+		});
+}
+
+void
+tool_argp_parser::add_distance_prefilter_option(bool &enabled, unsigned &time_millisecs)
+{
+	add_option(
+		{"distance-prefilter", OPT_DISTANCE_PREFILTER, "T", OPTION_ARG_OPTIONAL, "Measure the distance between solids, for up to T[=1] seconds, and skip paving those further apart than the imprint tolerance", 0},
+		[&enabled, &time_millisecs](int, const char *arg, struct argp_state* state) {
+			enabled = true;
+			if (!arg) {
+				return 0;
+			}
+			char *end;
+			const double seconds = std::strtod(arg, &end);
+			if (end == arg || *end != '\0' || !(seconds > 0 && seconds <= 3600)) {
+				argp_error(
+					state, "distance prefilter time should be between 0 and 3600 seconds, not '%s'",
+					arg);
+			}
+			time_millisecs = unsigned(std::ceil(seconds * 1000));
+			return 0;
+		});
+}
+
 
 void configure_aixlog()
 {
@@ -93,10 +197,16 @@ void configure_aixlog()
 
 std::string indexpair_to_string(size_t left, size_t right)
 {
-	std::stringstream ss;
-	ss.width(5);
-	ss << left << '-' << std::left << right;
-	return ss.str();
+	// called for most log messages, so avoid a stringstream
+	char buf[48];
+	const int n = std::snprintf(buf, sizeof(buf), "%5zu-%zu", left, right);
+	return std::string(buf, size_t(n));
+}
+
+bool
+debug_logging_enabled()
+{
+	return aixlog_severity <= AixLog::Severity::debug;
 }
 
 
@@ -134,6 +244,28 @@ TEST_CASE("are_vals_close") {
 }
 #endif
 
+uint64_t
+hash_of_string(std::string_view str, uint64_t hash)
+{
+	for (const char c : str) {
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("hash_of_string") {
+	// reference values from the FNV spec
+	CHECK(hash_of_string("") == 0xcbf29ce484222325ull);
+	CHECK(hash_of_string("a") == 0xaf63dc4c8601ec8cull);
+	CHECK(hash_of_string("foobar") == 0x85944171f73967e8ull);
+
+	// can be used incrementally
+	CHECK(hash_of_string("bar", hash_of_string("foo")) == hash_of_string("foobar"));
+}
+#endif
+
 bool int_of_string(const char *s, int &i, int base)
 {
 	char *end;
@@ -306,22 +438,908 @@ TEST_CASE("parse_csv_row") {
 }
 #endif
 
+/** greedy "longest processing time first" partitioning, each item (most
+ * expensive first) goes to the shard with the smallest total so far. ties
+ * are broken by index so the result only depends on the costs.
+ */
+std::vector<size_t>
+partition_by_cost(const std::vector<double> &costs, size_t num_shards)
+{
+	assert(num_shards > 0);
+
+	std::vector<size_t> order(costs.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(
+		order.begin(), order.end(),
+		[&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+	std::vector<double> totals(num_shards, 0.);
+	std::vector<size_t> result(costs.size());
+	for (const auto i : order) {
+		const auto it = std::min_element(totals.begin(), totals.end());
+		*it += costs[i];
+		result[i] = (size_t)(it - totals.begin());
+	}
+	return result;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("partition_by_cost") {
+	SECTION("empty") {
+		CHECK(partition_by_cost({}, 3).empty());
+	}
+	SECTION("one shard") {
+		CHECK(vectors_eq(partition_by_cost({1, 2, 3}, 1), {0, 0, 0}));
+	}
+	SECTION("balanced by cost") {
+		// 8 on its own, then 5+3 and 4+2+1+1
+		const auto result = partition_by_cost({1, 8, 3, 5, 4, 2, 1}, 3);
+		std::vector<double> totals(3);
+		const double costs[] = {1, 8, 3, 5, 4, 2, 1};
+		for (size_t i = 0; i < result.size(); i++) {
+			REQUIRE(result[i] < 3);
+			totals[result[i]] += costs[i];
+		}
+		CHECK(vectors_eq(totals, {8, 8, 8}));
+	}
+	SECTION("deterministic with ties") {
+		CHECK(vectors_eq(partition_by_cost({1, 1, 1, 1}, 2), {0, 1, 0, 1}));
+	}
+}
+#endif
+
+std::vector<size_t>
+batch_independent_pairs(const std::vector<std::pair<size_t, size_t>> &pairs)
+{
+	// earliest batch each index can next appear in
+	std::unordered_map<size_t, size_t> next_batch;
+
+	std::vector<size_t> result;
+	result.reserve(pairs.size());
+	for (const auto &pair : pairs) {
+		auto &first = next_batch[pair.first], &second = next_batch[pair.second];
+		const size_t batch = std::max(first, second);
+		first = second = batch + 1;
+		result.push_back(batch);
+	}
+	return result;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("batch_independent_pairs") {
+	SECTION("empty") {
+		CHECK(batch_independent_pairs({}).empty());
+	}
+	SECTION("disjoint pairs share a batch") {
+		CHECK(vectors_eq(batch_independent_pairs({{1, 0}, {3, 2}, {5, 4}}), {0, 0, 0}));
+	}
+	SECTION("chain is serialised") {
+		CHECK(vectors_eq(batch_independent_pairs({{1, 0}, {2, 1}, {3, 2}}), {0, 1, 2}));
+	}
+	SECTION("mixed") {
+		// {3,2} can run alongside {1,0}, {2,0} has to wait for both
+		CHECK(vectors_eq(
+			batch_independent_pairs({{1, 0}, {3, 2}, {2, 0}, {5, 4}, {4, 1}}),
+			{0, 0, 1, 0, 1}));
+	}
+	SECTION("no index repeated within a batch") {
+		const std::vector<std::pair<size_t, size_t>> pairs = {
+			{1, 0}, {2, 0}, {2, 1}, {3, 0}, {3, 1}, {3, 2}, {4, 3}, {5, 4}, {5, 0},
+		};
+		const auto batches = batch_independent_pairs(pairs);
+		for (size_t i = 0; i < pairs.size(); i++) {
+			for (size_t j = i + 1; j < pairs.size(); j++) {
+				const bool shared =
+					pairs[i].first == pairs[j].first || pairs[i].first == pairs[j].second ||
+					pairs[i].second == pairs[j].first || pairs[i].second == pairs[j].second;
+				if (shared) {
+					CHECK(batches[i] < batches[j]);
+				}
+			}
+		}
+	}
+}
+#endif
+
+std::vector<std::vector<size_t>>
+connected_components(const std::vector<std::pair<size_t, size_t>> &pairs)
+{
+	// union-find, with the smallest index as each set's root
+	std::unordered_map<size_t, size_t> parent;
+	auto find = [&parent](size_t i) {
+		// does nothing if already present
+		parent.emplace(i, i);
+		while (parent[i] != i) {
+			// path halving
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+
+	for (const auto &pair : pairs) {
+		const size_t a = find(pair.first), b = find(pair.second);
+		if (a < b) {
+			parent[b] = a;
+		} else if (b < a) {
+			parent[a] = b;
+		}
+	}
+
+	std::vector<size_t> indices;
+	indices.reserve(parent.size());
+	for (const auto &it : parent) {
+		indices.push_back(it.first);
+	}
+	std::sort(indices.begin(), indices.end());
+
+	// roots are the smallest in their set, so are seen first
+	std::vector<std::vector<size_t>> result;
+	std::unordered_map<size_t, size_t> component_of_root;
+	for (const auto i : indices) {
+		const size_t root = find(i);
+		auto it = component_of_root.find(root);
+		if (it == component_of_root.end()) {
+			it = component_of_root.emplace(root, result.size()).first;
+			result.emplace_back();
+		}
+		result[it->second].push_back(i);
+	}
+	return result;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("connected_components") {
+	using components = std::vector<std::vector<size_t>>;
+
+	SECTION("empty") {
+		CHECK(connected_components({}).empty());
+	}
+	SECTION("separate pairs") {
+		CHECK(connected_components({{3, 2}, {1, 0}}) == components{{0, 1}, {2, 3}});
+	}
+	SECTION("joined") {
+		CHECK(connected_components({{5, 1}, {7, 3}, {3, 1}, {9, 8}, {8, 6}}) ==
+			  components{{1, 3, 5, 7}, {6, 8, 9}});
+	}
+	SECTION("chain joined from both ends") {
+		CHECK(connected_components({{9, 8}, {1, 0}, {8, 7}, {2, 1}, {7, 2}}) ==
+			  components{{0, 1, 2, 7, 8, 9}});
+	}
+}
+#endif
+
+pair_sequencer::pair_sequencer(const std::vector<std::pair<size_t, size_t>> &pairs) :
+	pairs{pairs}, states(pairs.size(), state::unresolved), num_done{0}
+{
+	for (size_t i = 0; i < pairs.size(); i++) {
+		assert(pairs[i].first != pairs[i].second);
+		queues[pairs[i].first].pairs.push_back(i);
+		queues[pairs[i].second].pairs.push_back(i);
+	}
+}
+
+bool
+pair_sequencer::is_next(size_t index, size_t pair) const
+{
+	const auto &q = queues.at(index);
+	return q.head < q.pairs.size() && q.pairs[q.head] == pair;
+}
+
+void
+pair_sequencer::start_if_ready(size_t pair, std::vector<size_t> &ready)
+{
+	if (states[pair] == state::wanted &&
+		is_next(pairs[pair].first, pair) &&
+		is_next(pairs[pair].second, pair)) {
+		states[pair] = state::running;
+		ready.push_back(pair);
+	}
+}
+
+void
+pair_sequencer::advance(size_t index, std::vector<size_t> &ready)
+{
+	auto &q = queues.at(index);
+	while (q.head < q.pairs.size()) {
+		const auto st = states[q.pairs[q.head]];
+		if (st != state::skipped && st != state::finished) {
+			break;
+		}
+		q.head += 1;
+	}
+	if (q.head < q.pairs.size()) {
+		start_if_ready(q.pairs[q.head], ready);
+	}
+}
+
+std::vector<size_t>
+pair_sequencer::resolve(size_t pair, bool wanted)
+{
+	assert(states.at(pair) == state::unresolved);
+
+	std::vector<size_t> ready;
+	if (wanted) {
+		states[pair] = state::wanted;
+		start_if_ready(pair, ready);
+	} else {
+		states[pair] = state::skipped;
+		num_done += 1;
+		advance(pairs[pair].first, ready);
+		advance(pairs[pair].second, ready);
+	}
+	std::sort(ready.begin(), ready.end());
+	return ready;
+}
+
+std::vector<size_t>
+pair_sequencer::finish(size_t pair)
+{
+	assert(states.at(pair) == state::running);
+
+	states[pair] = state::finished;
+	num_done += 1;
+
+	std::vector<size_t> ready;
+	advance(pairs[pair].first, ready);
+	advance(pairs[pair].second, ready);
+	std::sort(ready.begin(), ready.end());
+	return ready;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("pair_sequencer") {
+	using indices = std::vector<size_t>;
+
+	SECTION("independent pairs start straight away") {
+		const std::vector<std::pair<size_t, size_t>> pairs{{1, 0}, {3, 2}};
+		pair_sequencer seq{pairs};
+		CHECK(seq.resolve(1, true) == indices{1});
+		CHECK(seq.resolve(0, true) == indices{0});
+		CHECK(seq.finish(1).empty());
+		CHECK_FALSE(seq.done());
+		CHECK(seq.finish(0).empty());
+		CHECK(seq.done());
+	}
+
+	SECTION("later pairs wait for earlier ones") {
+		const std::vector<std::pair<size_t, size_t>> pairs{{1, 0}, {2, 1}, {3, 2}};
+		pair_sequencer seq{pairs};
+		CHECK(seq.resolve(2, true).empty());
+		CHECK(seq.resolve(1, true).empty());
+		CHECK(seq.resolve(0, true) == indices{0});
+		CHECK(seq.finish(0) == indices{1});
+		CHECK(seq.finish(1) == indices{2});
+		CHECK(seq.finish(2).empty());
+		CHECK(seq.done());
+	}
+
+	SECTION("skipped pairs don't hold anything up") {
+		const std::vector<std::pair<size_t, size_t>> pairs{{1, 0}, {2, 1}, {3, 1}, {3, 2}};
+		pair_sequencer seq{pairs};
+		CHECK(seq.resolve(3, true).empty());
+		CHECK(seq.resolve(2, false).empty());
+		CHECK(seq.resolve(1, true).empty());
+		CHECK(seq.resolve(0, false) == indices{1});
+		CHECK(seq.num_completed() == 2);
+		CHECK(seq.finish(1) == indices{3});
+		CHECK(seq.finish(3).empty());
+		CHECK(seq.done());
+	}
+
+	SECTION("several pairs released at once") {
+		const std::vector<std::pair<size_t, size_t>> pairs{{2, 1}, {1, 0}, {3, 2}};
+		pair_sequencer seq{pairs};
+		CHECK(seq.resolve(2, true).empty());
+		CHECK(seq.resolve(1, true).empty());
+		CHECK(seq.resolve(0, true) == indices{0});
+		CHECK(seq.finish(0) == indices{1, 2});
+	}
+}
+#endif
+
+admission_queue::admission_queue(
+	const std::vector<size_t> &order, const std::vector<double> &sizes, double budget) :
+	pending{order.begin(), order.end()},
+	sizes{sizes},
+	budget{budget}
+{
+}
+
+bool
+admission_queue::fits(size_t item) const
+{
+	return budget <= 0 || num_in_flight == 0 || in_flight_size + sizes[item] <= budget;
+}
+
+std::vector<size_t>
+admission_queue::admit()
+{
+	std::vector<size_t> result;
+	auto start = [this, &result](size_t item) {
+		in_flight_size += sizes[item];
+		num_in_flight += 1;
+		result.push_back(item);
+	};
+
+	while (!pending.empty() && fits(pending.front())) {
+		start(pending.front());
+		pending.pop_front();
+	}
+	// fill any gap with the smallest items
+	while (!pending.empty() && fits(pending.back())) {
+		start(pending.back());
+		pending.pop_back();
+	}
+	return result;
+}
+
+void
+admission_queue::finished(size_t item)
+{
+	assert(num_in_flight > 0);
+	num_in_flight -= 1;
+	in_flight_size -= sizes[item];
+	if (num_in_flight == 0) {
+		// don't let rounding errors accumulate
+		in_flight_size = 0;
+	}
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("admission_queue") {
+	using indices = std::vector<size_t>;
+
+	const std::vector<double> sizes{8, 5, 3, 1};
+	const indices order{0, 1, 2, 3};
+
+	SECTION("no budget admits everything") {
+		admission_queue q{order, sizes, 0};
+		CHECK(q.admit() == order);
+		CHECK(q.admit().empty());
+	}
+
+	SECTION("smaller items fill the gap") {
+		admission_queue q{order, sizes, 10};
+		CHECK(q.num_pending() == 4);
+		CHECK(q.admit() == indices{0, 3});
+		CHECK(q.num_pending() == 2);
+		CHECK(q.admit().empty());
+		q.finished(0);
+		CHECK(q.admit() == indices{1, 2});
+		CHECK(q.num_pending() == 0);
+		q.finished(3);
+		q.finished(1);
+		q.finished(2);
+		CHECK(q.empty());
+	}
+
+	SECTION("items larger than the budget run alone") {
+		admission_queue q{order, sizes, 4};
+		CHECK(q.admit() == indices{0});
+		q.finished(0);
+		CHECK(q.admit() == indices{1});
+		q.finished(1);
+		CHECK(q.admit() == indices{2, 3});
+	}
+}
+#endif
+
+tolerance_learner::tolerance_learner(size_t num_tolerances) :
+	num_tolerances{num_tolerances},
+	overall{
+		std::vector<unsigned long>(num_tolerances),
+		std::vector<unsigned long>(num_tolerances)}
+{
+}
+
+tolerance_learner::counts &
+tolerance_learner::counts_of(uint32_t kind)
+{
+	auto it = by_kind.find(kind);
+	if (it == by_kind.end()) {
+		it = by_kind.emplace(kind, counts{
+			std::vector<unsigned long>(num_tolerances),
+			std::vector<unsigned long>(num_tolerances)}).first;
+	}
+	return it->second;
+}
+
+std::vector<size_t>
+tolerance_learner::order(uint32_t kind) const
+{
+	// weight given to results across all kinds, i.e. a kind needs a few
+	// results of its own before they dominate
+	const double prior_weight = 2;
+	// a later tolerance needs to be this much more likely to succeed to be
+	// tried first, otherwise results would flip between equally good
+	// tolerances
+	const double margin = 0.1;
+
+	std::unique_lock<std::mutex> mlock(mutex);
+	const auto it = by_kind.find(kind);
+
+	std::vector<double> scores(num_tolerances);
+	for (size_t i = 0; i < num_tolerances; i++) {
+		// untried tolerances are assumed to be as likely to succeed as fail
+		const double prior =
+			(double(overall.successes[i]) + 1) / (double(overall.tries[i]) + 2);
+		if (it == by_kind.end()) {
+			scores[i] = prior;
+		} else {
+			const auto &c = it->second;
+			scores[i] =
+				(double(c.successes[i]) + prior_weight * prior) /
+				(double(c.tries[i]) + prior_weight);
+		}
+	}
+	mlock.unlock();
+
+	std::vector<size_t> remaining(num_tolerances), result;
+	for (size_t i = 0; i < num_tolerances; i++) {
+		remaining[i] = i;
+	}
+	while (!remaining.empty()) {
+		double best = 0;
+		for (const auto i : remaining) {
+			best = std::max(best, scores[i]);
+		}
+		const auto next = std::find_if(remaining.begin(), remaining.end(), [&](size_t i) {
+			return scores[i] >= best - margin;
+		});
+		result.push_back(*next);
+		remaining.erase(next);
+	}
+	return result;
+}
+
+void
+tolerance_learner::record(uint32_t kind, size_t tolerance, bool succeeded)
+{
+	assert(tolerance < num_tolerances);
+	std::unique_lock<std::mutex> mlock(mutex);
+	auto &c = counts_of(kind);
+	c.tries[tolerance] += 1;
+	overall.tries[tolerance] += 1;
+	if (succeeded) {
+		c.successes[tolerance] += 1;
+		overall.successes[tolerance] += 1;
+	}
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("tolerance_learner") {
+	using indices = std::vector<size_t>;
+
+	tolerance_learner learner{3};
+
+	SECTION("given order is kept without results") {
+		CHECK(learner.order(1) == indices{0, 1, 2});
+	}
+
+	SECTION("tolerance that keeps succeeding goes first") {
+		for (int i = 0; i < 5; i++) {
+			learner.record(1, 0, false);
+			learner.record(1, 1, false);
+			learner.record(1, 2, true);
+		}
+		CHECK(learner.order(1) == indices{2, 0, 1});
+
+		// other kinds are pulled the same way, but less strongly
+		const auto other = learner.order(2);
+		REQUIRE(other.size() == 3);
+		CHECK(other.front() == 2);
+	}
+
+	SECTION("kinds are learnt separately") {
+		for (int i = 0; i < 10; i++) {
+			learner.record(1, 0, false);
+			learner.record(1, 1, true);
+			learner.record(2, 0, true);
+		}
+		CHECK(learner.order(1).front() == 1);
+		CHECK(learner.order(2).front() == 0);
+	}
+
+	SECTION("similar success rates keep the given order") {
+		for (int i = 0; i < 10; i++) {
+			learner.record(1, 0, i % 2 == 0);
+			learner.record(1, 1, i % 3 != 0);
+		}
+		CHECK(learner.order(1) == indices{0, 1, 2});
+	}
+}
+#endif
+
+bool
+bytes_of_string(const char *s, size_t &bytes)
+{
+	size_t len = std::strlen(s), shift = 0;
+	if (len > 0) {
+		switch (s[len - 1]) {
+		case 'k': case 'K': shift = 10; break;
+		case 'm': case 'M': shift = 20; break;
+		case 'g': case 'G': shift = 30; break;
+		case 't': case 'T': shift = 40; break;
+		}
+	}
+	if (shift) {
+		len -= 1;
+	}
+
+	size_t val;
+	if (len == 0 || !size_t_of_string(std::string(s, len).c_str(), val, 10)) {
+		return false;
+	}
+	if (val > (std::numeric_limits<size_t>::max() >> shift)) {
+		return false;
+	}
+	bytes = val << shift;
+	return true;
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("bytes_of_string") {
+	size_t val = 0;
+	CHECK(bytes_of_string("100", val));
+	CHECK(val == 100);
+	CHECK(bytes_of_string("2k", val));
+	CHECK(val == 2048);
+	CHECK(bytes_of_string("512M", val));
+	CHECK(val == 512ull << 20);
+	CHECK(bytes_of_string("4G", val));
+	CHECK(val == 4ull << 30);
+
+	val = 1;
+	CHECK_FALSE(bytes_of_string("", val));
+	CHECK_FALSE(bytes_of_string("G", val));
+	CHECK_FALSE(bytes_of_string("1.5G", val));
+	CHECK_FALSE(bytes_of_string("-1M", val));
+	CHECK_FALSE(bytes_of_string("100000000T", val));
+	CHECK(val == 1);
+}
+#endif
+
+
+csv_reader::csv_reader(std::istream &is, size_t block_size) :
+	is{is}, buf(std::max(block_size, size_t(1)))
+{
+}
+
+// moves anything unparsed to the start of the buffer and reads more after it,
+// returning false once nothing more could be read
+bool
+csv_reader::fill()
+{
+	if (begin > 0) {
+		std::memmove(buf.data(), buf.data() + begin, end - begin);
+		end -= begin;
+		scanned -= begin;
+		begin = 0;
+	}
+	if (end == buf.size()) {
+		// row is longer than the buffer
+		buf.resize(buf.size() * 2);
+	}
+
+	is.read(buf.data() + end, std::streamsize(buf.size() - end));
+	const auto num_read = size_t(is.gcount());
+	end += num_read;
+	if (num_read == 0) {
+		at_eof = true;
+	}
+	return num_read > 0;
+}
 
 input_status
-parse_next_row(std::istream &is, std::vector<std::string> &row)
+csv_reader::next_row(std::vector<std::string_view> &fields)
 {
-	if (is.eof()) {
-		return input_status::end_of_file;
+	size_t newline;
+	while ((newline = size_t(std::find(buf.data() + scanned, buf.data() + end, '\n') - buf.data())) == end) {
+		scanned = end;
+		if (at_eof || !fill()) {
+			if (is.bad()) {
+				return input_status::error;
+			}
+			if (begin == end) {
+				return input_status::end_of_file;
+			}
+			// last row has no newline
+			newline = end;
+			break;
+		}
 	}
-	std::string line;
-	if (std::getline(is, line).fail()) {
-		return input_status::end_of_file;
+
+	char *const row = buf.data() + begin;
+	const size_t length = newline - begin;
+	begin = scanned = std::min(newline + 1, end);
+	num_rows += 1;
+
+	// unescaped fields are never longer than the input, so can be written
+	// over it
+	fields.clear();
+	CSVState state = CSVState::UnquotedField;
+	char *out = row, *field = row;
+	for (size_t i = 0; i < length; i++) {
+		const char c = row[i];
+		switch (state) {
+		case CSVState::UnquotedField:
+			switch (c) {
+			case ',':
+				fields.emplace_back(field, size_t(out - field));
+				field = out;
+				break;
+			case '"':
+				state = CSVState::QuotedField;
+				break;
+			default:
+				*out++ = c;
+				break;
+			}
+			break;
+		case CSVState::QuotedField:
+			if (c == '"') {
+				state = CSVState::QuotedQuote;
+			} else {
+				*out++ = c;
+			}
+			break;
+		case CSVState::QuotedQuote:
+			switch (c) {
+			case ',':
+				fields.emplace_back(field, size_t(out - field));
+				field = out;
+				state = CSVState::UnquotedField;
+				break;
+			case '"':
+				*out++ = '"';
+				state = CSVState::QuotedField;
+				break;
+			default:
+				state = CSVState::UnquotedField;
+				break;
+			}
+			break;
+		}
 	}
-	if (is.bad()) {
-		return input_status::error;
+	fields.emplace_back(field, size_t(out - field));
+
+	return input_status::success;
+}
+
+static bool
+index_of_field(std::string_view field, size_t &index)
+{
+	// copied so size_t_of_string accepts the same as before
+	char str[32];
+	if (field.size() >= sizeof(str)) {
+		return false;
 	}
+	field.copy(str, field.size());
+	str[field.size()] = '\0';
+	return size_t_of_string(str, index);
+}
 
-	row = parse_csv_row(line);
+input_status
+csv_reader::next_pair(size_t &first, size_t &second)
+{
+	const auto status = next_row(pair_fields);
+	if (status != input_status::success) {
+		return status;
+	}
 
+	if (pair_fields.size() < 2) {
+		LOG(FATAL) << "CSV row " << num_rows << " does not contain two fields\n";
+		return input_status::error;
+	}
+	if (!index_of_field(pair_fields[0], first)) {
+		LOG(FATAL)
+			<< "CSV row " << num_rows << " first value ("
+			<< pair_fields[0] << ") is not a valid shape index\n";
+		return input_status::error;
+	}
+	if (!index_of_field(pair_fields[1], second)) {
+		LOG(FATAL)
+			<< "CSV row " << num_rows << " second value ("
+			<< pair_fields[1] << ") is not a valid shape index\n";
+		return input_status::error;
+	}
 	return input_status::success;
 }
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("csv_reader") {
+	// a tiny block to exercise rows spanning reads and growing the buffer
+	std::stringstream in{
+		"1,2,touch\n"
+		"\"3\",4\n"
+		"\n"
+		"a long row,\"with \"\"quotes\"\"\", and, more fields\n"
+		"5,6"};
+	csv_reader reader{in, 4};
+	std::vector<std::string_view> fields;
+
+	REQUIRE(reader.next_row(fields) == input_status::success);
+	CHECK(vectors_eq<std::string_view>(fields, {"1", "2", "touch"}));
+	REQUIRE(reader.next_row(fields) == input_status::success);
+	CHECK(vectors_eq<std::string_view>(fields, {"3", "4"}));
+	REQUIRE(reader.next_row(fields) == input_status::success);
+	CHECK(vectors_eq<std::string_view>(fields, {""}));
+	REQUIRE(reader.next_row(fields) == input_status::success);
+	CHECK(vectors_eq<std::string_view>(fields, {"a long row", "with \"quotes\"", " and", " more fields"}));
+	REQUIRE(reader.next_row(fields) == input_status::success);
+	CHECK(vectors_eq<std::string_view>(fields, {"5", "6"}));
+	CHECK(reader.row_number() == 5);
+	CHECK(reader.next_row(fields) == input_status::end_of_file);
+	CHECK(reader.next_row(fields) == input_status::end_of_file);
+
+	SECTION("pairs") {
+		std::stringstream pairs{"1,2,touch\n3,4,overlap,0.5\n5\n"};
+		csv_reader pair_reader{pairs};
+		size_t first, second;
+		REQUIRE(pair_reader.next_pair(first, second) == input_status::success);
+		CHECK((first == 1 && second == 2));
+		REQUIRE(pair_reader.next_pair(first, second) == input_status::success);
+		CHECK((first == 3 && second == 4));
+		CHECK(pair_reader.next_pair(first, second) == input_status::error);
+		CHECK(pair_reader.next_pair(first, second) == input_status::end_of_file);
+
+		std::stringstream invalid{"1,-2\n"};
+		csv_reader invalid_reader{invalid};
+		CHECK(invalid_reader.next_pair(first, second) == input_status::error);
+	}
+}
+#endif
+
+csv_writer::csv_writer(
+	std::ostream &os, size_t flush_bytes, clock::duration flush_interval) :
+	os{os}, flush_bytes{flush_bytes}, flush_interval{flush_interval}
+{
+	buf.reserve(flush_bytes + 256);
+	flusher = std::thread{[this]() { flush_when_due(); }};
+}
+
+csv_writer::~csv_writer()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopping = true;
+	}
+	cond.notify_one();
+	flusher.join();
+	flush();
+}
+
+csv_writer &
+csv_writer::field(std::string_view value)
+{
+	if (in_row) {
+		row.push_back(',');
+	}
+	row.append(value);
+	in_row = true;
+	return *this;
+}
+
+csv_writer &
+csv_writer::field(size_t value)
+{
+	char str[24];
+	const auto res = std::to_chars(str, str + sizeof(str), value);
+	return field(std::string_view(str, size_t(res.ptr - str)));
+}
+
+csv_writer &
+csv_writer::field(double value, int digits)
+{
+	char str[64];
+	const int n = std::snprintf(str, sizeof(str), "%.*f", digits, value);
+	if (n >= 0 && size_t(n) < sizeof(str)) {
+		return field(std::string_view(str, size_t(n)));
+	}
+
+	// very large values
+	std::string big(size_t(std::max(n, 0)) + 1, '\0');
+	std::snprintf(big.data(), big.size(), "%.*f", digits, value);
+	big.pop_back();
+	return field(big);
+}
+
+void
+csv_writer::end_row()
+{
+	row.push_back('\n');
+	in_row = false;
+
+	std::lock_guard<std::mutex> lock{mutex};
+	buf.append(row);
+	row.clear();
+	if (buf.size() >= flush_bytes) {
+		write_out();
+	}
+}
+
+void
+csv_writer::flush()
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	write_out();
+	os.flush();
+}
+
+// called with mutex held
+void
+csv_writer::write_out()
+{
+	if (!buf.empty()) {
+		os.write(buf.data(), std::streamsize(buf.size()));
+		os.flush();
+		buf.clear();
+	}
+}
+
+void
+csv_writer::flush_when_due()
+{
+	// rows wait at most flush_interval, even if no more are coming
+	std::unique_lock<std::mutex> lock{mutex};
+	while (!stopping) {
+		cond.wait_for(lock, flush_interval);
+		write_out();
+	}
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("csv_writer") {
+	std::stringstream out;
+	{
+		// only flushed once the buffer is full, or when destroyed
+		csv_writer writer{out, 16, std::chrono::hours{1}};
+		writer.field(size_t{1}).field(size_t{23}).field("touch").end_row();
+		CHECK(out.str().empty());
+		writer.field(size_t{4}).field(size_t{5}).field("overlap").field(0.125, 2).field(1e3, 1).end_row();
+		CHECK(out.str() == "1,23,touch\n4,5,overlap,0.12,1000.0\n");
+		writer.field("").field("b").end_row();
+		CHECK(out.str().size() == 35);
+	}
+	CHECK(out.str() == "1,23,touch\n4,5,overlap,0.12,1000.0\n,b\n");
+
+	// written after the interval, without waiting for another row
+	std::stringstream timed;
+	csv_writer writer{timed, 1024, std::chrono::milliseconds{10}};
+	writer.field(size_t{1}).field(size_t{2}).field("touch").end_row();
+	std::this_thread::sleep_for(std::chrono::milliseconds{200});
+	CHECK(timed.str() == "1,2,touch\n");
+}
+#endif
+
+temp_file::temp_file(const char *prefix)
+{
+	std::string path = std::string{"/tmp/"} + prefix + "_XXXXXX";
+	const int fd = mkstemp(path.data());
+	if (fd < 0) {
+		throw std::runtime_error("unable to create temporary file");
+	}
+	close(fd);
+	name = std::move(path);
+}
+
+temp_file::~temp_file()
+{
+	unlink(name.c_str());
+}
+
+#ifdef INCLUDE_TESTS
+TEST_CASE("temp_file") {
+	std::string path;
+	{
+		temp_file file{"temp_file_test"};
+		path = file.path();
+		CHECK(path.rfind("/tmp/temp_file_test_", 0) == 0);
+		CHECK(access(file.path(), F_OK) == 0);
+	}
+	CHECK(access(path.c_str(), F_OK) != 0);
+}
+#endif
@@ -1,13 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <istream>
+#include <ostream>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <cxx_argp_parser.h>
 
+#include "profiling.hpp"
+
 
 class tool_argp_parser : public cxx_argp::parser {
 public:
 	tool_argp_parser(size_t expected_args = 0);
+
+	// the usual -j option, leaving N blank will use all cores
+	void add_jobs_option(unsigned &num_parallel_jobs);
+
+	// --profile and --trace-file, enabling profiling when either is given
+	void add_profile_options(profile_writer &writer);
+
+	// --distance-prefilter[=T], enabling the prefilter and setting its time
+	// limit per pair when T is given
+	void add_distance_prefilter_option(bool &enabled, unsigned &time_millisecs);
+
+private:
+	// argp only keeps pointers to help text
+	std::deque<std::string> help_text;
 };
 
 
@@ -15,11 +43,143 @@ void configure_aixlog();
 
 std::string indexpair_to_string(size_t left, size_t right);
 
+// avoids formatting messages nobody will see in hot loops
+bool debug_logging_enabled();
+
 bool int_of_string (const char *s, int &i, int base=0);
 bool size_t_of_string (const char *s, size_t &i, int base=0);
 
+// decimal number of bytes with an optional K, M, G or T suffix, each a power
+// of 1024
+bool bytes_of_string(const char *s, size_t &bytes);
+
 bool are_vals_close(double a, double b, double drel=1e-10, double dabs=1e-13);
 
+// deterministically split items into num_shards groups of similar total
+// cost, returning the shard each item was assigned to
+std::vector<size_t> partition_by_cost(const std::vector<double> &costs, size_t num_shards);
+
+// splits pairs into batches where no index appears twice within a batch, so
+// each batch can be processed in parallel. pairs sharing an index are kept in
+// their original order, i.e. processing batches in order gives the same
+// result as processing the pairs serially. returns the batch of each pair
+std::vector<size_t> batch_independent_pairs(
+	const std::vector<std::pair<size_t, size_t>> &pairs);
+
+// groups indices joined by pairs, each component is sorted and components
+// are ordered by their smallest index. indices not in any pair are ignored
+std::vector<std::vector<size_t>> connected_components(
+	const std::vector<std::pair<size_t, size_t>> &pairs);
+
+/* hands out pairs once every earlier pair sharing an index with them is
+ * finished, so processing pairs as they're handed out gives the same result
+ * as processing them serially, like batch_independent_pairs. the difference
+ * is that it's not known up front whether each pair needs processing, so
+ * pairs are resolved as wanted or skipped as that's found out. unresolved
+ * pairs hold up any later pairs they share an index with.
+ */
+class pair_sequencer {
+	enum class state { unresolved, wanted, skipped, running, finished };
+
+	const std::vector<std::pair<size_t, size_t>> &pairs;
+	std::vector<state> states;
+
+	// pairs using each index in order, and the first that isn't done with
+	struct queue {
+		std::vector<size_t> pairs;
+		size_t head = 0;
+	};
+	std::unordered_map<size_t, queue> queues;
+
+	size_t num_done;
+
+	bool is_next(size_t index, size_t pair) const;
+	void start_if_ready(size_t pair, std::vector<size_t> &ready);
+	void advance(size_t index, std::vector<size_t> &ready);
+
+public:
+	explicit pair_sequencer(const std::vector<std::pair<size_t, size_t>> &pairs);
+
+	// both return pairs that can now be started, in increasing order
+	std::vector<size_t> resolve(size_t pair, bool wanted);
+	std::vector<size_t> finish(size_t pair);
+
+	// pairs that have been skipped or finished
+	size_t num_completed() const {
+		return num_done;
+	}
+
+	bool done() const {
+		return num_done == pairs.size();
+	}
+};
+
+/* holds back items whose estimated size would take the total in flight over
+ * a budget. items are started in the order given where they fit, otherwise
+ * items from the end of the order fill any gap, so the order should be
+ * largest first. an item is always started when nothing else is in flight,
+ * so items larger than the budget still run. a budget of zero admits
+ * everything.
+ */
+class admission_queue {
+	std::deque<size_t> pending;
+	const std::vector<double> &sizes;
+	double budget;
+
+	double in_flight_size = 0;
+	size_t num_in_flight = 0;
+
+	bool fits(size_t item) const;
+
+public:
+	admission_queue(
+		const std::vector<size_t> &order, const std::vector<double> &sizes, double budget);
+
+	// items that can now be started
+	std::vector<size_t> admit();
+	void finished(size_t item);
+
+	bool empty() const {
+		return pending.empty() && num_in_flight == 0;
+	}
+
+	// items not yet admitted
+	size_t num_pending() const {
+		return pending.size();
+	}
+};
+
+/* learns which of a list of tolerances is most likely to succeed for each
+ * kind of pair, so the first attempt doesn't keep failing when a later
+ * tolerance would work. kinds are chosen by the caller, e.g. from the surface
+ * types of both solids. kinds with few results lean on what's been seen
+ * across all kinds. tolerances stay in the order given unless a later one is
+ * clearly more likely to succeed. safe to use from multiple threads
+ */
+class tolerance_learner {
+	struct counts {
+		std::vector<unsigned long> tries, successes;
+	};
+
+	const size_t num_tolerances;
+	mutable std::mutex mutex;
+	counts overall;
+	std::unordered_map<uint32_t, counts> by_kind;
+
+	counts &counts_of(uint32_t kind);
+
+public:
+	explicit tolerance_learner(size_t num_tolerances);
+
+	// indices of tolerances in the order they should be tried
+	std::vector<size_t> order(uint32_t kind) const;
+
+	void record(uint32_t kind, size_t tolerance, bool succeeded);
+};
+
+// 64bit FNV-1a, not cryptographic but stable across runs and platforms
+uint64_t hash_of_string(std::string_view str, uint64_t hash=14695981039346656037ull);
+
 enum class input_status {
 	error,
 
@@ -30,4 +190,93 @@ enum class input_status {
 
 std::vector<std::string> parse_csv_row(const std::string &row);
 
-input_status parse_next_row(std::istream &is, std::vector<std::string> &row);
+/* reads CSV a block at a time, parsing rows in place. fields refer to the
+ * reader's buffer, so are only valid until the next call. rows are split and
+ * quotes handled the same as parse_csv_row
+ */
+class csv_reader {
+	std::istream &is;
+	std::vector<char> buf;
+	// unparsed input is [begin, end), none of [begin, scanned) is a newline
+	size_t begin = 0, scanned = 0, end = 0;
+	bool at_eof = false;
+	unsigned long num_rows = 0;
+	std::vector<std::string_view> pair_fields;
+
+	bool fill();
+
+public:
+	explicit csv_reader(std::istream &is, size_t block_size = 64 * 1024);
+
+	input_status next_row(std::vector<std::string_view> &fields);
+
+	// rows starting with two solid indices, e.g. from overlap_checker. later
+	// fields are ignored, malformed rows are logged and reported as an error
+	input_status next_pair(size_t &first, size_t &second);
+
+	// of the last row read, from one
+	unsigned long row_number() const { return num_rows; }
+};
+
+/* appends CSV rows to a buffer, writing them out once it gets large, or
+ * from a thread every flush_interval, rather than flushing after every row.
+ * rows still get written while nothing new is coming, e.g. while a slow
+ * pair is checked, so little is lost if the process is killed or aborts.
+ * fields aren't quoted. whatever is left is flushed when destroyed
+ */
+class csv_writer {
+	using clock = std::chrono::steady_clock;
+
+	std::ostream &os;
+
+	// the row being built, only touched by the caller's thread
+	std::string row;
+	bool in_row = false;
+
+	// complete rows, shared with the flusher
+	std::string buf;
+	const size_t flush_bytes;
+	const clock::duration flush_interval;
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::thread flusher;
+
+	void write_out();
+	void flush_when_due();
+
+public:
+	explicit csv_writer(
+		std::ostream &os, size_t flush_bytes = 64 * 1024,
+		clock::duration flush_interval = std::chrono::seconds{1});
+	~csv_writer();
+
+	csv_writer(const csv_writer &) = delete;
+	csv_writer& operator=(const csv_writer &) = delete;
+
+	csv_writer &field(std::string_view value);
+	csv_writer &field(size_t value);
+	// fixed point, with digits after the decimal point
+	csv_writer &field(double value, int digits);
+
+	// ends the row, and writes out the buffer if it's full
+	void end_row();
+
+	void flush();
+};
+
+/* an empty file in /tmp whose name starts with prefix, e.g. for tests,
+ * removed again when destroyed
+ */
+class temp_file {
+	std::string name;
+
+public:
+	explicit temp_file(const char *prefix);
+	~temp_file();
+
+	temp_file(const temp_file &) = delete;
+	temp_file& operator=(const temp_file &) = delete;
+
+	const char *path() const { return name.c_str(); }
+};
@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""Time each tool over generated models and compare against a baseline.
+
+Models come from make_benchmark, and are the awkward cases described in
+ARCHITECTURE.md: grids of touching cubes, nested shells, and tori around
+cylinders. Each tool is run with --profile so its phases, throughput and peak
+memory can be recorded. Results are compared to those in the baseline file,
+which is written if it doesn't exist yet, or with --update-baseline.
+
+Run from the build directory, e.g. with `make bench`.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+# (name, make_benchmark model, extra arguments), from hundreds to tens of
+# thousands of solids
+SCALES = {
+    "small": [
+        ("grid", "grid:20x20", []),
+        ("grid-overlap", "grid:20x20", ["--overlap=0.005"]),
+        ("nested", "nested:40x5", []),
+        ("tori", "tori:100", []),
+    ],
+    "medium": [
+        ("grid", "grid:50x50", []),
+        ("grid-overlap", "grid:50x50", ["--overlap=0.005"]),
+        ("nested", "nested:200x5", []),
+        ("tori", "tori:1000", []),
+    ],
+    "large": [
+        ("grid", "grid:150x150", []),
+        ("grid-overlap", "grid:150x150", ["--overlap=0.005"]),
+        ("nested", "nested:2000x5", []),
+        ("tori", "tori:10000", []),
+    ],
+}
+
+# phases whose count is the number of pairs handled by each tool, for
+# reporting throughput
+PAIR_PHASES = {
+    "overlap_checker": "classify pair",
+    "imprint_solids": "imprint pave",
+    "merge_solids": None,
+}
+
+
+def run_tool(bin_dir, work_dir, tool, args, stdin=None, stdout=None):
+    profile = os.path.join(work_dir, f"{tool}-{os.getpid()}.json")
+    cmd = [os.path.join(bin_dir, tool), "-q", f"--profile={profile}"] + args
+
+    start = time.monotonic()
+    proc = subprocess.run(cmd, stdin=stdin, stdout=stdout)
+    elapsed = time.monotonic() - start
+
+    if proc.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} exited with status {proc.returncode}")
+
+    with open(profile) as fd:
+        summary = json.load(fd)
+    os.remove(profile)
+
+    result = {
+        "wall_seconds": elapsed,
+        "peak_rss_bytes": max(summary["peak_rss_bytes"], summary["peak_child_rss_bytes"]),
+        "phases": {
+            name: phase["total_seconds"] for name, phase in summary["phases"].items()
+        },
+    }
+
+    pair_phase = PAIR_PHASES.get(tool)
+    if pair_phase and pair_phase in summary["phases"]:
+        num_pairs = summary["phases"][pair_phase]["count"]
+        result["pairs"] = num_pairs
+        result["pairs_per_second"] = num_pairs / elapsed if elapsed > 0 else 0
+    return result
+
+
+def run_case(bin_dir, work_dir, jobs, name, model, extra):
+    base = os.path.join(work_dir, name)
+    brep, csv = f"{base}.brep", f"{base}.csv"
+    jobs_arg = f"-j{jobs}"
+
+    subprocess.run(
+        [os.path.join(bin_dir, "make_benchmark"), "-q", jobs_arg] + extra + [model, brep],
+        check=True,
+    )
+
+    results = {}
+    with open(csv, "w") as out:
+        results["overlap_checker"] = run_tool(
+            bin_dir, work_dir, "overlap_checker", [jobs_arg, brep], stdout=out
+        )
+    with open(csv) as inp:
+        results["imprint_solids"] = run_tool(
+            bin_dir, work_dir, "imprint_solids",
+            [jobs_arg, brep, f"{base}-imprinted.brep"], stdin=inp,
+        )
+    results["merge_solids"] = run_tool(
+        bin_dir, work_dir, "merge_solids",
+        [jobs_arg, f"{base}-imprinted.brep", f"{base}-merged.brep"],
+    )
+    return results
+
+
+def compare(baseline, results, tolerance):
+    """returns descriptions of anything slower, using more memory, or with
+    lower throughput than the baseline by more than tolerance"""
+    regressions = []
+    for case, tools in results.items():
+        for tool, result in tools.items():
+            old = baseline.get(case, {}).get(tool)
+            if old is None:
+                continue
+
+            def check(key, worse):
+                if key in old and key in result and worse(result[key], old[key]):
+                    regressions.append(
+                        f"{case} {tool} {key}: {result[key]:.4g} vs baseline {old[key]:.4g}"
+                    )
+
+            check("wall_seconds", lambda new, old: new > old * (1 + tolerance))
+            check("peak_rss_bytes", lambda new, old: new > old * (1 + tolerance))
+            check("pairs_per_second", lambda new, old: new < old / (1 + tolerance))
+    return regressions
+
+
+def print_results(results):
+    print(f"{'case':<24} {'tool':<16} {'seconds':>9} {'peak MiB':>9} {'pairs/s':>9}")
+    for case, tools in results.items():
+        for tool, result in tools.items():
+            pps = result.get("pairs_per_second")
+            print(
+                f"{case:<24} {tool:<16} {result['wall_seconds']:>9.2f} "
+                f"{result['peak_rss_bytes'] / (1 << 20):>9.1f} "
+                f"{'-' if pps is None else format(pps, '.1f'):>9}"
+            )
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--scale", choices=SCALES.keys(), default="small")
+    parser.add_argument("--jobs", "-j", type=int, default=os.cpu_count())
+    parser.add_argument("--bin-dir", default=".", help="where the tools were built")
+    parser.add_argument("--work-dir", default="benchmark", help="where models and outputs are written")
+    parser.add_argument("--baseline", default="benchmark-baseline.json")
+    parser.add_argument("--update-baseline", action="store_true")
+    parser.add_argument(
+        "--tolerance", type=float, default=0.2,
+        help="relative change allowed before reporting a regression",
+    )
+    parser.add_argument("--output", help="also write results as JSON to this file")
+    args = parser.parse_args()
+
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    # baselines for each scale and job count are kept separately
+    key = f"{args.scale}-j{args.jobs}"
+    results = {}
+    for name, model, extra in SCALES[args.scale]:
+        print(f"running {name} ({model})", file=sys.stderr)
+        results[f"{key}/{name}"] = run_case(
+            args.bin_dir, args.work_dir, args.jobs, name, model, extra
+        )
+
+    print_results(results)
+
+    if args.output:
+        with open(args.output, "w") as fd:
+            json.dump(results, fd, indent=2)
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as fd:
+            baseline = json.load(fd)
+
+    regressions = []
+    if args.update_baseline or not any(case in baseline for case in results):
+        baseline.update(results)
+        with open(args.baseline, "w") as fd:
+            json.dump(baseline, fd, indent=2, sort_keys=True)
+        print(f"wrote baseline to {args.baseline}", file=sys.stderr)
+    else:
+        regressions = compare(baseline, results, args.tolerance)
+
+    for line in regressions:
+        print(f"regression: {line}", file=sys.stderr)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
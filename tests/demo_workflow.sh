@@ -27,13 +27,84 @@ echo "checking for intersecting solids" 1>&2
 
 overlap_checker -j1 "$brep" > "$overlaps"
 
+echo "checking saved solid properties give the same result" 1>&2
+test -f "$brep.props"
+cp "$brep" "$base-noprops.brep"
+overlap_checker -j1 "$base-noprops.brep" | diff - "$overlaps"
+
+echo "checking splitting pairs by face gives the same result" 1>&2
+overlap_checker -j2 --split-faces=1 "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking hybrid parallelism gives the same result" 1>&2
+overlap_checker -j2 --hybrid-parallel "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking resuming from a partial checkpoint gives the same result" 1>&2
+checkpoint="$base-checkpoint.csv"
+overlap_checker -j2 --checkpoint="$checkpoint" "$brep" > /dev/null
+head -n 3 "$checkpoint" > "$checkpoint.partial"
+mv "$checkpoint.partial" "$checkpoint"
+overlap_checker -j2 --checkpoint="$checkpoint" --resume "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking cached contexts give the same result" 1>&2
+overlap_checker -j2 --context-cache=64M "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking adaptive tolerances give the same result" 1>&2
+overlap_checker -j2 --adaptive-tolerance "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking fast classification gives the same result" 1>&2
+overlap_checker -j1 --fast-classification "$brep" | diff - "$overlaps"
+
+echo "checking isolated worker processes give the same result" 1>&2
+overlap_checker -j2 --isolate "$brep" | sort | diff - <(sort "$overlaps")
+
+echo "checking profiling output is written" 1>&2
+overlap_checker -j2 --profile="$base-profile.json" --trace-file="$base-trace.json" "$brep" > /dev/null
+grep -q '"pave"' "$base-profile.json"
+grep -q '"ph": "X"' "$base-trace.json"
+
+echo "checking approximate mode agrees there are no bad overlaps" 1>&2
+overlap_checker -j2 --approximate "$brep" > /dev/null
+
+echo "checking indexed brep files give the same result" 1>&2
+step_to_brep "$source" "$base.bbrep" > /dev/null
+overlap_checker -j1 "$base.bbrep" | sort > "$base-overlaps-indexed.csv"
+sort "$overlaps" | diff - "$base-overlaps-indexed.csv"
+
 if grep -q overlap "$overlaps"; then
     echo "writing overlapping solds into $common" 1>&2
     grep overlap "$overlaps" | overlap_collecter "$brep" "$common"
+
+    echo "checking parallel collection gives the same result" 1>&2
+    grep overlap "$overlaps" | overlap_collecter -j2 "$brep" "$base-common-j2.brep"
+    cmp "$common" "$base-common-j2.brep"
+
+    echo "checking common solids written while checking match collecting them" 1>&2
+    grep overlap "$overlaps" | sort -t, -k1,1n -k2,2n | overlap_collecter "$brep" "$base-common-sorted.brep"
+    overlap_checker -j2 --write-common="$base-common-checker.brep" "$brep" > /dev/null
+    cmp "$base-common-sorted.brep" "$base-common-checker.brep"
 fi
 
 echo "removing overlaps and writing to $imprinted" 1>&2
 imprint_solids "$brep" "$imprinted" < "$overlaps"
 
+echo "checking parallel imprinting gives the same result" 1>&2
+imprint_solids -j2 "$brep" "$base-imprinted-j2.brep" < "$overlaps"
+cmp "$imprinted" "$base-imprinted-j2.brep"
+
+echo "checking combined check and imprint matches running them separately" 1>&2
+sort -t, -k1,1n -k2,2n "$overlaps" | imprint_solids "$brep" "$base-imprinted-sorted.brep"
+check_and_imprint -j2 "$brep" "$base-imprinted-combined.brep" | sort | diff - <(sort "$overlaps")
+cmp "$base-imprinted-sorted.brep" "$base-imprinted-combined.brep"
+
+echo "checking general fuse imprinting leaves the same solids touching" 1>&2
+imprint_solids --engine=general -j2 "$brep" "$base-imprinted-general.brep" < "$overlaps"
+overlap_checker -j2 "$imprinted" | cut -d, -f1-3 | sort > "$base-imprinted-overlaps.csv"
+overlap_checker -j2 "$base-imprinted-general.brep" | cut -d, -f1-3 | sort | diff - "$base-imprinted-overlaps.csv"
+merge_solids "$base-imprinted-general.brep" "$base-merged-general.brep"
+
+echo "checking large groups fall back to pairwise imprinting" 1>&2
+imprint_solids --engine=general --max-group-size=1 "$brep" "$base-imprinted-fallback.brep" < "$overlaps"
+cmp "$imprinted" "$base-imprinted-fallback.brep"
+
 echo "merging faces, edges and verticies and writing to $merged" 1>&2
 merge_solids "$imprinted" "$merged"
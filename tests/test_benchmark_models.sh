@@ -0,0 +1,31 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# make sure the models generated for benchmarking are what tests/benchmark.py
+# expects, so a change to make_benchmark doesn't silently change the workload
+
+PATH=.:$PATH
+
+base=benchmark-models
+
+count_rows() {
+    grep -c "$1" "$2" || true
+}
+
+# each cube touches the 8 around it, giving 6 + 6 along rows and columns
+# and 8 diagonally
+make_benchmark grid:3x3 "$base-grid.brep"
+overlap_checker -j2 "$base-grid.brep" > "$base-grid.csv"
+test "$(count_rows touch "$base-grid.csv")" -eq 20
+test "$(count_rows overlap "$base-grid.csv")" -eq 0
+
+# only neighbouring shells in each group touch
+make_benchmark nested:2x3 "$base-nested.brep"
+overlap_checker -j2 "$base-nested.brep" > "$base-nested.csv"
+test "$(count_rows touch "$base-nested.csv")" -eq 4
+
+# bounding boxes overlap, but the solids don't
+make_benchmark tori:4 "$base-tori.brep"
+overlap_checker -j2 "$base-tori.brep" > "$base-tori.csv"
+test ! -s "$base-tori.csv"
@@ -8,3 +8,8 @@ set -euxo pipefail
 ./merge_solids ../data/paramak_reactor.brep merged.brep
 
 diff -u ../data/paramak_reactor-salome_glued.brep merged.brep
+
+# gluing in parallel shouldn't change anything
+./merge_solids -j4 ../data/paramak_reactor.brep merged-j4.brep
+
+diff -u ../data/paramak_reactor-salome_glued.brep merged-j4.brep
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# make sure that splitting the overlap check into shards and merging their
+# output gives the same result as a single run
+
+if [ ! -f "${1-}" ]; then
+    echo "Please pass the name of a STEP file first" 1>&2
+    exit 1
+fi
+
+PATH=.:$PATH
+
+base=sharding
+brep="$base.brep"
+
+step_to_brep "$1" "$brep" > /dev/null
+
+# rows come out as pairs complete, so put them into a consistent order
+sort_rows() {
+    sort -t, -k1,1n -k2,2n "$@"
+}
+
+overlap_checker -j2 "$brep" | sort_rows > "$base-single.csv"
+
+for k in 1 2 3; do
+    overlap_checker -j2 --shard=$k/3 "$brep" > "$base-shard$k.csv"
+done
+
+sort_rows "$base"-shard?.csv > "$base-merged.csv"
+
+diff -u "$base-single.csv" "$base-merged.csv"